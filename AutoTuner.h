@@ -0,0 +1,162 @@
+#ifndef AUTO_TUNER_H
+#define AUTO_TUNER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <limits>
+
+#include "OpenCLEngine.h"
+#include "KMeansGPUQuantization.h"
+#include "image.h"
+
+struct TuningResult
+{
+    std::string kernelFilename;
+    unsigned int localWorkSizeX;
+    unsigned int localWorkSizeY;
+    // device time of all kernels of one run, best of the repetitions
+    double milliseconds;
+};
+
+// Benchmarks every kernel file with every local size the device accepts on a sample image
+// and keeps the fastest combination. The winner is stored next to the program binaries,
+// keyed by platform, device and driver, so later runs on the same device can load it
+// instead of tuning again.
+class AutoTuner
+{
+private:
+    std::string cacheDirectory;
+    std::vector<TuningResult> results;
+
+public:
+    AutoTuner(std::string cacheDirectory = OpenCLEngine::defaultCacheDirectory()) : cacheDirectory(cacheDirectory)
+    {
+    }
+
+    static std::vector<std::string> kernelFilenames()
+    {
+        return {"atomicAddKernel.cl", "parallelReductionKernel.cl", "localHistogramKernel.cl"};
+    }
+
+    // Configuration used when nothing has been tuned for the device yet.
+    static TuningResult defaultConfiguration()
+    {
+        return {"parallelReductionKernel.cl", 32, 32, 0.0};
+    }
+
+    TuningResult tune(Image& image, unsigned int colorTableSize, unsigned int iterations, unsigned int repetitions = 3)
+    {
+        results.clear();
+        TuningResult best = defaultConfiguration();
+        best.milliseconds = std::numeric_limits<double>::max();
+        std::string deviceKey;
+
+        for(const std::string& kernelFilename : kernelFilenames())
+        {
+            OpenCLEngine engine(kernelFilename, cacheDirectory);
+            deviceKey = engine.getDeviceKey();
+            for(auto size : candidateSizes(engine, colorTableSize))
+            {
+                TuningResult result = {kernelFilename, size.first, size.second, benchmark(engine, image, colorTableSize, iterations, repetitions, size)};
+                results.push_back(result);
+                if(result.milliseconds < best.milliseconds)
+                    best = result;
+            }
+        }
+
+        if(!results.empty())
+            save(deviceKey, best);
+        return best;
+    }
+
+    const std::vector<TuningResult>& getResults() const
+    {
+        return results;
+    }
+
+    // Reads the stored winner for the device a new engine would use.
+    bool load(TuningResult& result) const
+    {
+        std::string deviceKey = OpenCLEngine::defaultDeviceKey();
+        std::string filename = OpenCLEngine::cacheFile(cacheDirectory, deviceKey, ".tuning");
+        std::ifstream file(filename);
+        std::string key;
+        if(filename.empty() || !file || !std::getline(file, key) || key != deviceKey)
+            return false;
+        return bool(file >> result.kernelFilename >> result.localWorkSizeX >> result.localWorkSizeY >> result.milliseconds);
+    }
+
+    // The stored winner, or the default configuration.
+    TuningResult loadOrDefault() const
+    {
+        TuningResult result;
+        if(!load(result))
+            result = defaultConfiguration();
+        return result;
+    }
+
+private:
+    // Power of two local sizes within the device limits; the reduction kernels need power of
+    // two groups and their local memory has to fit.
+    std::vector<std::pair<unsigned int, unsigned int> > candidateSizes(const OpenCLEngine& engine, unsigned int colorTableSize)
+    {
+        std::vector<std::pair<unsigned int, unsigned int> > sizes;
+        size_t maxWorkGroupSize = engine.getMaxWorkGroupSize();
+        std::vector<size_t> maxWorkItemSizes = engine.getMaxWorkItemSizes();
+        cl_ulong localMemorySize = engine.getLocalMemorySize();
+        OpenCLEngine::AccumulationStrategy strategy = engine.getAccumulationStrategy();
+
+        if(strategy == OpenCLEngine::LocalHistogram && (4*colorTableSize + 2)*sizeof(cl_uint) > localMemorySize)
+            return sizes;
+
+        for(unsigned int x = 4; x <= 256; x *= 2)
+        {
+            for(unsigned int y = 1; y <= 32; y *= 2)
+            {
+                if(x * y < 32 || x * y > maxWorkGroupSize)
+                    continue;
+                if(maxWorkItemSizes.size() > 1 && (x > maxWorkItemSizes[0] || y > maxWorkItemSizes[1]))
+                    continue;
+                if(strategy == OpenCLEngine::GroupReduction && 4*x*y*sizeof(cl_uint) > localMemorySize)
+                    continue;
+                sizes.push_back(std::make_pair(x, y));
+            }
+        }
+        return sizes;
+    }
+
+    double benchmark(OpenCLEngine& engine, Image& image, unsigned int colorTableSize, unsigned int iterations, unsigned int repetitions,
+        std::pair<unsigned int, unsigned int> size)
+    {
+        Image output = createBlankImage(image.details.width, image.details.height);
+        double best = std::numeric_limits<double>::max();
+
+        // the first run also grows the engine buffers, so it does not count
+        for(unsigned int repetition = 0; repetition <= repetitions; repetition++)
+        {
+            KMeansGPUQuantization quantizer(&engine, &image, &output, colorTableSize, size.first, size.second);
+            quantizer.init();
+            quantizer.runIterations(iterations);
+            quantizer.finalize();
+            double milliseconds = quantizer.getAccumulateKernelTime() + quantizer.getPartitionKernelTime() + quantizer.getQuantizeKernelTime();
+            if(repetition > 0)
+                best = std::min(best, milliseconds);
+        }
+        return best;
+    }
+
+    void save(const std::string& deviceKey, const TuningResult& result)
+    {
+        std::string filename = OpenCLEngine::cacheFile(cacheDirectory, deviceKey, ".tuning");
+        if(filename.empty())
+            return;
+
+        std::error_code error;
+        std::filesystem::create_directories(cacheDirectory, error);
+        std::ofstream file(filename);
+        file<<deviceKey<<"\n"<<result.kernelFilename<<" "<<result.localWorkSizeX<<" "<<result.localWorkSizeY<<" "<<result.milliseconds<<"\n";
+    }
+};
+
+#endif // AUTO_TUNER_H
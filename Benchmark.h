@@ -0,0 +1,221 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <map>
+
+#include "image.h"
+
+// One point of a benchmark sweep.
+struct BenchmarkCase
+{
+    std::string backend;
+    unsigned int width;
+    unsigned int height;
+    unsigned int colors;
+    unsigned int iterations;
+};
+
+// Timings of the repetitions of one case, without the warm-up runs. Throughput is
+// width * height * iterations pixels per median run, in megapixels per second.
+struct BenchmarkResult
+{
+    BenchmarkCase benchmarkCase;
+    std::vector<double> milliseconds;
+    double minimum;
+    double maximum;
+    double mean;
+    double median;
+    double deviation;
+    double megapixelsPerSecond;
+};
+
+class Benchmark
+{
+public:
+    // Runs warmup + repetitions times and keeps the timings of the last repetitions. Every run
+    // calls prepare() untimed, then times the work it returned.
+    static BenchmarkResult run(const BenchmarkCase& benchmarkCase, unsigned int warmup, unsigned int repetitions,
+        std::function<std::function<void()>()> prepare)
+    {
+        std::vector<double> milliseconds;
+        for(unsigned int r = 0; r < warmup + repetitions; r++)
+        {
+            std::function<void()> f = prepare();
+
+            auto start = std::chrono::high_resolution_clock::now();
+            f();
+            auto finish = std::chrono::high_resolution_clock::now();
+
+            if(r >= warmup)
+                milliseconds.push_back(std::chrono::duration<double, std::milli>(finish - start).count());
+        }
+        return summarize(benchmarkCase, milliseconds);
+    }
+
+    static BenchmarkResult summarize(const BenchmarkCase& benchmarkCase, const std::vector<double>& milliseconds)
+    {
+        BenchmarkResult result = BenchmarkResult();
+        result.benchmarkCase = benchmarkCase;
+        result.milliseconds = milliseconds;
+        if(milliseconds.empty())
+            return result;
+
+        std::vector<double> sorted = milliseconds;
+        std::sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+        result.minimum = sorted.front();
+        result.maximum = sorted.back();
+        result.median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+        for(double value : sorted)
+            result.mean += value;
+        result.mean /= n;
+        for(double value : sorted)
+            result.deviation += (value - result.mean) * (value - result.mean);
+        result.deviation = n > 1 ? std::sqrt(result.deviation / (n - 1)) : 0.0;
+
+        double pixels = (double)benchmarkCase.width * benchmarkCase.height * std::max(1u, benchmarkCase.iterations);
+        result.megapixelsPerSecond = result.median > 0 ? pixels / (result.median * 1000.0) : 0.0;
+        return result;
+    }
+
+    // Reproducible test image: smooth gradients with noise, so there are many distinct colors
+    // and the clusters are not trivially separated.
+    static Image syntheticImage(unsigned int width, unsigned int height, unsigned int seed = 1)
+    {
+        Image image = createBlankImage(width, height);
+        std::mt19937 generator(seed);
+        std::uniform_int_distribution<int> noise(-24, 24);
+        for(unsigned int y = 0; y < height; y++)
+        for(unsigned int x = 0; x < width; x++)
+        {
+            unsigned char* px = &image.data[4 * ((size_t)y * width + x)];
+            int base[3] = {(int)(255 * x / std::max(1u, width - 1)), (int)(255 * y / std::max(1u, height - 1)),
+                (int)(255 * ((x + y) % 256) / 255)};
+            for(int c = 0; c < 3; c++)
+                px[c] = std::min(255, std::max(0, base[c] + noise(generator)));
+            px[3] = 255;
+        }
+        return image;
+    }
+
+    static void writeCsv(std::ostream& out, const std::vector<BenchmarkResult>& results)
+    {
+        out<<"backend,width,height,colors,iterations,repetitions,min_ms,max_ms,mean_ms,median_ms,stddev_ms,mpixels_per_s"<<std::endl;
+        out<<std::fixed<<std::setprecision(3);
+        for(const BenchmarkResult& result : results)
+        {
+            const BenchmarkCase& c = result.benchmarkCase;
+            out<<c.backend<<","<<c.width<<","<<c.height<<","<<c.colors<<","<<c.iterations<<","<<result.milliseconds.size()<<","
+                <<result.minimum<<","<<result.maximum<<","<<result.mean<<","<<result.median<<","<<result.deviation<<","
+                <<result.megapixelsPerSecond<<std::endl;
+        }
+    }
+
+    // context holds name/value pairs describing the run, e.g. the OpenCL device.
+    static void writeJson(std::ostream& out, const std::vector<BenchmarkResult>& results,
+        const std::vector<std::pair<std::string, std::string> >& context)
+    {
+        out<<std::fixed<<std::setprecision(3);
+        out<<"{"<<std::endl<<"  \"context\": {";
+        for(size_t i = 0; i < context.size(); i++)
+            out<<(i ? ", " : "")<<quote(context[i].first)<<": "<<quote(context[i].second);
+        out<<"},"<<std::endl<<"  \"benchmarks\": ["<<std::endl;
+        for(size_t r = 0; r < results.size(); r++)
+        {
+            const BenchmarkResult& result = results[r];
+            const BenchmarkCase& c = result.benchmarkCase;
+            out<<"    {\"backend\": "<<quote(c.backend)<<", \"width\": "<<c.width<<", \"height\": "<<c.height
+                <<", \"colors\": "<<c.colors<<", \"iterations\": "<<c.iterations<<", \"repetitions\": "<<result.milliseconds.size()
+                <<", \"min_ms\": "<<result.minimum<<", \"max_ms\": "<<result.maximum<<", \"mean_ms\": "<<result.mean
+                <<", \"median_ms\": "<<result.median<<", \"stddev_ms\": "<<result.deviation
+                <<", \"mpixels_per_s\": "<<result.megapixelsPerSecond<<"}"<<(r + 1 < results.size() ? "," : "")<<std::endl;
+        }
+        out<<"  ]"<<std::endl<<"}"<<std::endl;
+    }
+
+private:
+    static std::string quote(const std::string& value)
+    {
+        std::string quoted = "\"";
+        for(char c : value)
+        {
+            if(c == '"' || c == '\\')
+                quoted += '\\';
+            if((unsigned char)c >= 0x20)
+                quoted += c;
+        }
+        return quoted + "\"";
+    }
+};
+
+// Step timings of one command line run, e.g. init, every iteration and finalize of each
+// quantizer. time() runs a step, prints "<title> : <ms> ms;" and keeps the time under the
+// title; results() summarizes every title like a benchmark case, a step repeated under one
+// title (every iteration) giving the repetitions. Each step counts as one pass over the
+// image of the case set last, width and height 0 when the run did not set one.
+class BenchmarkLog
+{
+private:
+    std::ostream* out;
+    BenchmarkCase currentCase;
+    std::vector<BenchmarkCase> cases;
+    std::vector<std::vector<double> > milliseconds;
+    std::map<std::string, size_t> titles;
+
+public:
+    BenchmarkLog(std::ostream* out) : out(out), currentCase{"", 0, 0, 0, 1}
+    {
+    }
+
+    // image size and palette of the steps that follow
+    void setCase(unsigned int width, unsigned int height, unsigned int colors)
+    {
+        currentCase.width = width;
+        currentCase.height = height;
+        currentCase.colors = colors;
+    }
+
+    double time(const std::string& title, std::function<void()> f)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto finish = std::chrono::high_resolution_clock::now();
+        double elapsed = std::chrono::duration<double, std::milli>(finish - start).count();
+        if(out)
+            *out<<std::setw(32)<<title<<" : "<<std::setw(13)<<std::fixed<<std::setprecision(2)<<elapsed<<" ms;"<<std::endl;
+
+        // titles are padded to line up on the console
+        std::string name = title.substr(0, title.find_last_not_of(' ') + 1);
+        auto found = titles.find(name);
+        if(found == titles.end())
+        {
+            found = titles.insert(std::make_pair(name, cases.size())).first;
+            cases.push_back(currentCase);
+            cases.back().backend = name;
+            milliseconds.push_back(std::vector<double>());
+        }
+        milliseconds[found->second].push_back(elapsed);
+        return elapsed;
+    }
+
+    // in the order the titles first appeared
+    std::vector<BenchmarkResult> results() const
+    {
+        std::vector<BenchmarkResult> summaries;
+        for(size_t i = 0; i < cases.size(); i++)
+            summaries.push_back(Benchmark::summarize(cases[i], milliseconds[i]));
+        return summaries;
+    }
+};
+
+#endif // BENCHMARK_H
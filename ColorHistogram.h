@@ -0,0 +1,136 @@
+#ifndef COLOR_HISTOGRAM_H
+#define COLOR_HISTOGRAM_H
+
+#include <vector>
+
+#include "PixelLayout.h"
+
+// Table of the distinct colors of an image with their pixel counts and channel sums.
+// Exact mode keeps every RGB triple (the color -> entry map then takes 64 MB); the binned
+// modes merge colors sharing the top 6 or 5 bits per channel and represent each bin by the
+// mean of its pixels. Channel sums are exact in every mode, so accumulating entries gives
+// the same totals as accumulating the pixels they stand for.
+class ColorHistogram
+{
+public:
+    enum Mode { Disabled, Exact, Binned6, Binned5 };
+
+private:
+    unsigned int bits;
+    std::vector<unsigned int> cellToEntry;
+    std::vector<unsigned char> colors;
+    std::vector<unsigned int> counts;
+    std::vector<unsigned long long> sums;
+
+public:
+    ColorHistogram() : bits(8)
+    {
+    }
+
+    static unsigned int bitsPerChannel(Mode mode)
+    {
+        switch(mode)
+        {
+        case Binned6:
+            return 6;
+        case Binned5:
+            return 5;
+        default:
+            return 8;
+        }
+    }
+
+    template<class Layout>
+    void build(const unsigned char* pixels, size_t pixelsNumber, Mode mode)
+    {
+        bits = bitsPerChannel(mode);
+        bool binned = bits < 8;
+
+        std::vector<unsigned int>& cellCounts = cellToEntry;
+        cellCounts.assign(1u << (3 * bits), 0);
+        std::vector<unsigned long long> cellSums;
+        if(binned)
+            cellSums.assign(3 * cellCounts.size(), 0);
+
+        for(size_t p = 0; p < pixelsNumber; p++)
+        {
+            unsigned char px[3];
+            Layout::read(pixels + Layout::stride * p, px[0], px[1], px[2]);
+            unsigned int c = cell(px[0], px[1], px[2]);
+            cellCounts[c]++;
+            if(binned)
+            {
+                cellSums[3*c + 0] += px[0];
+                cellSums[3*c + 1] += px[1];
+                cellSums[3*c + 2] += px[2];
+            }
+        }
+
+        colors.clear();
+        counts.clear();
+        sums.clear();
+        for(unsigned int c = 0; c < cellCounts.size(); c++)
+        {
+            unsigned int count = cellCounts[c];
+            if(count == 0)
+                continue;
+
+            unsigned long long sum[3];
+            if(binned)
+            {
+                sum[0] = cellSums[3*c + 0];
+                sum[1] = cellSums[3*c + 1];
+                sum[2] = cellSums[3*c + 2];
+            }
+            else
+            {
+                sum[0] = (unsigned long long)((c >> 16) & 0xFF) * count;
+                sum[1] = (unsigned long long)((c >> 8) & 0xFF) * count;
+                sum[2] = (unsigned long long)(c & 0xFF) * count;
+            }
+
+            cellToEntry[c] = counts.size();
+            counts.push_back(count);
+            for(int i = 0; i < 3; i++)
+            {
+                sums.push_back(sum[i]);
+                colors.push_back((sum[i] + count / 2) / count);
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return counts.size();
+    }
+
+    const unsigned char* color(size_t entry) const
+    {
+        return &colors[3 * entry];
+    }
+
+    unsigned int count(size_t entry) const
+    {
+        return counts[entry];
+    }
+
+    const unsigned long long* sum(size_t entry) const
+    {
+        return &sums[3 * entry];
+    }
+
+    // Only valid for colors that were part of the histogrammed image.
+    unsigned int entryOf(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        return cellToEntry[cell(r, g, b)];
+    }
+
+private:
+    unsigned int cell(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        unsigned int shift = 8 - bits;
+        return ((r >> shift) << (2 * bits)) | ((g >> shift) << bits) | (b >> shift);
+    }
+};
+
+#endif // COLOR_HISTOGRAM_H
@@ -0,0 +1,192 @@
+#ifndef COLOR_LOOKUP_H
+#define COLOR_LOOKUP_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+// RGB cube mapping every color to its nearest palette entry, built once per palette so a
+// remap costs a table lookup per pixel instead of a palette scan. The cube has 2^bits cells
+// per channel. A cell whose colors all share one nearest entry stores that entry; any other
+// cell stores the offset of a candidate list holding every entry that can be nearest for
+// some color in the cell, which is searched exactly. An entry is a candidate when its
+// smallest distance to the cell does not exceed the smallest largest distance of any entry,
+// so the result always equals a full palette scan, ties included (lowest index wins).
+class ColorLookup
+{
+public:
+    static constexpr unsigned int ambiguousCell = 0x80000000u;
+
+private:
+    unsigned int bits;
+    unsigned int colorTableSize;
+    std::vector<unsigned char> colorTable;
+    std::vector<unsigned int> cells;
+    // per ambiguous cell: the number of candidates, then their indices in increasing order
+    std::vector<unsigned int> candidates;
+
+public:
+    ColorLookup() : bits(0), colorTableSize(0)
+    {
+    }
+
+    void build(const unsigned char* rgb, unsigned int size, unsigned int bitsPerChannel, ThreadPool* threadPool = NULL)
+    {
+        bits = bitsPerChannel;
+        colorTableSize = size;
+        colorTable.assign(rgb, rgb + 3*size);
+        cells.assign(1u << (3 * bits), 0);
+        candidates.clear();
+
+        // red slices are built in bands with their own candidate lists, appended in band order
+        unsigned int slices = 1u << bits;
+        unsigned int bands = threadPool ? std::min(threadPool->size(), slices) : 1;
+        std::vector<std::vector<unsigned int> > bandCandidates(bands);
+        auto buildBand = [this, slices, bands, &bandCandidates](unsigned int band){
+            for(unsigned int r = (slices * band) / bands; r < (slices * (band + 1)) / bands; r++)
+                buildSlice(r, bandCandidates[band]);
+        };
+        if(threadPool)
+            threadPool->run(bands, buildBand);
+        else
+            buildBand(0);
+
+        for(unsigned int band = 0; band < bands; band++)
+        {
+            unsigned int base = candidates.size();
+            for(unsigned int r = (slices * band) / bands; r < (slices * (band + 1)) / bands; r++)
+                for(unsigned int c = r << (2 * bits); c < (r + 1) << (2 * bits); c++)
+                    if(cells[c] & ambiguousCell)
+                        cells[c] += base;
+            candidates.insert(candidates.end(), bandCandidates[band].begin(), bandCandidates[band].end());
+        }
+    }
+
+    unsigned int find(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        unsigned int value = cells[cell(r, g, b)];
+        if(!(value & ambiguousCell))
+            return value;
+
+        const unsigned int* list = &candidates[value & ~ambiguousCell];
+        unsigned int bestIndex = list[1];
+        unsigned int bestValue = std::numeric_limits<unsigned int>::max();
+        for(unsigned int c = 1; c <= list[0]; c++)
+        {
+            unsigned int value = squaredDistance(list[c], r, g, b);
+            if(value < bestValue)
+            {
+                bestValue = value;
+                bestIndex = list[c];
+            }
+        }
+        return bestIndex;
+    }
+
+    // Maps pixelsNumber pixels of stride bytes each to the palette; bytes after RGB are copied.
+    void remap(const unsigned char* pixels, unsigned char* output, size_t pixelsNumber, unsigned int stride, ThreadPool* threadPool = NULL) const
+    {
+        unsigned int bands = threadPool ? threadPool->size() : 1;
+        auto remapBand = [this, pixels, output, pixelsNumber, stride, bands](unsigned int band){
+            for(size_t p = (pixelsNumber * band) / bands; p < (pixelsNumber * (band + 1)) / bands; p++)
+            {
+                const unsigned char* px = pixels + stride * p;
+                unsigned int i = find(px[0], px[1], px[2]);
+                std::copy(&colorTable[3*i], &colorTable[3*i] + 3, output + stride * p);
+                std::copy(px + 3, px + stride, output + stride * p + 3);
+            }
+        };
+        if(threadPool)
+            threadPool->run(bands, remapBand);
+        else
+            remapBand(0);
+    }
+
+    unsigned int getBits() const
+    {
+        return bits;
+    }
+
+    const std::vector<unsigned int>& getCells() const
+    {
+        return cells;
+    }
+
+    const std::vector<unsigned int>& getCandidates() const
+    {
+        return candidates;
+    }
+
+    // fraction of cells that need a candidate search
+    double ambiguousFraction() const
+    {
+        size_t ambiguous = std::count_if(cells.begin(), cells.end(), [](unsigned int value){ return (value & ambiguousCell) != 0; });
+        return cells.empty() ? 0.0 : (double)ambiguous / cells.size();
+    }
+
+private:
+    unsigned int cell(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        unsigned int shift = 8 - bits;
+        return ((r >> shift) << (2 * bits)) | ((g >> shift) << bits) | (b >> shift);
+    }
+
+    unsigned int squaredDistance(unsigned int index, int r, int g, int b) const
+    {
+        int dr = colorTable[3*index + 0] - r;
+        int dg = colorTable[3*index + 1] - g;
+        int db = colorTable[3*index + 2] - b;
+        return dr*dr + dg*dg + db*db;
+    }
+
+    void buildSlice(unsigned int r, std::vector<unsigned int>& list)
+    {
+        unsigned int cellSize = 1u << (8 - bits);
+        std::vector<unsigned int> nearest(colorTableSize);
+        for(unsigned int g = 0; g < (1u << bits); g++)
+        for(unsigned int b = 0; b < (1u << bits); b++)
+        {
+            int low[3] = {(int)(r * cellSize), (int)(g * cellSize), (int)(b * cellSize)};
+            int high[3] = {low[0] + (int)cellSize - 1, low[1] + (int)cellSize - 1, low[2] + (int)cellSize - 1};
+
+            unsigned int bound = std::numeric_limits<unsigned int>::max();
+            for(unsigned int i = 0; i < colorTableSize; i++)
+            {
+                unsigned int nearestDistance = 0, furthestDistance = 0;
+                for(int c = 0; c < 3; c++)
+                {
+                    int v = colorTable[3*i + c];
+                    int inside = v < low[c] ? low[c] - v : (v > high[c] ? v - high[c] : 0);
+                    int outside = std::max(v - low[c], high[c] - v);
+                    nearestDistance += inside * inside;
+                    furthestDistance += outside * outside;
+                }
+                nearest[i] = nearestDistance;
+                bound = std::min(bound, furthestDistance);
+            }
+
+            unsigned int first = list.size();
+            list.push_back(0);
+            for(unsigned int i = 0; i < colorTableSize; i++)
+                if(nearest[i] <= bound)
+                    list.push_back(i);
+
+            unsigned int count = list.size() - first - 1;
+            unsigned int& value = cells[(r << (2 * bits)) | (g << bits) | b];
+            if(count == 1)
+            {
+                value = list[first + 1];
+                list.resize(first);
+            }
+            else
+            {
+                list[first] = count;
+                value = ambiguousCell | first;
+            }
+        }
+    }
+};
+
+#endif // COLOR_LOOKUP_H
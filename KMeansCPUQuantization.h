@@ -3,104 +3,694 @@
 
 #include <vector>
 #include <limits>
+#include <thread>
+#include <algorithm>
 
 #include "image.h"
+#include "ThreadPool.h"
+#include "NearestColor.h"
+#include "ColorHistogram.h"
+#include "PaletteSeeding.h"
+#include "MiniBatch.h"
+#include "ColorLookup.h"
+#include "PixelLayout.h"
 
+// Works on the pixels in their own layout: PNG_FORMAT_GRAY, PNG_FORMAT_RGB or
+// PNG_FORMAT_RGBA input, with an output image of the same format. Alpha is kept.
 class KMeansCPUQuantization : public Quantization
 {
+public:
+    // FullSearch scans the whole palette for every pixel. Hamerly keeps an upper bound on the
+    // distance to the assigned entry and a lower bound on the distance to any other entry per
+    // pixel and skips the scan while the bounds prove the assignment cannot change.
+    enum AssignmentMode { FullSearch, Hamerly };
+
 private:
     Image* inputImage;
     Image* outputImage;
     unsigned int colorTableSize;
+    unsigned int threadsNumber;
+
+    ThreadPool threadPool;
 
     std::vector<unsigned char> colorTable;
-    std::vector<unsigned int> acc;
+    NearestColorSearch nearestColor;
+    std::vector<unsigned long long> acc;
     std::vector<unsigned int> counter;
+
+    PaletteSeeding::Strategy seedingStrategy;
+    std::vector<unsigned char> sample;
+    std::vector<unsigned char> initialPalette;
+
+    // iterations run on the weighted distinct colors instead of the pixels when enabled
+    ColorHistogram::Mode histogramMode;
+    ColorHistogram histogram;
+    std::vector<unsigned int> entryLabels;
+
+    // one accumulator set per band, merged in band order
+    std::vector<std::vector<unsigned long long> > bandAcc;
+    std::vector<std::vector<unsigned int> > bandCounter;
+    std::vector<unsigned long long> bandEvaluations;
+    std::vector<unsigned long long> bandReassigned;
+    std::vector<double> bandSse;
+    // nearest entries of one row, for the run search of FullSearch
+    std::vector<std::vector<unsigned int> > bandRowLabels;
+
+    // assignment of every sample in the last pass, for both assignment modes
+    std::vector<unsigned int> labels;
+    Convergence lastConvergence;
+    PhaseStats lastStats;
+    PhaseTimer phaseTimer;
+
+    AssignmentMode assignmentMode;
+    unsigned long long distanceEvaluations;
+    unsigned long long skippedDistanceEvaluations;
+
+    // Hamerly state; bounds are kept slightly loose so that ties always fall back to a full
+    // scan, which keeps the assignment identical to FullSearch
+    static constexpr float boundsSlack = 1e-3f;
+    bool boundsValid;
+    std::vector<float> upperBounds;
+    std::vector<float> lowerBounds;
+    std::vector<unsigned char> previousColorTable;
+    std::vector<float> centroidShift;
+    std::vector<float> halfNearestCentroid;
+    float maxShift;
+    float secondMaxShift;
+    unsigned int maxShiftIndex;
+
+    // mini-batch mode, enabled by a non-zero batch size
+    size_t miniBatchSize;
+    MiniBatch::Sampling miniBatchSampling;
+    unsigned int miniBatchIteration;
+    std::vector<size_t> miniBatchSample;
+    std::vector<float> miniBatchCenters;
+    std::vector<unsigned long long> miniBatchSeen;
+
+    // finalize() maps pixels through an RGB cube of the final palette when non-zero
+    unsigned int remapLookupBits;
+    ColorLookup colorLookup;
+
+    // finalize() writes palette indices here instead of pixels into outputImage when set
+    IndexedImage* indexedOutput;
 public:
-    KMeansCPUQuantization(Image *inputImage, Image* outputImage, unsigned int colorTableSize) :
-        inputImage(inputImage), outputImage(outputImage), colorTableSize(colorTableSize)
+    KMeansCPUQuantization(Image *inputImage, Image* outputImage, unsigned int colorTableSize, 
+        unsigned int threadsNumber = std::thread::hardware_concurrency()) :
+        inputImage(inputImage), outputImage(outputImage), colorTableSize(colorTableSize), 
+        threadsNumber(std::max(1u, threadsNumber)), threadPool(this->threadsNumber),
+        seedingStrategy(PaletteSeeding::GrayRamp), histogramMode(ColorHistogram::Disabled), assignmentMode(FullSearch), distanceEvaluations(0), skippedDistanceEvaluations(0), boundsValid(false),
+        miniBatchSize(0), miniBatchSampling(MiniBatch::Stratified), miniBatchIteration(0), remapLookupBits(0), indexedOutput(NULL)
+    {
+    }
+
+    // Moves the quantizer to another image pair and palette size; the next init() starts over
+    // and keeps the threads and the capacity of the buffers of previous images. Indexed output
+    // is turned off for sizes it cannot hold.
+    void reset(Image* input, Image* output, unsigned int size)
+    {
+        inputImage = input;
+        outputImage = output;
+        colorTableSize = size;
+        if(colorTableSize > IndexedImage::maxColors)
+            indexedOutput = NULL;
+    }
+
+    void setAssignmentMode(AssignmentMode mode)
+    {
+        assignmentMode = mode;
+    }
+
+    void setHistogramMode(ColorHistogram::Mode mode)
+    {
+        histogramMode = mode;
+    }
+
+    void setSeedingStrategy(PaletteSeeding::Strategy strategy)
+    {
+        seedingStrategy = strategy;
+    }
+
+    // init() then starts from this palette (interleaved RGB, colorTableSize entries), e.g. the
+    // final palette of the previous frame, instead of seeding one. Empty seeds again.
+    void setInitialPalette(const std::vector<unsigned char>& rgb)
+    {
+        initialPalette = rgb;
+    }
+
+    // finalize() builds a lookup cube with 2^bits cells per channel (5 or 6 are sensible) from
+    // the final palette and maps every pixel with one lookup. 0 keeps the palette search.
+    void setRemapLookup(unsigned int bits)
+    {
+        remapLookupBits = std::min(bits, 8u);
+    }
+
+    // finalize() then fills indexed with the palette and one index per pixel and leaves
+    // outputImage alone. Refused (false) for more than 256 colors; NULL writes pixels again.
+    bool setIndexedOutput(IndexedImage* indexed)
+    {
+        if(indexed && colorTableSize > IndexedImage::maxColors)
+            return false;
+        indexedOutput = indexed;
+        return true;
+    }
+
+    // interleaved RGB, colorTableSize entries
+    const std::vector<unsigned char>& getColorTable() const
+    {
+        return colorTable;
+    }
+
+    // Iterations then only look at batchSize sampled pixels and update the palette with per
+    // entry learning rates; finalize() still maps every pixel. 0 turns it off. Reassigned
+    // pixels and SSE then describe the batch.
+    void setMiniBatch(size_t batchSize, MiniBatch::Sampling sampling = MiniBatch::Stratified)
+    {
+        miniBatchSize = batchSize;
+        miniBatchSampling = sampling;
+    }
+
+    Convergence convergence()
+    {
+        return lastConvergence;
+    }
+
+    PhaseStats stats()
+    {
+        return lastStats;
+    }
+
+    // distance evaluations done / avoided by the last iterate() or finalize()
+    unsigned long long getDistanceEvaluations() const
     {
+        return distanceEvaluations;
+    }
+
+    unsigned long long getSkippedDistanceEvaluations() const
+    {
+        return skippedDistanceEvaluations;
+    }
+
+    void setSearchPath(NearestColorSearch::Path path)
+    {
+        nearestColor.setPath(path);
     }
     
 
     void init()
     {
-        colorTable.resize(3 * colorTableSize);
-        for(int i = 0; i < colorTableSize; i++)
-        {   
-            colorTable[3*i] = (i * 255) / colorTableSize ;
-            colorTable[3*i+1] = (i * 255) / colorTableSize ;
-            colorTable[3*i+2] = (i * 255) / colorTableSize;
-        }
+        phaseTimer.start();
+        dispatchPixelLayout(inputImage->details.format, [this](auto layout){
+            sample = PaletteSeeding::samplePixels<decltype(layout)>(inputImage->data.data(), pixelsNumber());
+            if(histogramMode != ColorHistogram::Disabled)
+                histogram.build<decltype(layout)>(inputImage->data.data(), pixelsNumber(), histogramMode);
+        });
+        colorTable = initialPalette.size() == 3*colorTableSize ? initialPalette : PaletteSeeding::seed(seedingStrategy, sample, colorTableSize);
 
         acc.resize(3*colorTableSize);
         counter.resize(colorTableSize);
+
+        if(histogramMode != ColorHistogram::Disabled)
+            entryLabels.resize(histogram.size());
+
+        unsigned int bands = bandsNumber();
+        bandAcc.assign(bands, std::vector<unsigned long long>(3*colorTableSize));
+        bandCounter.assign(bands, std::vector<unsigned int>(colorTableSize));
+        bandEvaluations.assign(bands, 0);
+        bandReassigned.assign(bands, 0);
+        bandSse.assign(bands, 0.0);
+        bandRowLabels.assign(bands, std::vector<unsigned int>(inputImage->details.width));
+
+        labels.assign(samplesNumber(), colorTableSize);
+        lastConvergence = Convergence();
+        boundsValid = false;
+        if(assignmentMode == Hamerly)
+        {
+            upperBounds.assign(samplesNumber(), 0.0f);
+            lowerBounds.assign(samplesNumber(), 0.0f);
+        }
+        previousColorTable = colorTable;
+        updatePalette();
+
+        miniBatchIteration = 0;
+        miniBatchCenters.assign(colorTable.begin(), colorTable.end());
+        miniBatchSeen.assign(colorTableSize, 0);
+
+        distanceEvaluations = 0;
+        endPhase(histogramMode != ColorHistogram::Disabled ? pixelsNumber() : sample.size() / 3, 0.0, 0);
+        // nothing is assigned yet
+        lastStats.psnr = 0.0;
     }
 
     void iterate()
+    {
+        phaseTimer.start();
+        if(miniBatchSize > 0)
+        {
+            iterateMiniBatch();
+            return;
+        }
+
+        threadPool.run(bandsNumber(), [this](unsigned int band){
+            if(histogramMode != ColorHistogram::Disabled)
+                accumulateEntries(band);
+            else
+                dispatchPixelLayout(inputImage->details.format, [this, band](auto layout){
+                    accumulateBand<decltype(layout)>(band);
+                });
+        });
+        mergeBands();
+        countEvaluations();
+        unsigned int emptyClusters = std::count(counter.begin(), counter.end(), 0u);
+
+        std::vector<unsigned char> previous = colorTable;
+
+        for(int i = 0; i < colorTableSize; i++)
+        {
+            if(counter[i] == 0) continue;
+
+            colorTable[3*i + 0] = acc[3*i + 0] / counter[i];
+            colorTable[3*i + 1] = acc[3*i + 1] / counter[i];
+            colorTable[3*i + 2] = acc[3*i + 2] / counter[i];
+        }
+        PaletteSeeding::reseedDeadEntries(colorTable, counter, sample);
+        updatePalette();
+
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            float shift = nearestColor.distance(i, previous[3*i], previous[3*i + 1], previous[3*i + 2]);
+            lastConvergence.maxCentroidShift = std::max(lastConvergence.maxCentroidShift, shift);
+        }
+        endPhase(samplesNumber(), lastConvergence.sse, emptyClusters);
+    }
+
+    void finalize()
+    {
+        phaseTimer.start();
+        if(indexedOutput)
+        {
+            indexedOutput->width = inputImage->details.width;
+            indexedOutput->height = inputImage->details.height;
+            indexedOutput->palette = colorTable;
+            indexedOutput->indices.resize(pixelsNumber());
+        }
+        if(histogramMode != ColorHistogram::Disabled)
+        {
+            threadPool.run(bandsNumber(), [this](unsigned int band){
+                labelEntries(band);
+            });
+            countEvaluations();
+            threadPool.run(bandsNumber(), [this](unsigned int band){
+                dispatchPixelLayout(inputImage->details.format, [this, band](auto layout){
+                    expandEntries<decltype(layout)>(band);
+                });
+            });
+        }
+        else
+        {
+            if(remapLookupBits > 0)
+                colorLookup.build(colorTable.data(), colorTableSize, remapLookupBits, &threadPool);
+            threadPool.run(bandsNumber(), [this](unsigned int band){
+                dispatchPixelLayout(inputImage->details.format, [this, band](auto layout){
+                    quantizeBand<decltype(layout)>(band);
+                });
+            });
+            countEvaluations();
+        }
+
+        double sse = 0.0;
+        for(unsigned int band = 0; band < bandsNumber(); band++)
+            sse += bandSse[band];
+        endPhase(pixelsNumber(), sse, 0);
+    }
+
+private:
+    void endPhase(unsigned long long pixels, double sse, unsigned int emptyClusters)
+    {
+        lastStats = PhaseStats();
+        lastStats.pixelsProcessed = pixels;
+        lastStats.distanceEvaluations = distanceEvaluations;
+        lastStats.sse = sse;
+        lastStats.psnr = peakSignalToNoiseRatio(sse, pixels);
+        lastStats.emptyClusters = emptyClusters;
+        lastStats.wallTime = phaseTimer.milliseconds();
+    }
+
+    void mergeBands()
     {
         for(int i = 0; i < colorTableSize; i++)
             counter[i] = 0;
         for(int i = 0; i < 3*colorTableSize; i++)
             acc[i] = 0;
 
-        for(int y = 0; y < inputImage->details.height; y++)
-        for(int x = 0; x < inputImage->details.width; x++)
+        lastConvergence = Convergence();
+        for(unsigned int band = 0; band < bandsNumber(); band++)
+        {
+            for(int i = 0; i < colorTableSize; i++)
+                counter[i] += bandCounter[band][i];
+            for(int i = 0; i < 3*colorTableSize; i++)
+                acc[i] += bandAcc[band][i];
+            lastConvergence.reassignedPixels += bandReassigned[band];
+            lastConvergence.sse += bandSse[band];
+        }
+    }
+
+    void iterateMiniBatch()
+    {
+        miniBatchSample = MiniBatch::drawSample(pixelsNumber(), miniBatchSize, miniBatchSampling, miniBatchIteration++);
+        threadPool.run(bandsNumber(), [this](unsigned int band){
+            dispatchPixelLayout(inputImage->details.format, [this, band](auto layout){
+                accumulateMiniBatch<decltype(layout)>(band);
+            });
+        });
+        mergeBands();
+        distanceEvaluations = (unsigned long long)miniBatchSample.size() * colorTableSize;
+        skippedDistanceEvaluations = 0;
+        // only the batch saw the palette move, so bounds of the other pixels are stale
+        boundsValid = false;
+
+        std::vector<unsigned char> previous = colorTable;
+        MiniBatch::update(miniBatchCenters, miniBatchSeen, acc, counter, colorTable);
+
+        // only entries that never got a pixel in any batch are dead
+        std::vector<unsigned int> seen(colorTableSize);
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            seen[i] = std::min<unsigned long long>(miniBatchSeen[i], 0xFFFFFFFFu);
+        unsigned int emptyClusters = std::count(seen.begin(), seen.end(), 0u);
+        if(PaletteSeeding::reseedDeadEntries(colorTable, seen, sample) > 0)
+        {
+            for(unsigned int i = 0; i < colorTableSize; i++)
+                if(seen[i] == 0)
+                    std::copy(&colorTable[3*i], &colorTable[3*i] + 3, &miniBatchCenters[3*i]);
+        }
+        updatePalette();
+
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            float shift = nearestColor.distance(i, previous[3*i], previous[3*i + 1], previous[3*i + 2]);
+            lastConvergence.maxCentroidShift = std::max(lastConvergence.maxCentroidShift, shift);
+        }
+        endPhase(miniBatchSample.size(), lastConvergence.sse, emptyClusters);
+    }
+
+    template<class Layout>
+    void accumulateMiniBatch(unsigned int band)
+    {
+        std::vector<unsigned long long>& acc = bandAcc[band];
+        std::vector<unsigned int>& counter = bandCounter[band];
+        std::fill(acc.begin(), acc.end(), 0);
+        std::fill(counter.begin(), counter.end(), 0);
+        unsigned long long& reassigned = bandReassigned[band];
+        double& sse = bandSse[band];
+        reassigned = 0;
+        sse = 0.0;
+
+        size_t begin, end;
+        bandRange(band, miniBatchSample.size(), begin, end);
+        for(size_t s = begin; s < end; s++)
         {
-            unsigned char r =inputImage->data.data()[3*(y * inputImage->details.width + x) + 0];
-            unsigned char g = inputImage->data.data()[3*(y * inputImage->details.width + x) + 1];
-            unsigned char b = inputImage->data.data()[3*(y * inputImage->details.width + x) + 2];
-            int i = colorize(r,g,b);
+            size_t p = miniBatchSample[s];
+            unsigned char r, g, b;
+            Layout::read(inputImage->data.data() + Layout::stride * p, r, g, b);
+            unsigned int i = colorize(r, g, b);
+            if(histogramMode == ColorHistogram::Disabled)
+            {
+                if(labels[p] != i)
+                    reassigned += 1;
+                labels[p] = i;
+            }
+            sse += nearestColor.squaredDistance(i, r, g, b);
 
             acc[3*i + 0] += r;
             acc[3*i + 1] += g;
             acc[3*i + 2] += b;
-            counter[i] += 1;                             
+            counter[i] += 1;
         }
-        for(int i = 0; i < colorTableSize; i++)
+    }
+
+    unsigned int bandsNumber() const
+    {
+        return threadsNumber;
+    }
+
+    size_t pixelsNumber() const
+    {
+        return (size_t)inputImage->details.width * inputImage->details.height;
+    }
+
+    // pixels, or histogram entries when the histogram is enabled
+    size_t samplesNumber() const
+    {
+        return histogramMode != ColorHistogram::Disabled ? histogram.size() : pixelsNumber();
+    }
+
+    void bandRange(unsigned int band, size_t total, size_t& begin, size_t& end) const
+    {
+        begin = (total * band) / bandsNumber();
+        end = (total * (band + 1)) / bandsNumber();
+    }
+
+    template<class Layout>
+    void accumulateBand(unsigned int band)
+    {
+        std::vector<unsigned long long>& acc = bandAcc[band];
+        std::vector<unsigned int>& counter = bandCounter[band];
+        std::fill(acc.begin(), acc.end(), 0);
+        std::fill(counter.begin(), counter.end(), 0);
+        unsigned long long& evaluations = bandEvaluations[band];
+        unsigned long long& reassigned = bandReassigned[band];
+        double& sse = bandSse[band];
+        std::vector<unsigned int>& rowLabels = bandRowLabels[band];
+        evaluations = 0;
+        reassigned = 0;
+        sse = 0.0;
+
+        size_t width = inputImage->details.width;
+        size_t yBegin, yEnd;
+        bandRange(band, inputImage->details.height, yBegin, yEnd);
+        for(size_t y = yBegin; y < yEnd; y++)
         {
-            if(counter[i] == 0) counter[i] = 1;
+            const unsigned char* row = inputImage->data.data() + Layout::stride * y * width;
+            if(assignmentMode == FullSearch)
+            {
+                nearestColor.findRun<Layout>(row, width, rowLabels.data());
+                evaluations += width * colorTableSize;
+            }
 
-            colorTable[3*i + 0] = acc[3*i + 0] / counter[i];
-            colorTable[3*i + 1] = acc[3*i + 1] / counter[i];
-            colorTable[3*i + 2] = acc[3*i + 2] / counter[i];
+            for(size_t x = 0; x < width; x++)
+            {
+                unsigned char r, g, b;
+                Layout::read(row + Layout::stride * x, r, g, b);
+                unsigned int& label = labels[y * width + x];
+                unsigned int previous = label;
+                unsigned int i = assignmentMode == FullSearch ? rowLabels[x] : assign(y * width + x, r, g, b, evaluations);
+                label = i;
+                if(i != previous)
+                    reassigned += 1;
+                sse += nearestColor.squaredDistance(i, r, g, b);
+
+                acc[3*i + 0] += r;
+                acc[3*i + 1] += g;
+                acc[3*i + 2] += b;
+                counter[i] += 1;
+            }
         }
     }
 
-    void finalize()
+    template<class Layout>
+    void quantizeBand(unsigned int band)
     {
+        unsigned long long& evaluations = bandEvaluations[band];
+        double& sse = bandSse[band];
+        std::vector<unsigned int>& rowLabels = bandRowLabels[band];
+        evaluations = 0;
+        sse = 0.0;
 
-        for(int y = 0; y < inputImage->details.height; y++)
-        for(int x = 0; x < inputImage->details.width; x++)
+        size_t width = inputImage->details.width;
+        size_t yBegin, yEnd;
+        bandRange(band, inputImage->details.height, yBegin, yEnd);
+        for(size_t y = yBegin; y < yEnd; y++)
         {
-            unsigned char r =inputImage->data.data()[3*(y * inputImage->details.width + x) + 0];
-            unsigned char g = inputImage->data.data()[3*(y * inputImage->details.width + x) + 1];
-            unsigned char b = inputImage->data.data()[3*(y * inputImage->details.width + x) + 2];
-            int i = colorize(r,g,b);
+            const unsigned char* row = inputImage->data.data() + Layout::stride * y * width;
+            unsigned char* outputRow = outputImage->data.data() + Layout::stride * y * width;
+            bool runSearch = remapLookupBits == 0 && assignmentMode == FullSearch;
+            if(runSearch)
+            {
+                nearestColor.findRun<Layout>(row, width, rowLabels.data());
+                evaluations += width * colorTableSize;
+            }
 
-            outputImage->data.data()[3*(y * outputImage->details.width + x) + 0] = colorTable[3*i + 0];
-            outputImage->data.data()[3*(y * outputImage->details.width + x) + 1] = colorTable[3*i + 1];
-            outputImage->data.data()[3*(y * outputImage->details.width + x) + 2] = colorTable[3*i + 2];
+            for(size_t x = 0; x < width; x++)
+            {
+                unsigned char r, g, b;
+                Layout::read(row + Layout::stride * x, r, g, b);
+                unsigned int i = runSearch ? rowLabels[x] :
+                    (remapLookupBits > 0 ? colorLookup.find(r, g, b) : assign(y * width + x, r, g, b, evaluations));
+                sse += nearestColor.squaredDistance(i, r, g, b);
+                if(indexedOutput)
+                    indexedOutput->indices[y * width + x] = i;
+                else
+                    Layout::write(outputRow + Layout::stride * x, row + Layout::stride * x, &colorTable[3*i]);
+            }
         }
     }
 
-private:
-    unsigned int colorize(unsigned char r, unsigned char g, unsigned char b)
+    void accumulateEntries(unsigned int band)
+    {
+        std::vector<unsigned long long>& acc = bandAcc[band];
+        std::vector<unsigned int>& counter = bandCounter[band];
+        std::fill(acc.begin(), acc.end(), 0);
+        std::fill(counter.begin(), counter.end(), 0);
+        unsigned long long& evaluations = bandEvaluations[band];
+        unsigned long long& reassigned = bandReassigned[band];
+        double& sse = bandSse[band];
+        evaluations = 0;
+        reassigned = 0;
+        sse = 0.0;
+
+        size_t begin, end;
+        bandRange(band, histogram.size(), begin, end);
+        for(size_t entry = begin; entry < end; entry++)
+        {
+            const unsigned char* color = histogram.color(entry);
+            const unsigned long long* sum = histogram.sum(entry);
+            unsigned int previous = labels[entry];
+            unsigned int i = assign(entry, color[0], color[1], color[2], evaluations);
+            if(i != previous)
+                reassigned += histogram.count(entry);
+            sse += (double)histogram.count(entry) * nearestColor.squaredDistance(i, color[0], color[1], color[2]);
+
+            acc[3*i + 0] += sum[0];
+            acc[3*i + 1] += sum[1];
+            acc[3*i + 2] += sum[2];
+            counter[i] += histogram.count(entry);
+        }
+    }
+
+    void labelEntries(unsigned int band)
+    {
+        unsigned long long& evaluations = bandEvaluations[band];
+        evaluations = 0;
+
+        size_t begin, end;
+        bandRange(band, histogram.size(), begin, end);
+        for(size_t entry = begin; entry < end; entry++)
+        {
+            const unsigned char* color = histogram.color(entry);
+            entryLabels[entry] = assign(entry, color[0], color[1], color[2], evaluations);
+        }
+    }
+
+    template<class Layout>
+    void expandEntries(unsigned int band)
+    {
+        double& sse = bandSse[band];
+        sse = 0.0;
+
+        size_t begin, end;
+        bandRange(band, pixelsNumber(), begin, end);
+        for(size_t p = begin; p < end; p++)
+        {
+            unsigned char r, g, b;
+            Layout::read(inputImage->data.data() + Layout::stride * p, r, g, b);
+            int i = entryLabels[histogram.entryOf(r, g, b)];
+            sse += nearestColor.squaredDistance(i, r, g, b);
+            if(indexedOutput)
+                indexedOutput->indices[p] = i;
+            else
+                Layout::write(outputImage->data.data() + Layout::stride * p, inputImage->data.data() + Layout::stride * p, &colorTable[3*i]);
+        }
+    }
+
+    unsigned int colorize(unsigned char r, unsigned char g, unsigned char b) const
     {
-        unsigned int bestIndex = 0;
-        float bestValue = std::numeric_limits<float>::max();
+        return nearestColor.find(r, g, b);
+    }
 
+    unsigned int assign(unsigned int pixel, unsigned char r, unsigned char g, unsigned char b, unsigned long long& evaluations)
+    {
+        if(assignmentMode != Hamerly)
+        {
+            evaluations += colorTableSize;
+            labels[pixel] = colorize(r, g, b);
+            return labels[pixel];
+        }
+
+        unsigned int& label = labels[pixel];
+        float& upper = upperBounds[pixel];
+        float& lower = lowerBounds[pixel];
+        if(boundsValid)
+        {
+            upper += centroidShift[label] + boundsSlack;
+            lower -= (label == maxShiftIndex ? secondMaxShift : maxShift) + boundsSlack;
+            float bound = std::max(halfNearestCentroid[label] - boundsSlack, lower);
+            if(upper < bound)
+                return label;
+
+            upper = nearestColor.distance(label, r, g, b);
+            evaluations += 1;
+            if(upper < bound)
+                return label;
+        }
+
+        evaluations += colorTableSize;
+        label = nearestColor.findWithSecond(r, g, b, upper, lower);
+        return label;
+    }
+
+    // Publishes colorTable to the search and, for Hamerly, records how far every entry moved
+    // since the previous pass and half the distance to its nearest neighbour entry.
+    void updatePalette()
+    {
+        nearestColor.setPalette(colorTable.data(), colorTableSize);
+        if(assignmentMode != Hamerly)
+            return;
+
+        centroidShift.assign(colorTableSize, 0.0f);
+        maxShift = 0.0f;
+        secondMaxShift = 0.0f;
+        maxShiftIndex = 0;
         for(unsigned int i = 0; i < colorTableSize; i++)
         {
-            float l2 = (1.0 * colorTable[3*i + 0] - r)*(1.0 * colorTable[3*i + 0] - r) + (1.0 * colorTable[3*i + 1] - g)*(1.0 * colorTable[3*i + 1] - g) + (1.0 * colorTable[3*i + 2] - b)*(1.0 * colorTable[3*i + 2] - b);
-            if(l2<bestValue)
+            centroidShift[i] = nearestColor.distance(i, previousColorTable[3*i], previousColorTable[3*i + 1], previousColorTable[3*i + 2]);
+            if(centroidShift[i] > maxShift)
             {
-                bestIndex = i;
-                bestValue = l2;
+                secondMaxShift = maxShift;
+                maxShift = centroidShift[i];
+                maxShiftIndex = i;
+            }
+            else if(centroidShift[i] > secondMaxShift)
+            {
+                secondMaxShift = centroidShift[i];
             }
         }
+        previousColorTable = colorTable;
 
-        return bestIndex;
+        halfNearestCentroid.assign(colorTableSize, std::numeric_limits<float>::max());
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        for(unsigned int j = i + 1; j < colorTableSize; j++)
+        {
+            float half = 0.5f * nearestColor.distance(j, colorTable[3*i], colorTable[3*i + 1], colorTable[3*i + 2]);
+            halfNearestCentroid[i] = std::min(halfNearestCentroid[i], half);
+            halfNearestCentroid[j] = std::min(halfNearestCentroid[j], half);
+        }
+    }
+
+    // Sums per band counters after a pass; the bounds then account for the current palette.
+    void countEvaluations()
+    {
+        distanceEvaluations = 0;
+        for(unsigned int band = 0; band < bandsNumber(); band++)
+            distanceEvaluations += bandEvaluations[band];
+        unsigned long long fullSearch = (unsigned long long)samplesNumber() * colorTableSize;
+        skippedDistanceEvaluations = fullSearch - distanceEvaluations;
+
+        if(assignmentMode == Hamerly)
+        {
+            boundsValid = true;
+            std::fill(centroidShift.begin(), centroidShift.end(), 0.0f);
+            maxShift = 0.0f;
+            secondMaxShift = 0.0f;
+        }
     }
 };
 
@@ -1,17 +1,23 @@
 #ifndef KMEANS_GPU_QUANTIZATION
 #define KMEANS_GPU_QUANTIZATION
 
-#define CL_TARGET_OPENCL_VERSION 220
-#include <CL/cl.h>
+#include <cmath>
+#include <memory>
 
+#include "OpenCLEngine.h"
 #include "helpers.h"
 #include "image.h"
+#include "PaletteSeeding.h"
+#include "MiniBatch.h"
+#include "ColorLookup.h"
 
 class KMeansGPUQuantization : public Quantization
 {
 private:
     Image* inputImage;
     Image* outputImage;
+    OpenCLEngine* engine;
+    std::unique_ptr<OpenCLEngine> ownedEngine;
     std::string kernelFilename;
     unsigned int colorTableSize;
     unsigned int localWorkSizeX;
@@ -19,22 +25,29 @@ private:
     unsigned int accGroupsX;
     unsigned int accGroupsY;
     unsigned int accGroupsNumber;
-    cl_platform_id platform_id;
-    cl_device_id device_id;   
-    cl_uint ret_num_devices;
-    cl_uint ret_num_platforms;
     cl_context context;
     cl_command_queue command_queue;
-    cl_program program;
     cl_int ret;
     cl_kernel accKernel;
     cl_kernel partKernel;
     cl_kernel quantKernel;
+    cl_kernel miniBatchAccKernel;
+    cl_kernel miniBatchUpdateKernel;
+    cl_kernel quantizeLookupKernel;
+    cl_kernel quantizeIndicesKernel;
 
     cl_mem inputClImage;
     cl_mem outputClImage;
     cl_mem  partialSumsClBuffer; 
     cl_mem  colorTableClBuffer;
+    cl_mem  labelsClBuffer;
+    cl_mem  convergenceClBuffer;
+    cl_mem  countsClBuffer;
+    cl_mem  miniBatchCentersClBuffer;
+    cl_mem  miniBatchSeenClBuffer;
+    cl_mem  lookupCellsClBuffer;
+    cl_mem  lookupCandidatesClBuffer;
+    cl_mem  indicesClBuffer;
 
     size_t imageOrigin[3];
     size_t imageRegion[3];
@@ -44,120 +57,645 @@ private:
     size_t part_global_work_size[3];
     size_t quant_local_work_size[3];
     size_t quant_global_work_size[3];
-    cl_image_format clImageFormat;
-    cl_image_desc clImageDesc;
+    size_t mini_local_work_size[3];
+    size_t mini_acc_global_work_size[3];
+    size_t mini_update_global_work_size[3];
+    cl_uint imageWidth;
+    cl_uint imageHeight;
+
+    // rows [rowBegin, rowEnd) are accumulated and quantized; rowEnd 0 means the whole image
+    unsigned int rowBegin;
+    unsigned int rowEnd;
+    size_t rowOffset[3];
+    cl_uint rowLimit;
+
+    // zero-copy mode wraps the Image storage itself; the output stays mapped until release
+    bool zeroCopy;
+    cl_mem hostInputClImage;
+    cl_mem hostOutputClImage;
+    void* mappedOutput;
+
+    // transfers are asynchronous; these events order the host against them
+    const unsigned char* uploadSource;
+    cl_event uploadEvent;
+    cl_event finalizeEvent;
 
     std::vector<unsigned char> colorTable;
-    std::vector<unsigned int> partialSums;
+    // device layout of colorTable: one uchar4 per entry, the fourth byte is 0
+    std::vector<unsigned char> paddedColorTable;
+    unsigned int pixelsPerItem;
+    // reassigned pixels, SSE low word, SSE high word, max squared centroid shift, empty entries
+    cl_uint convergenceData[5];
+    // the last iteration waited for left entries empty (or none was yet); iterations are then
+    // waited for one by one so dead entries are reseeded before the next one
+    bool reseedPending;
+    // per entry pixel count and channel sums of the last iteration, as written by the partition
+    std::vector<cl_uint> entrySums;
+    std::vector<unsigned int> counts;
+
+    PaletteSeeding::Strategy seedingStrategy;
+    std::vector<unsigned char> sample;
+    std::vector<unsigned char> initialPalette;
+
+    // kernel events waiting to be turned into profiling times
+    enum KernelType { Accumulate, Partition, Quantize, KernelTypesNumber };
+    std::vector<std::pair<KernelType, cl_event> > kernelEvents;
+    double kernelTimes[KernelTypesNumber];
+
+    // the phase being timed; host<->device bytes are counted as transfers are queued
+    PhaseStats lastStats;
+    PhaseTimer phaseTimer;
+    double phaseKernelStart;
+    unsigned long long bytesTransferred;
+    bool finalSsePending;
+
+    // mini-batch mode, enabled by a non-zero batch size
+    cl_uint miniBatchSize;
+    cl_uint miniBatchStratified;
+    cl_uint miniBatchSeed;
+
+    // the final remap goes through an RGB cube of the final palette when non-zero
+    cl_uint remapLookupBits;
+    ColorLookup colorLookup;
+
+    // the final remap writes palette indices here instead of the output image when set
+    IndexedImage* indexedOutput;
 public:
     KMeansGPUQuantization(Image* inputImage, Image* outputImage, unsigned int colorTableSize, std::string kernelFilename = "parallelReductionKernel.cl", 
         unsigned int localWorkSizeX = 32, unsigned int localWorkSizeY = 32) :
-        inputImage(inputImage), outputImage(outputImage), colorTableSize(colorTableSize), kernelFilename(kernelFilename), localWorkSizeX(localWorkSizeX), localWorkSizeY(localWorkSizeY)
+        inputImage(inputImage), outputImage(outputImage), engine(NULL), colorTableSize(colorTableSize), kernelFilename(kernelFilename), localWorkSizeX(localWorkSizeX), localWorkSizeY(localWorkSizeY),
+        command_queue(NULL), rowBegin(0), rowEnd(0), zeroCopy(false), hostInputClImage(NULL), hostOutputClImage(NULL), mappedOutput(NULL),
+        uploadSource(NULL), uploadEvent(NULL), finalizeEvent(NULL), seedingStrategy(PaletteSeeding::GrayRamp), kernelTimes(),
+        lastStats(), phaseKernelStart(0.0), bytesTransferred(0), finalSsePending(false),
+        miniBatchSize(0), miniBatchStratified(1), miniBatchSeed(0), remapLookupBits(0), indexedOutput(NULL)
     {
     }
 
+    // Borrows the context, kernels and device memory of a long lived engine.
+    KMeansGPUQuantization(OpenCLEngine* engine, Image* inputImage, Image* outputImage, unsigned int colorTableSize,
+        unsigned int localWorkSizeX = 32, unsigned int localWorkSizeY = 32) :
+        inputImage(inputImage), outputImage(outputImage), engine(engine), colorTableSize(colorTableSize), localWorkSizeX(localWorkSizeX), localWorkSizeY(localWorkSizeY),
+        command_queue(NULL), rowBegin(0), rowEnd(0), zeroCopy(false), hostInputClImage(NULL), hostOutputClImage(NULL), mappedOutput(NULL),
+        uploadSource(NULL), uploadEvent(NULL), finalizeEvent(NULL), seedingStrategy(PaletteSeeding::GrayRamp), kernelTimes(),
+        lastStats(), phaseKernelStart(0.0), bytesTransferred(0), finalSsePending(false),
+        miniBatchSize(0), miniBatchStratified(1), miniBatchSeed(0), remapLookupBits(0), indexedOutput(NULL)
+    {
+    }
+
+    unsigned int getLocalWorkSizeX() const { return localWorkSizeX; }
+    unsigned int getLocalWorkSizeY() const { return localWorkSizeY; }
+
+    void setSeedingStrategy(PaletteSeeding::Strategy strategy)
+    {
+        seedingStrategy = strategy;
+    }
+
+    // init() then starts from this palette (interleaved RGB, colorTableSize entries), e.g. the
+    // final palette of the previous frame, instead of seeding one. Empty seeds again.
+    void setInitialPalette(const std::vector<unsigned char>& rgb)
+    {
+        initialPalette = rgb;
+    }
+
     ~KMeansGPUQuantization()
     {
+        finishImages();
+    }
+
+    // Moves the quantizer to another image pair and palette size, e.g. the next job of a
+    // worker. Work still queued for the previous images is waited for; the next init() starts
+    // over on the same engine and reuses its kernels and device memory. Rows go back to the
+    // whole image, kernel times start from zero and the upload source is dropped. Indexed
+    // output is turned off for sizes it cannot hold.
+    void reset(Image* input, Image* output, unsigned int size)
+    {
+        finishImages();
+        inputImage = input;
+        outputImage = output;
+        colorTableSize = size;
+        if(colorTableSize > IndexedImage::maxColors)
+            indexedOutput = NULL;
+        rowBegin = rowEnd = 0;
+        uploadSource = NULL;
+        finalSsePending = false;
+        std::fill(kernelTimes, kernelTimes + KernelTypesNumber, 0.0);
+    }
+
+    // The final remap then builds a lookup cube with 2^bits cells per channel from the final
+    // palette on the host and maps every pixel with one lookup. 0 keeps the palette search.
+    void setRemapLookup(unsigned int bits)
+    {
+        remapLookupBits = std::min(bits, 8u);
+    }
+
+    // The final remap then runs the quantizeIndices kernel and downloads one byte per pixel
+    // into indexed instead of RGBA pixels into outputImage; finalize() also copies the
+    // palette. Ignores the remap lookup. Refused (false) for more than 256 colors; NULL
+    // turns it off.
+    bool setIndexedOutput(IndexedImage* indexed)
+    {
+        if(indexed && colorTableSize > IndexedImage::maxColors)
+            return false;
+        indexedOutput = indexed;
+        return true;
+    }
+
+    // interleaved RGB, valid after finalize()
+    const std::vector<unsigned char>& getColorTable() const
+    {
+        return colorTable;
+    }
+
+    // Iterations then only look at batchSize pixels drawn on the device and update the
+    // palette with per entry learning rates; finalize() still maps every pixel. 0 turns it
+    // off. Reassigned pixels and SSE then describe the batch.
+    void setMiniBatch(size_t batchSize, MiniBatch::Sampling sampling = MiniBatch::Stratified)
+    {
+        miniBatchSize = batchSize;
+        miniBatchStratified = sampling == MiniBatch::Stratified ? 1 : 0;
+    }
+
+    // Shares the pixels of inputImage and outputImage with the device (CL_MEM_USE_HOST_PTR)
+    // instead of copying them into engine images and back. On integrated GPUs and CPU
+    // runtimes the kernels then work on the host memory itself and the result is mapped,
+    // not read back. The images must not change size or be touched by the host between
+    // init() and the end of finalize(). An upload source is ignored in this mode.
+    void setZeroCopy(bool enabled)
+    {
+        zeroCopy = enabled;
+    }
+
+    // Uploads the input from this copy of inputImage->data instead, e.g. an engine staging
+    // buffer. It has to stay valid until the first iterate() returns.
+    void setUploadSource(const unsigned char* pixels)
+    {
+        uploadSource = pixels;
+    }
+
+    // Restricts accumulation and quantization to rows [begin, end) of the image, so several
+    // devices can share one image; end 0 selects the whole image. Mini-batch iterations
+    // still sample every row. May be changed between iterations.
+    void setRows(unsigned int begin, unsigned int end)
+    {
+        rowBegin = begin;
+        rowEnd = end;
+        if(command_queue)
+        {
+            if(rowEnd == 0 || rowEnd > imageHeight)
+            {
+                rowBegin = 0;
+                rowEnd = imageHeight;
+            }
+            setupKernels();
+        }
+    }
+
+    // Replaces the palette on the device, e.g. by one reduced over several devices. The
+    // upload is not waited for; rgb is copied first.
+    void setColorTable(const std::vector<unsigned char>& rgb)
+    {
+        colorTable = rgb;
+        packColorTable();
+        ret = clEnqueueWriteBuffer(command_queue, colorTableClBuffer, CL_FALSE, 0, paddedColorTable.size(),
+            paddedColorTable.data(), 0, NULL, NULL); trace(ret);
+        bytesTransferred += paddedColorTable.size();
+    }
+
+    // Queues one accumulate/partition pair over the rows and the download of its per entry
+    // sums. The device palette moves to the means of the rows; callers combining several
+    // devices overwrite it with setColorTable() before the next one.
+    void enqueueBandSums()
+    {
+        resetConvergence();
+        iterateAccumulation();
+        iteratePartition();
+        ret = clEnqueueReadBuffer(command_queue, countsClBuffer, CL_FALSE, 0, sizeof(cl_uint)*entrySums.size(),
+            entrySums.data(), 0, NULL, NULL); trace(ret);
+        ret = clEnqueueReadBuffer(command_queue, convergenceClBuffer, CL_FALSE, 0, sizeof(convergenceData),
+            convergenceData, 0, NULL, NULL); trace(ret);
+        bytesTransferred += sizeof(cl_uint)*entrySums.size() + sizeof(convergenceData);
+        clFlush(command_queue);
+    }
+
+    // Waits for enqueueBandSums() and adds its (pixels, r, g, b) per entry to sums and its
+    // squared error and reassigned pixels to the totals.
+    void finishBandSums(std::vector<unsigned long long>& sums, double& sse, unsigned long long& reassigned)
+    {
+        clFinish(command_queue);
+        collectKernelTimes();
+        sums.resize(entrySums.size());
+        for(size_t i = 0; i < entrySums.size(); i++)
+            sums[i] += entrySums[i];
+        sse += convergence().sse;
+        reassigned += convergenceData[0];
+    }
+
+    // Queues the remap of the rows with the current palette and their download into
+    // outputImage; finishRows() waits for it.
+    void enqueueQuantizeRows()
+    {
+        quantizeImage();
+        size_t origin[3] = {0, rowBegin, 0};
+        size_t region[3] = {imageWidth, rowEnd - rowBegin, 1};
+        ret = clEnqueueReadImage(command_queue, outputClImage, CL_FALSE, origin, region, 0, 0,
+            outputImage->data.data() + 4 * (size_t)imageWidth * rowBegin, 0, NULL, NULL); trace(ret);
+        bytesTransferred += 4 * (unsigned long long)imageWidth * (rowEnd - rowBegin);
         clFlush(command_queue);
+    }
+
+    void finishRows()
+    {
         clFinish(command_queue);
-        clReleaseKernel(accKernel);
-        clReleaseKernel(partKernel);
-        clReleaseKernel(quantKernel);
-        clReleaseMemObject(colorTableClBuffer);
-        clReleaseMemObject(partialSumsClBuffer);
-        clReleaseMemObject(outputClImage);
-        clReleaseMemObject(inputClImage);
-        clReleaseProgram(program);
-        clReleaseCommandQueue(command_queue);
-        clReleaseContext(context);
+        collectKernelTimes();
+    }
+
+    // accumulate, partition and quantize kernel time so far in milliseconds
+    double getKernelTime()
+    {
+        collectKernelTimes();
+        return kernelTimes[Accumulate] + kernelTimes[Partition] + kernelTimes[Quantize];
+    }
+
+    unsigned long long getBytesTransferred() const
+    {
+        return bytesTransferred;
     }
 
     void init()
     {
-        accGroupsX = up(inputImage->details.width, localWorkSizeX) / localWorkSizeX;
+        beginPhase();
+        if(!engine)
+        {
+            ownedEngine.reset(new OpenCLEngine(kernelFilename));
+            engine = ownedEngine.get();
+        }
+        pixelsPerItem = engine->getPixelsPerItem();
+        fitLocalWorkSize();
+        accGroupsX = up(itemsX(), localWorkSizeX) / localWorkSizeX;
+        // partial sums are sized for the whole image, setupKernels() narrows the groups to the rows
         accGroupsY = up(inputImage->details.height, localWorkSizeY) / localWorkSizeY;
         accGroupsNumber = accGroupsX * accGroupsY;
+        if(rowEnd == 0 || rowEnd > inputImage->details.height)
+        {
+            rowBegin = 0;
+            rowEnd = inputImage->details.height;
+        }
+
+        context = engine->getContext();
+        command_queue = engine->getCommandQueue();
+        accKernel = engine->getAccumulateKernel();
+        partKernel = engine->getPartitionKernel();
+        quantKernel = engine->getQuantizeKernel();
+        miniBatchAccKernel = engine->getMiniBatchAccumulateKernel();
+        miniBatchUpdateKernel = engine->getMiniBatchUpdateKernel();
+        quantizeLookupKernel = engine->getQuantizeLookupKernel();
+        quantizeIndicesKernel = engine->getQuantizeIndicesKernel();
+        miniBatchSeed = 0;
+        reseedPending = true;
 
-        initOpenCL();
-        buildKernels();
         createImageObjects();
         createBufferObjects();
-        clFinish(command_queue);
         setupKernels();
         clFlush(command_queue);
-        clFinish(command_queue);
+        endPhase(sample.size() / 3, 0, 0.0, 0);
+        // nothing is assigned yet
+        lastStats.psnr = 0.0;
     }
 
     void iterate()
     {
-        iterateAccumulation();
-        iteratePartition();
-        clFlush(command_queue);
-        clFinish(command_queue);
+        runIterations(1);
     };
 
+    // Enqueues n accumulate/partition pairs back to back and synchronizes once at the end.
+    // While iterations leave palette entries empty (and for the first one) every iteration is
+    // waited for and its dead entries are reseeded before the next is queued; once one ends
+    // without empty entries the rest are chained. Entries dying inside a chain are reseeded
+    // at its end.
+    void runIterations(unsigned int n)
+    {
+        beginPhase();
+        for(unsigned int i = 0; i + 1 < n; i++)
+        {
+            enqueueIteration();
+            if(reseedPending)
+                reseedAfterIteration();
+        }
+        if(n > 0)
+            enqueueIteration();
+        finishIterations();
+        endIterations(n);
+    }
+
+    // Runs until the largest palette shift drops below epsilon, at most maxIterations times.
+    // The convergence buffer is copied back asynchronously every checkInterval iterations and
+    // polled without blocking, so the device keeps working while the host waits for the answer;
+    // at most two checks are in flight. Dead entries are reseeded as in runIterations(n), and
+    // also when a check reports empty entries: the queue is drained, the entries reseeded and
+    // the pending checks dropped. Returns the number of iterations run.
+    unsigned int runIterations(unsigned int maxIterations, float epsilon, unsigned int checkInterval = 4)
+    {
+        const unsigned int maxPendingChecks = 2;
+        cl_uint checkData[maxPendingChecks][5];
+        cl_event checkEvents[maxPendingChecks];
+        unsigned int checkIterations[maxPendingChecks];
+        unsigned int firstCheck = 0;
+        unsigned int pendingChecks = 0;
+        unsigned int converged = 0;
+
+        beginPhase();
+        unsigned int iterations = 0;
+        bool emptyEntries = false;
+        while(iterations < maxIterations && !converged)
+        {
+            enqueueIteration();
+            iterations++;
+
+            if((reseedPending || emptyEntries) && iterations < maxIterations)
+            {
+                for(; pendingChecks > 0; pendingChecks--, firstCheck = (firstCheck + 1) % maxPendingChecks)
+                    clReleaseEvent(checkEvents[firstCheck]);
+                emptyEntries = false;
+                reseedAfterIteration();
+                continue;
+            }
+
+            if(iterations % checkInterval == 0 && iterations < maxIterations)
+            {
+                if(pendingChecks == maxPendingChecks)
+                    clWaitForEvents(1, &checkEvents[firstCheck]);
+
+                unsigned int slot = (firstCheck + pendingChecks) % maxPendingChecks;
+                if(pendingChecks == maxPendingChecks)
+                {
+                    converged = checkConverged(checkData[firstCheck], checkEvents[firstCheck], epsilon, emptyEntries) ? checkIterations[firstCheck] : 0;
+                    firstCheck = (firstCheck + 1) % maxPendingChecks;
+                    pendingChecks--;
+                }
+                ret = clEnqueueReadBuffer(command_queue, convergenceClBuffer, CL_FALSE, 0, sizeof(checkData[slot]), checkData[slot],
+                               0, NULL, &checkEvents[slot]); trace(ret);
+                bytesTransferred += sizeof(checkData[slot]);
+                checkIterations[slot] = iterations;
+                pendingChecks++;
+                clFlush(command_queue);
+            }
+
+            while(pendingChecks > 0 && !converged && !emptyEntries && isComplete(checkEvents[firstCheck]))
+            {
+                converged = checkConverged(checkData[firstCheck], checkEvents[firstCheck], epsilon, emptyEntries) ? checkIterations[firstCheck] : 0;
+                firstCheck = (firstCheck + 1) % maxPendingChecks;
+                pendingChecks--;
+            }
+        }
+
+        for(; pendingChecks > 0; pendingChecks--, firstCheck = (firstCheck + 1) % maxPendingChecks)
+            clReleaseEvent(checkEvents[firstCheck]);
+        finishIterations();
+        endIterations(iterations);
+        return iterations;
+    }
+
+    // Total device time per kernel, from CL_QUEUE_PROFILING_ENABLE events.
+    double getAccumulateKernelTime() { collectKernelTimes(); return kernelTimes[Accumulate]; }
+    double getPartitionKernelTime() { collectKernelTimes(); return kernelTimes[Partition]; }
+    double getQuantizeKernelTime() { collectKernelTimes(); return kernelTimes[Quantize]; }
+
+    Convergence convergence()
+    {
+        Convergence result;
+        result.reassignedPixels = convergenceData[0];
+        result.sse = (double)(((unsigned long long)convergenceData[2] << 32) | convergenceData[1]);
+        result.maxCentroidShift = std::sqrt((float)convergenceData[3]);
+        return result;
+    }
+
+    // After runIterations() the stats cover all of its iterations. The error of finalize()
+    // is measured on the host from the downloaded image the first time it is asked for.
+    PhaseStats stats()
+    {
+        if(finalSsePending)
+        {
+            const unsigned char* input = inputImage->data.data();
+            const unsigned char* output = outputImage->data.data();
+            double sse = 0.0;
+            for(size_t p = 0; p < (size_t)imageWidth * imageHeight; p++)
+            {
+                const unsigned char* color = indexedOutput ? &colorTable[3 * indexedOutput->indices[p]] : output + 4*p;
+                for(int c = 0; c < 3; c++)
+                    sse += (input[4*p + c] - color[c]) * (input[4*p + c] - color[c]);
+            }
+            lastStats.sse = sse;
+            lastStats.psnr = peakSignalToNoiseRatio(sse, lastStats.pixelsProcessed);
+            finalSsePending = false;
+        }
+        return lastStats;
+    }
+
 
     void finalize()
     {
-        quantizeImage();
-        getQuantizedImageFromGPU();
-        getColorTableFromGPU();
+        beginPhase();
+        enqueueFinalize();
+        clWaitForEvents(1, &finalizeEvent);
+        unpackColorTable();
+        if(indexedOutput)
+            indexedOutput->palette = colorTable;
+        endPhase((unsigned long long)imageWidth * imageHeight, remapLookupBits > 0 && !indexedOutput ? 0 : (unsigned long long)imageWidth * imageHeight * colorTableSize, 0.0, 0);
+        finalSsePending = true;
+    };
+
+private:
+    void enqueueIteration()
+    {
+        if(miniBatchSize > 0)
+        {
+            resetConvergence();
+            iterateMiniBatch();
+            return;
+        }
+        resetConvergence();
+        iterateAccumulation();
+        iteratePartition();
+    }
+
+    void beginPhase()
+    {
+        phaseTimer.start();
+        bytesTransferred = 0;
+        phaseKernelStart = kernelTimes[Accumulate] + kernelTimes[Partition] + kernelTimes[Quantize];
+        finalSsePending = false;
+    }
+
+    void endPhase(unsigned long long pixels, unsigned long long evaluations, double sse, unsigned int emptyClusters)
+    {
+        collectKernelTimes();
+        lastStats = PhaseStats();
+        lastStats.wallTime = phaseTimer.milliseconds();
+        lastStats.kernelTime = kernelTimes[Accumulate] + kernelTimes[Partition] + kernelTimes[Quantize] - phaseKernelStart;
+        lastStats.bytesTransferred = bytesTransferred;
+        lastStats.pixelsProcessed = pixels;
+        lastStats.distanceEvaluations = evaluations;
+        lastStats.sse = sse;
+        lastStats.psnr = peakSignalToNoiseRatio(sse, pixels);
+        lastStats.emptyClusters = emptyClusters;
+    }
+
+    // SSE and empty entries are those of the last of the iterations.
+    void endIterations(unsigned int iterations)
+    {
+        unsigned long long samples = miniBatchSize > 0 ? miniBatchSize : (unsigned long long)imageWidth * imageHeight;
+        endPhase(samples * iterations, samples * iterations * colorTableSize, convergence().sse, convergenceData[4]);
+        lastStats.psnr = peakSignalToNoiseRatio(lastStats.sse, samples);
+    }
+
+    // Waits for the queued iterations and reseeds the entries the last one left empty.
+    void reseedAfterIteration()
+    {
+        getConvergenceFromGPU();
+        reseedPending = convergenceData[4] != 0;
+        if(reseedPending)
+            reseedEmptyEntries();
+    }
+
+    void finishIterations()
+    {
+        reseedAfterIteration();
         clFlush(command_queue);
         clFinish(command_queue);
-    };
+        collectKernelTimes();
+    }
 
-private: 
+    // Waits for everything queued for the current images and lets go of them.
+    void finishImages()
+    {
+        if(finalizeEvent)
+        {
+            clWaitForEvents(1, &finalizeEvent);
+            clReleaseEvent(finalizeEvent);
+            finalizeEvent = NULL;
+        }
+        else if(engine)
+        {
+            clFlush(engine->getCommandQueue());
+            clFinish(engine->getCommandQueue());
+        }
+        if(uploadEvent)
+        {
+            clReleaseEvent(uploadEvent);
+            uploadEvent = NULL;
+        }
+        collectKernelTimes();
+        releaseHostImages();
+    }
 
-    void initOpenCL()
+    bool isComplete(cl_event event)
     {
-        ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms); trace(ret);
-        ret = clGetDeviceIDs( platform_id, CL_DEVICE_TYPE_ALL, 1, &device_id, &ret_num_devices); trace(ret);
-        context = clCreateContext( NULL, 1, &device_id, NULL, NULL, &ret); trace(ret);
-        command_queue = clCreateCommandQueueWithProperties(context, device_id, 0, &ret); trace(ret);
+        cl_int status;
+        clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        return status == CL_COMPLETE;
     }
 
-    void buildKernels()
+    // A check with empty entries never converges: they are reseeded, which moves them.
+    bool checkConverged(const cl_uint* data, cl_event event, float epsilon, bool& emptyEntries)
     {
-        std::vector<std::string> sources;
-        for(auto file : {kernelFilename})
-            sources.push_back(readFile(file));
-        auto [numberOfFiles, strings, lengths] = prepareSourcesForCL(sources);
+        clReleaseEvent(event);
+        emptyEntries = data[4] != 0;
+        return !emptyEntries && std::sqrt((float)data[3]) < epsilon;
+    }
 
-        program = clCreateProgramWithSource(context, numberOfFiles, strings.data(), lengths.data(), &ret); trace(ret);
-        ret = clBuildProgram(program, 1, &device_id, NULL, NULL, NULL); trace(ret);
-        if(ret != 0)
+    cl_event* recordKernel(KernelType type)
+    {
+        kernelEvents.push_back(std::make_pair(type, cl_event(NULL)));
+        return &kernelEvents.back().second;
+    }
+
+    void collectKernelTimes()
+    {
+        for(auto& kernelEvent : kernelEvents)
         {
-            size_t len;
-            clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &len);
-            std::string logs;
-            logs.resize(len);
-            clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, logs.data(), NULL);
-            std::cout<<"Kernel compilation error: "<<std::endl<<logs<<std::endl;
+            cl_ulong start = 0, end = 0;
+            clWaitForEvents(1, &kernelEvent.second);
+            clGetEventProfilingInfo(kernelEvent.second, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(kernelEvent.second, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            kernelTimes[kernelEvent.first] += (end - start) * 1e-6;
+            clReleaseEvent(kernelEvent.second);
         }
+        kernelEvents.clear();
+    }
 
-        accKernel = clCreateKernel(program, "accumulate", &ret); trace(ret);
-        partKernel = clCreateKernel(program, "partition", &ret); trace(ret);
-        quantKernel = clCreateKernel(program, "quantize", &ret); trace(ret);
+public:
+    // Queues the quantization and the downloads without waiting. outputImage is complete
+    // once getFinalizeEvent() has completed.
+    void enqueueFinalize()
+    {
+        if(indexedOutput)
+            quantizeIndices();
+        else
+        {
+            if(remapLookupBits > 0)
+                quantizeImageWithLookup();
+            else
+                quantizeImage();
+            if(zeroCopy)
+                mapQuantizedImage();
+            else
+                getQuantizedImageFromGPU(CL_FALSE);
+        }
+        getColorTableFromGPU(CL_FALSE);
+        if(finalizeEvent)
+            clReleaseEvent(finalizeEvent);
+        ret = clEnqueueMarkerWithWaitList(command_queue, 0, NULL, &finalizeEvent); trace(ret);
+        clFlush(command_queue);
     }
 
+    cl_event getFinalizeEvent() const
+    {
+        return finalizeEvent;
+    }
+
+private: 
 
-void createImageObjects()
+    // Halves the requested local size until the device and the kernels accept it.
+    void fitLocalWorkSize()
     {
-        clImageFormat = {CL_RGBA, CL_UNSIGNED_INT8};
-        clImageDesc = {
-            CL_MEM_OBJECT_IMAGE2D,          /* cl_mem_object_type image_type, */
-            inputImage->details.width,      /* size_t image_width; */
-            inputImage->details.height,     /* size_t image_height; */
-            1,                              /* size_t image_depth; */
-            1,                              /* size_t image_array_size; */
-            0,                              /* size_t image_row_pitch; */ // OpenCL will calculate this
-            0,                              /* size_t image_slice_pitch; */ // as above
-            0,                              /* cl_uint num_mip_levels; */
-            0,                              /* cl_uint num_samples; */
-            NULL                            /* cl_mem mem_object; */ 
-        };
-        inputClImage = clCreateImage(context, CL_MEM_READ_WRITE, &clImageFormat, &clImageDesc, inputImage->data.data(), &ret); trace(ret);
-        outputClImage = clCreateImage(context, CL_MEM_READ_WRITE, &clImageFormat, &clImageDesc, outputImage->data.data(), &ret); trace(ret);
+        size_t maxWorkGroupSize = engine->getMaxWorkGroupSize();
+        std::vector<size_t> maxWorkItemSizes = engine->getMaxWorkItemSizes();
+        size_t maxX = maxWorkItemSizes.size() > 0 ? maxWorkItemSizes[0] : maxWorkGroupSize;
+        size_t maxY = maxWorkItemSizes.size() > 1 ? maxWorkItemSizes[1] : maxWorkGroupSize;
+        while(localWorkSizeX * localWorkSizeY > maxWorkGroupSize || localWorkSizeX > maxX || localWorkSizeY > maxY)
+        {
+            if(localWorkSizeX > maxX || (localWorkSizeY <= maxY && localWorkSizeX >= localWorkSizeY))
+                localWorkSizeX = std::max(1u, localWorkSizeX / 2);
+            else
+                localWorkSizeY = std::max(1u, localWorkSizeY / 2);
+            if(localWorkSizeX * localWorkSizeY == 1)
+                break;
+        }
+    }
+
+    // work-items per row, each covering pixelsPerItem pixels
+    unsigned int itemsX() const
+    {
+        return (inputImage->details.width + pixelsPerItem - 1) / pixelsPerItem;
+    }
+
+    void packColorTable()
+    {
+        paddedColorTable.assign(4 * colorTableSize, 0);
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            std::copy(&colorTable[3*i], &colorTable[3*i] + 3, &paddedColorTable[4*i]);
+    }
+
+    void unpackColorTable()
+    {
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            std::copy(&paddedColorTable[4*i], &paddedColorTable[4*i] + 3, &colorTable[3*i]);
+    }
+
+    void createImageObjects()
+    {
+        imageWidth = inputImage->details.width;
+        imageHeight = inputImage->details.height;
 
         imageOrigin[0] = 0;
         imageOrigin[1] = 0;
@@ -166,62 +704,85 @@ void createImageObjects()
         imageRegion[1] = inputImage->details.height;
         imageRegion[2] = 1;
 
+        if(zeroCopy)
+        {
+            createHostImages();
+            return;
+        }
+        engine->getImages(imageWidth, imageHeight, inputClImage, outputClImage);
+
         ret = clEnqueueWriteImage(command_queue,
                                inputClImage,
-                               CL_TRUE,
+                               CL_FALSE,
                                imageOrigin, /*const size_t *origin,*/
                                imageRegion, /*const size_t *region,*/
                                0, /*size_t input_row_pitch,*/ // OpenCL will calculate this
                                0, /*size_t input_slice_pitch,*/ // as above
-                               inputImage->data.data(), /*const void *ptr,*/
+                               uploadSource ? uploadSource : inputImage->data.data(), /*const void *ptr,*/
                                0, /*cl_uint num_events_in_wait_list,*/
                                NULL, /*const cl_event *event_wait_list,*/
-                               NULL /*cl_event *event*/
+                               &uploadEvent /*cl_event *event*/
                             ); trace(ret);
+        bytesTransferred += 4 * (unsigned long long)imageWidth * imageHeight;
 
     }
 
     void createBufferObjects()
     {
-        colorTable.resize(colorTableSize * 3);
-        for(int i = 0; i < colorTableSize; i++)
-        {   
-            colorTable[3*i] = (i * 255) / colorTableSize ;
-            colorTable[3*i+1] = (i * 255) / colorTableSize ;
-            colorTable[3*i+2] = (i * 255) / colorTableSize;
-        }
+        sample = PaletteSeeding::samplePixels<RGBALayout>(inputImage->data.data(), inputImage->details.width*inputImage->details.height);
+        colorTable = initialPalette.size() == 3*colorTableSize ? initialPalette : PaletteSeeding::seed(seedingStrategy, sample, colorTableSize);
+        packColorTable();
 
-        colorTableClBuffer = clCreateBuffer(context,
-                          CL_MEM_READ_WRITE,
-                          sizeof(unsigned char)*colorTable.size(),
-                          NULL,
-                          &ret); trace(ret);
+        colorTableClBuffer = engine->getBuffer(OpenCLEngine::ColorTable, sizeof(unsigned char)*paddedColorTable.size());
 
         ret = clEnqueueWriteBuffer(command_queue,
                                colorTableClBuffer, /*cl_mem buffer,*/
                                CL_TRUE, /*cl_bool blocking_write,*/
                                0, /* size_t offset, */
-                               sizeof(unsigned char)*colorTable.size(), /*size_t size,*/
-                               colorTable.data(), /*const void *ptr,*/
+                               sizeof(unsigned char)*paddedColorTable.size(), /*size_t size,*/
+                               paddedColorTable.data(), /*const void *ptr,*/
                                0, /*cl_uint num_events_in_wait_list,*/
                                NULL, /* const cl_event *event_wait_list, */
                                NULL /*cl_event *event */); trace(ret);
+        bytesTransferred += paddedColorTable.size();
 
-        partialSums.resize(4*accGroupsX *accGroupsY * colorTableSize);
-        partialSumsClBuffer = clCreateBuffer(context,
-                          CL_MEM_READ_WRITE,
-                          sizeof(unsigned int)*partialSums.size(),
-                          NULL,
-                          &ret); trace(ret);
-        ret = clEnqueueWriteBuffer(command_queue,
-                               partialSumsClBuffer, /*cl_mem buffer,*/
-                               CL_TRUE, /*cl_bool blocking_write,*/
-                               0, /* size_t offset, */
-                               sizeof(unsigned int)*partialSums.size(), /*size_t size,*/
-                               partialSums.data(), /*const void *ptr,*/
-                               0, /*cl_uint num_events_in_wait_list,*/
-                               NULL, /* const cl_event *event_wait_list, */
-                               NULL /*cl_event *event */); trace(ret);
+        size_t partialSumsSize = sizeof(unsigned int)*4*accGroupsX *accGroupsY * colorTableSize;
+        cl_uint zero = 0;
+        partialSumsClBuffer = engine->getBuffer(OpenCLEngine::PartialSums, partialSumsSize);
+        ret = clEnqueueFillBuffer(command_queue, partialSumsClBuffer, &zero, sizeof(cl_uint), 0, partialSumsSize, 0, NULL, NULL); trace(ret);
+
+        // labels start out invalid, so the first iteration counts every pixel as reassigned
+        cl_uint invalidLabel = 0xFFFFFFFF;
+        labelsClBuffer = engine->getBuffer(OpenCLEngine::Labels, sizeof(cl_uint)*inputImage->details.width*inputImage->details.height);
+        ret = clEnqueueFillBuffer(command_queue, labelsClBuffer, &invalidLabel, sizeof(cl_uint), 0, 
+                               sizeof(cl_uint)*inputImage->details.width*inputImage->details.height, 0, NULL, NULL); trace(ret);
+
+        memset(convergenceData, 0, sizeof(convergenceData));
+        convergenceClBuffer = engine->getBuffer(OpenCLEngine::Convergence, sizeof(convergenceData));
+
+        counts.resize(colorTableSize);
+        entrySums.resize(4 * colorTableSize);
+        countsClBuffer = engine->getBuffer(OpenCLEngine::Counts, sizeof(cl_uint)*entrySums.size());
+
+        if(miniBatchSize > 0)
+        {
+            miniBatchCentersClBuffer = engine->getBuffer(OpenCLEngine::MiniBatchCenters, sizeof(cl_float)*4*colorTableSize);
+            writeMiniBatchCenters(0, colorTableSize);
+            miniBatchSeenClBuffer = engine->getBuffer(OpenCLEngine::MiniBatchSeen, sizeof(cl_uint)*colorTableSize);
+            ret = clEnqueueFillBuffer(command_queue, miniBatchSeenClBuffer, &zero, sizeof(cl_uint), 0, sizeof(cl_uint)*colorTableSize, 0, NULL, NULL); trace(ret);
+        }
+    }
+
+    // float centers of entries [begin, end) from the host palette
+    void writeMiniBatchCenters(unsigned int begin, unsigned int end)
+    {
+        std::vector<cl_float> centers(4*(end - begin), 0.0f);
+        for(unsigned int i = begin; i < end; i++)
+            for(int c = 0; c < 3; c++)
+                centers[4*(i - begin) + c] = colorTable[3*i + c];
+        ret = clEnqueueWriteBuffer(command_queue, miniBatchCentersClBuffer, CL_TRUE, sizeof(cl_float)*4*begin, sizeof(cl_float)*centers.size(), 
+                               centers.data(), 0, NULL, NULL); trace(ret);
+        bytesTransferred += sizeof(cl_float)*centers.size();
     }
 
 
@@ -230,19 +791,40 @@ void createImageObjects()
         acc_local_work_size[0] = localWorkSizeX;
         acc_local_work_size[1] = localWorkSizeY;
         acc_local_work_size[2] = 1;
-        acc_global_work_size[0] = up(inputImage->details.width, localWorkSizeX);
-        acc_global_work_size[1] = up(inputImage->details.height, localWorkSizeY);
+        accGroupsY = up(rowEnd - rowBegin, localWorkSizeY) / localWorkSizeY;
+        accGroupsNumber = accGroupsX * accGroupsY;
+        rowOffset[0] = 0;
+        rowOffset[1] = rowBegin;
+        rowOffset[2] = 0;
+        rowLimit = rowEnd;
+
+        acc_global_work_size[0] = up(itemsX(), localWorkSizeX);
+        acc_global_work_size[1] = up(rowEnd - rowBegin, localWorkSizeY);
         acc_global_work_size[2] = 1;
         clSetKernelArg(accKernel, 0, sizeof(cl_mem), (void *)&inputClImage);
         clSetKernelArg(accKernel, 1, sizeof(unsigned int), (void *)&colorTableSize);
         clSetKernelArg(accKernel, 2, sizeof(cl_mem), (void *)&colorTableClBuffer);
         clSetKernelArg(accKernel, 3, sizeof(cl_mem), (void *)&partialSumsClBuffer);
-        clSetKernelArg(accKernel, 4, 4*localWorkSizeX*localWorkSizeY*sizeof(unsigned int), NULL);
+        bool localHistogram = engine->getAccumulationStrategy() == OpenCLEngine::LocalHistogram;
+        size_t accLocalSize = localHistogram ? (4*colorTableSize + 2)*sizeof(unsigned int) : 4*localWorkSizeX*localWorkSizeY*sizeof(unsigned int);
+        clSetKernelArg(accKernel, 4, accLocalSize, NULL);
+        clSetKernelArg(accKernel, 5, sizeof(cl_mem), (void *)&labelsClBuffer);
+        clSetKernelArg(accKernel, 6, sizeof(cl_mem), (void *)&convergenceClBuffer);
+        clSetKernelArg(accKernel, 7, sizeof(cl_uint), (void *)&imageWidth);
+        clSetKernelArg(accKernel, 8, sizeof(cl_uint), (void *)&rowLimit);
 
-        part_local_work_size[0] = localWorkSizeX;
+        // the local histogram partition reduces with one work-group per entry
+        unsigned int partLocalWorkSize = localWorkSizeX;
+        if(localHistogram)
+        {
+            partLocalWorkSize = 1;
+            while(partLocalWorkSize < accGroupsNumber && partLocalWorkSize < 256 && 2 * partLocalWorkSize <= engine->getMaxWorkGroupSize())
+                partLocalWorkSize *= 2;
+        }
+        part_local_work_size[0] = partLocalWorkSize;
         part_local_work_size[1] = 1; 
         part_local_work_size[2] = 1;
-        part_global_work_size[0] = up(colorTableSize, localWorkSizeX);
+        part_global_work_size[0] = localHistogram ? colorTableSize * partLocalWorkSize : up(colorTableSize, localWorkSizeX);
         part_global_work_size[1] = 1;
         part_global_work_size[2] = 1;
         clSetKernelArg(partKernel, 0, sizeof(unsigned int), (void *)&colorTableSize);
@@ -250,99 +832,296 @@ void createImageObjects()
         clSetKernelArg(partKernel, 2, sizeof(cl_mem), (void *)&partialSumsClBuffer);
         clSetKernelArg(partKernel, 3, sizeof(unsigned int), (void *)&accGroupsNumber);
         clSetKernelArg(partKernel, 4, sizeof(unsigned int), (void *)&accGroupsX);
+        clSetKernelArg(partKernel, 5, sizeof(cl_mem), (void *)&convergenceClBuffer);
+        clSetKernelArg(partKernel, 6, sizeof(cl_mem), (void *)&countsClBuffer);
+        if(localHistogram)
+            clSetKernelArg(partKernel, 7, 4*partLocalWorkSize*sizeof(unsigned int), NULL);
         
         quant_local_work_size[0] = localWorkSizeX;
         quant_local_work_size[1] = localWorkSizeY; 
         quant_local_work_size[2] = 1;
-        quant_global_work_size[0] = up(inputImage->details.width, localWorkSizeX);
-        quant_global_work_size[1] = up(inputImage->details.height, localWorkSizeY);
+        quant_global_work_size[0] = up(itemsX(), localWorkSizeX);
+        quant_global_work_size[1] = up(rowEnd - rowBegin, localWorkSizeY);
         quant_global_work_size[2] = 1;
         clSetKernelArg(quantKernel, 0, sizeof(cl_mem), (void *)&inputClImage);
         clSetKernelArg(quantKernel, 1, sizeof(unsigned int), (void *)&colorTableSize);
         clSetKernelArg(quantKernel, 2, sizeof(cl_mem), (void *)&colorTableClBuffer);
         clSetKernelArg(quantKernel, 3, sizeof(cl_mem), (void *)&outputClImage);
+        clSetKernelArg(quantKernel, 4, sizeof(cl_uint), (void *)&imageWidth);
+        clSetKernelArg(quantKernel, 5, sizeof(cl_uint), (void *)&rowLimit);
+
+        if(miniBatchSize == 0)
+            return;
+
+        // every stratum needs at least one pixel
+        miniBatchSize = std::min<size_t>(miniBatchSize, (size_t)imageWidth * imageHeight);
+        mini_local_work_size[0] = localWorkSizeX;
+        mini_local_work_size[1] = 1;
+        mini_local_work_size[2] = 1;
+        mini_acc_global_work_size[0] = up(miniBatchSize, localWorkSizeX);
+        mini_acc_global_work_size[1] = 1;
+        mini_acc_global_work_size[2] = 1;
+        clSetKernelArg(miniBatchAccKernel, 0, sizeof(cl_mem), (void *)&inputClImage);
+        clSetKernelArg(miniBatchAccKernel, 1, sizeof(unsigned int), (void *)&colorTableSize);
+        clSetKernelArg(miniBatchAccKernel, 2, sizeof(cl_mem), (void *)&colorTableClBuffer);
+        clSetKernelArg(miniBatchAccKernel, 3, sizeof(cl_mem), (void *)&partialSumsClBuffer);
+        clSetKernelArg(miniBatchAccKernel, 4, sizeof(cl_mem), (void *)&labelsClBuffer);
+        clSetKernelArg(miniBatchAccKernel, 5, sizeof(cl_mem), (void *)&convergenceClBuffer);
+        clSetKernelArg(miniBatchAccKernel, 6, sizeof(cl_uint), (void *)&imageWidth);
+        clSetKernelArg(miniBatchAccKernel, 7, sizeof(cl_uint), (void *)&imageHeight);
+        clSetKernelArg(miniBatchAccKernel, 8, sizeof(cl_uint), (void *)&miniBatchSize);
+        clSetKernelArg(miniBatchAccKernel, 9, sizeof(cl_uint), (void *)&miniBatchStratified);
+
+        mini_update_global_work_size[0] = up(colorTableSize, localWorkSizeX);
+        mini_update_global_work_size[1] = 1;
+        mini_update_global_work_size[2] = 1;
+        clSetKernelArg(miniBatchUpdateKernel, 0, sizeof(unsigned int), (void *)&colorTableSize);
+        clSetKernelArg(miniBatchUpdateKernel, 1, sizeof(cl_mem), (void *)&colorTableClBuffer);
+        clSetKernelArg(miniBatchUpdateKernel, 2, sizeof(cl_mem), (void *)&partialSumsClBuffer);
+        clSetKernelArg(miniBatchUpdateKernel, 3, sizeof(cl_mem), (void *)&miniBatchCentersClBuffer);
+        clSetKernelArg(miniBatchUpdateKernel, 4, sizeof(cl_mem), (void *)&miniBatchSeenClBuffer);
+        clSetKernelArg(miniBatchUpdateKernel, 5, sizeof(cl_mem), (void *)&convergenceClBuffer);
+        clSetKernelArg(miniBatchUpdateKernel, 6, sizeof(cl_mem), (void *)&countsClBuffer);
+    }
+
+    void iterateMiniBatch()
+    {
+        // the seed is taken when the launch is queued, so every queued iteration draws its own batch
+        clSetKernelArg(miniBatchAccKernel, 10, sizeof(cl_uint), (void *)&miniBatchSeed);
+        miniBatchSeed++;
+        cl_uint waitListSize = uploadEvent ? 1 : 0;
+        ret = clEnqueueNDRangeKernel(command_queue, miniBatchAccKernel, 1, NULL, mini_acc_global_work_size, mini_local_work_size, waitListSize, uploadEvent ? &uploadEvent : NULL, recordKernel(Accumulate)); trace(ret);
+        if(uploadEvent)
+        {
+            clReleaseEvent(uploadEvent);
+            uploadEvent = NULL;
+        }
+        ret = clEnqueueNDRangeKernel(command_queue, miniBatchUpdateKernel, 1, NULL, mini_update_global_work_size, mini_local_work_size, 0, NULL, recordKernel(Partition)); trace(ret);
     }
 
     void iterateAccumulation()
     {
-        ret = clEnqueueNDRangeKernel(command_queue, accKernel, 2, NULL, acc_global_work_size, acc_local_work_size, 0, NULL, NULL); trace(ret);
+        cl_uint waitListSize = uploadEvent ? 1 : 0;
+        ret = clEnqueueNDRangeKernel(command_queue, accKernel, 2, rowOffset, acc_global_work_size, acc_local_work_size, waitListSize, uploadEvent ? &uploadEvent : NULL, recordKernel(Accumulate)); trace(ret);
+        if(uploadEvent)
+        {
+            clReleaseEvent(uploadEvent);
+            uploadEvent = NULL;
+        }
     }
 
     void iteratePartition()
     {
 
-        ret = clEnqueueNDRangeKernel(command_queue, partKernel, 1, NULL, part_global_work_size, part_local_work_size, 0, NULL, NULL); trace(ret);
+        ret = clEnqueueNDRangeKernel(command_queue, partKernel, 1, NULL, part_global_work_size, part_local_work_size, 0, NULL, recordKernel(Partition)); trace(ret);
     }
 
-    void quantizeImage()
+    void resetConvergence()
     {
-        ret = clEnqueueNDRangeKernel(command_queue, quantKernel, 2, NULL, quant_global_work_size, quant_local_work_size, 0, NULL, NULL); trace(ret);
+        cl_uint zero = 0;
+        ret = clEnqueueFillBuffer(command_queue, convergenceClBuffer, &zero, sizeof(cl_uint), 0, sizeof(convergenceData), 0, NULL, NULL); trace(ret);
     }
 
-    void getQuantizedImageFromGPU()
+    void getConvergenceFromGPU()
     {
-        ret = clEnqueueReadImage(command_queue, 
-            outputClImage, 
-            CL_TRUE, 
-            imageOrigin, /*  const size_t *origin */
-            imageRegion, /* const size_t *region, */
-            0,  /* size_t input_row_pitch, */ //OpenCl Will calculate this
-            0,  /* size_t input_slice_pitch, */
-            outputImage->data.data(), /*  const void *ptr,*/
-            0, /* cl_uint num_events_in_wait_list, */ 
-            NULL, /* const cl_event *event_wait_list, */  
-            NULL /*  cl_event *event */
-        ); trace(ret);
-
+        ret = clEnqueueReadBuffer(command_queue,
+                               convergenceClBuffer, /*cl_mem buffer,*/
+                               CL_TRUE, /*cl_bool blocking_write,*/
+                               0, /* size_t offset, */
+                               sizeof(convergenceData), /*size_t size,*/
+                               convergenceData, /*const void *ptr,*/
+                               0, /*cl_uint num_events_in_wait_list,*/
+                               NULL, /* const cl_event *event_wait_list, */
+                               NULL /*cl_event *event */); trace(ret);
+        bytesTransferred += sizeof(convergenceData);
     }
 
-    void getColorTableFromGPU()
+    // Moves palette entries that got no pixels on the host and reports the move as a shift.
+    void reseedEmptyEntries()
     {
+        getColorTableFromGPU();
+        unpackColorTable();
         ret = clEnqueueReadBuffer(command_queue,
+                               countsClBuffer, /*cl_mem buffer,*/
+                               CL_TRUE, /*cl_bool blocking_write,*/
+                               0, /* size_t offset, */
+                               sizeof(cl_uint)*entrySums.size(), /*size_t size,*/
+                               entrySums.data(), /*const void *ptr,*/
+                               0, /*cl_uint num_events_in_wait_list,*/
+                               NULL, /* const cl_event *event_wait_list, */
+                               NULL /*cl_event *event */); trace(ret);
+        bytesTransferred += sizeof(cl_uint)*entrySums.size();
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            counts[i] = entrySums[4*i];
+
+        std::vector<unsigned char> previous = colorTable;
+        PaletteSeeding::reseedDeadEntries(colorTable, counts, sample);
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            cl_uint shift = 0;
+            for(int c = 0; c < 3; c++)
+                shift += (colorTable[3*i + c] - previous[3*i + c]) * (colorTable[3*i + c] - previous[3*i + c]);
+            convergenceData[3] = std::max(convergenceData[3], shift);
+            if(miniBatchSize > 0 && shift > 0)
+                writeMiniBatchCenters(i, i + 1);
+        }
+        packColorTable();
+
+        ret = clEnqueueWriteBuffer(command_queue,
                                colorTableClBuffer, /*cl_mem buffer,*/
                                CL_TRUE, /*cl_bool blocking_write,*/
                                0, /* size_t offset, */
-                               sizeof(unsigned char)*colorTable.size(), /*size_t size,*/
-                               colorTable.data(), /*const void *ptr,*/
+                               sizeof(unsigned char)*paddedColorTable.size(), /*size_t size,*/
+                               paddedColorTable.data(), /*const void *ptr,*/
                                0, /*cl_uint num_events_in_wait_list,*/
                                NULL, /* const cl_event *event_wait_list, */
                                NULL /*cl_event *event */); trace(ret);
+        bytesTransferred += paddedColorTable.size();
+    }
+
+    void quantizeImage()
+    {
+        ret = clEnqueueNDRangeKernel(command_queue, quantKernel, 2, rowOffset, quant_global_work_size, quant_local_work_size, 0, NULL, recordKernel(Quantize)); trace(ret);
     }
 
-    std::string readFile(std::string filename)
+    // Needs the final palette on the host to build the cube, so it waits for the iterations.
+    void quantizeImageWithLookup()
     {
-            std::FILE *file = std::fopen(filename.c_str(), "r");
-            if(!file)
-                    std::cout<<"Problem with opening: "<<filename<<std::endl;
+        getColorTableFromGPU();
+        unpackColorTable();
+        colorLookup.build(colorTable.data(), colorTableSize, remapLookupBits);
 
-            std::string content;
-            std::fseek(file, 0, SEEK_END);
-            content.resize(std::ftell(file));
-            std::rewind(file);
-            std::fread(&content[0], sizeof(char), content.size(), file);
-            std::fclose(file);
-            return std::move(content);
+        const std::vector<unsigned int>& cells = colorLookup.getCells();
+        const std::vector<unsigned int>& candidates = colorLookup.getCandidates();
+        lookupCellsClBuffer = engine->getBuffer(OpenCLEngine::LookupCells, sizeof(cl_uint)*cells.size());
+        ret = clEnqueueWriteBuffer(command_queue, lookupCellsClBuffer, CL_FALSE, 0, sizeof(cl_uint)*cells.size(), cells.data(), 0, NULL, NULL); trace(ret);
+        bytesTransferred += sizeof(cl_uint)*(cells.size() + candidates.size());
+        // the candidate list may be empty, the buffer may not
+        lookupCandidatesClBuffer = engine->getBuffer(OpenCLEngine::LookupCandidates, sizeof(cl_uint)*std::max<size_t>(1, candidates.size()));
+        if(!candidates.empty())
+        {
+            ret = clEnqueueWriteBuffer(command_queue, lookupCandidatesClBuffer, CL_FALSE, 0, sizeof(cl_uint)*candidates.size(), candidates.data(), 0, NULL, NULL); trace(ret);
+        }
+
+        clSetKernelArg(quantizeLookupKernel, 0, sizeof(cl_mem), (void *)&inputClImage);
+        clSetKernelArg(quantizeLookupKernel, 1, sizeof(unsigned int), (void *)&colorTableSize);
+        clSetKernelArg(quantizeLookupKernel, 2, sizeof(cl_mem), (void *)&colorTableClBuffer);
+        clSetKernelArg(quantizeLookupKernel, 3, sizeof(cl_mem), (void *)&lookupCellsClBuffer);
+        clSetKernelArg(quantizeLookupKernel, 4, sizeof(cl_mem), (void *)&lookupCandidatesClBuffer);
+        clSetKernelArg(quantizeLookupKernel, 5, sizeof(cl_uint), (void *)&remapLookupBits);
+        clSetKernelArg(quantizeLookupKernel, 6, sizeof(cl_mem), (void *)&outputClImage);
+        clSetKernelArg(quantizeLookupKernel, 7, sizeof(cl_uint), (void *)&imageWidth);
+        clSetKernelArg(quantizeLookupKernel, 8, sizeof(cl_uint), (void *)&rowLimit);
+        ret = clEnqueueNDRangeKernel(command_queue, quantizeLookupKernel, 2, rowOffset, quant_global_work_size, quant_local_work_size, 0, NULL, recordKernel(Quantize)); trace(ret);
     }
 
-    struct OpenCLProgram
+    // Maps rows [rowBegin, rowEnd) to palette indices and queues a non-blocking download of one
+    // byte per pixel into indexedOutput; finalize() waits for it through finalizeEvent.
+    void quantizeIndices()
     {
-        size_t file;
-        std::vector<const char*> strings;
-        std::vector<size_t> lengths;
-    };
+        indexedOutput->width = imageWidth;
+        indexedOutput->height = imageHeight;
+        indexedOutput->indices.resize((size_t)imageWidth * imageHeight);
+        indicesClBuffer = engine->getBuffer(OpenCLEngine::Indices, indexedOutput->indices.size());
+
+        clSetKernelArg(quantizeIndicesKernel, 0, sizeof(cl_mem), (void *)&inputClImage);
+        clSetKernelArg(quantizeIndicesKernel, 1, sizeof(unsigned int), (void *)&colorTableSize);
+        clSetKernelArg(quantizeIndicesKernel, 2, sizeof(cl_mem), (void *)&colorTableClBuffer);
+        clSetKernelArg(quantizeIndicesKernel, 3, sizeof(cl_mem), (void *)&indicesClBuffer);
+        clSetKernelArg(quantizeIndicesKernel, 4, sizeof(cl_uint), (void *)&imageWidth);
+        clSetKernelArg(quantizeIndicesKernel, 5, sizeof(cl_uint), (void *)&rowLimit);
+        ret = clEnqueueNDRangeKernel(command_queue, quantizeIndicesKernel, 2, rowOffset, quant_global_work_size, quant_local_work_size, 0, NULL, recordKernel(Quantize)); trace(ret);
+
+        size_t offset = (size_t)imageWidth * rowBegin;
+        size_t size = (size_t)imageWidth * (rowEnd - rowBegin);
+        ret = clEnqueueReadBuffer(command_queue, indicesClBuffer, CL_FALSE, offset, size, indexedOutput->indices.data() + offset, 0, NULL, NULL); trace(ret);
+        bytesTransferred += size;
+    }
+
+    // Images of exactly the input size over the Image storage, which is page aligned.
+    void createHostImages()
+    {
+        releaseHostImages();
+
+        cl_image_format clImageFormat = {CL_RGBA, CL_UNSIGNED_INT8};
+        cl_image_desc clImageDesc = {
+            CL_MEM_OBJECT_IMAGE2D,          /* cl_mem_object_type image_type, */
+            imageWidth,                     /* size_t image_width; */
+            imageHeight,                    /* size_t image_height; */
+            1,                              /* size_t image_depth; */
+            1,                              /* size_t image_array_size; */
+            0,                              /* size_t image_row_pitch; */ // tightly packed rows
+            0,                              /* size_t image_slice_pitch; */
+            0,                              /* cl_uint num_mip_levels; */
+            0,                              /* cl_uint num_samples; */
+            NULL                            /* cl_mem mem_object; */
+        };
+        hostInputClImage = clCreateImage(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, &clImageFormat, &clImageDesc,
+            inputImage->data.data(), &ret); trace(ret);
+        hostOutputClImage = clCreateImage(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, &clImageFormat, &clImageDesc,
+            outputImage->data.data(), &ret); trace(ret);
+        inputClImage = hostInputClImage;
+        outputClImage = hostOutputClImage;
+    }
 
-    OpenCLProgram prepareSourcesForCL(const std::vector<std::string>& sources)
+    void releaseHostImages()
     {
-        std::vector<size_t> lengths(sources.size());
-        std::vector<const char*> strings(sources.size());
+        if(mappedOutput)
+        {
+            ret = clEnqueueUnmapMemObject(engine->getCommandQueue(), hostOutputClImage, mappedOutput, 0, NULL, NULL); trace(ret);
+            mappedOutput = NULL;
+        }
+        if(hostInputClImage)
+            clReleaseMemObject(hostInputClImage);
+        if(hostOutputClImage)
+            clReleaseMemObject(hostOutputClImage);
+        hostInputClImage = NULL;
+        hostOutputClImage = NULL;
+    }
 
-        for(int i = 0; i < sources.size(); i++)
+    // Makes the quantized pixels visible in outputImage->data: for a CL_MEM_USE_HOST_PTR image
+    // the mapped pointer is the host storage, so nothing is copied where memory is shared.
+    void mapQuantizedImage()
+    {
+        if(mappedOutput)
         {
-            strings[i] = sources[i].c_str();
-            lengths[i] = sources[i].size();
+            ret = clEnqueueUnmapMemObject(command_queue, hostOutputClImage, mappedOutput, 0, NULL, NULL); trace(ret);
         }
+        size_t rowPitch;
+        mappedOutput = clEnqueueMapImage(command_queue, hostOutputClImage, CL_FALSE, CL_MAP_READ, imageOrigin, imageRegion,
+            &rowPitch, NULL, 0, NULL, NULL, &ret); trace(ret);
+    }
+
+    void getQuantizedImageFromGPU(cl_bool blocking = CL_TRUE)
+    {
+        ret = clEnqueueReadImage(command_queue, 
+            outputClImage, 
+            blocking, 
+            imageOrigin, /*  const size_t *origin */
+            imageRegion, /* const size_t *region, */
+            0,  /* size_t input_row_pitch, */ //OpenCl Will calculate this
+            0,  /* size_t input_slice_pitch, */
+            outputImage->data.data(), /*  const void *ptr,*/
+            0, /* cl_uint num_events_in_wait_list, */ 
+            NULL, /* const cl_event *event_wait_list, */  
+            NULL /*  cl_event *event */
+        ); trace(ret);
+        bytesTransferred += 4 * (unsigned long long)imageWidth * imageHeight;
 
-        return {sources.size(), std::move(strings), std::move(lengths)};
+    }
+
+    void getColorTableFromGPU(cl_bool blocking = CL_TRUE)
+    {
+        ret = clEnqueueReadBuffer(command_queue,
+                               colorTableClBuffer, /*cl_mem buffer,*/
+                               blocking, /*cl_bool blocking_write,*/
+                               0, /* size_t offset, */
+                               sizeof(unsigned char)*paddedColorTable.size(), /*size_t size,*/
+                               paddedColorTable.data(), /*const void *ptr,*/
+                               0, /*cl_uint num_events_in_wait_list,*/
+                               NULL, /* const cl_event *event_wait_list, */
+                               NULL /*cl_event *event */); trace(ret);
+        bytesTransferred += paddedColorTable.size();
     }
 };
 
@@ -0,0 +1,56 @@
+#ifndef MINI_BATCH_H
+#define MINI_BATCH_H
+
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Mini-batch k-means (Sculley): every iteration assigns a fresh random batch of pixels and
+// moves each palette entry towards the mean of its batch pixels with a learning rate of
+// 1 / (pixels the entry has seen so far), so entries settle as evidence accumulates. Centers
+// are kept in float because late updates are far smaller than one color step.
+class MiniBatch
+{
+public:
+    // Stratified splits the pixels into batchSize equal runs and draws one pixel from each,
+    // which covers the image evenly; Uniform draws every pixel from the whole image.
+    enum Sampling { Uniform, Stratified };
+
+    static constexpr size_t defaultBatchSize = 16384;
+
+    // Pixel indices of the batch of one iteration; the same iteration always draws the same batch.
+    static std::vector<size_t> drawSample(size_t pixelsNumber, size_t batchSize, Sampling sampling, unsigned int iteration)
+    {
+        std::vector<size_t> sample(std::min(batchSize, pixelsNumber));
+        std::mt19937_64 generator(5489u + iteration);
+        for(size_t s = 0; s < sample.size(); s++)
+        {
+            size_t begin = sampling == Stratified ? (pixelsNumber * s) / sample.size() : 0;
+            size_t end = sampling == Stratified ? (pixelsNumber * (s + 1)) / sample.size() : pixelsNumber;
+            sample[s] = std::uniform_int_distribution<size_t>(begin, end - 1)(generator);
+        }
+        return sample;
+    }
+
+    // Applies the per entry learning rate update for one batch given its per entry channel
+    // sums and counts, and rounds the centers into colorTable.
+    static void update(std::vector<float>& centers, std::vector<unsigned long long>& seen,
+        const std::vector<unsigned long long>& acc, const std::vector<unsigned int>& counter, std::vector<unsigned char>& colorTable)
+    {
+        for(size_t i = 0; i < seen.size(); i++)
+        {
+            if(counter[i] == 0)
+                continue;
+
+            seen[i] += counter[i];
+            float rate = 1.0f / seen[i];
+            for(int c = 0; c < 3; c++)
+            {
+                centers[3*i + c] += rate * (acc[3*i + c] - (float)counter[i] * centers[3*i + c]);
+                colorTable[3*i + c] = std::min(255.0f, std::max(0.0f, centers[3*i + c] + 0.5f));
+            }
+        }
+    }
+};
+
+#endif // MINI_BATCH_H
@@ -0,0 +1,412 @@
+#ifndef MULTI_DEVICE_QUANTIZATION_H
+#define MULTI_DEVICE_QUANTIZATION_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+
+#include "Quantization.h"
+#include "KMeansGPUQuantization.h"
+#include "NearestColor.h"
+#include "PaletteSeeding.h"
+#include "PixelLayout.h"
+#include "ThreadPool.h"
+#include "image.h"
+
+// K-means over one RGBA image split by rows across several OpenCL devices and, optionally,
+// threads of the host. Every iteration each participant assigns its rows to the shared
+// palette and returns per entry (pixels, r, g, b) sums; the host adds them up, moves the
+// palette to the means, reseeds empty entries and broadcasts it again. The sums are exact
+// integers, so the palette does not depend on how the rows are split.
+//
+// After each iteration the rows are redistributed in proportion to the rows per millisecond
+// every participant achieved (kernel time for devices, wall time for the host), smoothed
+// over iterations. Reassigned pixels are only approximate once rows move between participants,
+// since each one compares against the labels it last saw for those rows. When the image
+// has fewer rows than participants, the last ones get no rows and sit the run out.
+class MultiDeviceQuantization : public Quantization
+{
+public:
+    struct Participant
+    {
+        std::string name;
+        double speed;
+        unsigned int rowBegin;
+        unsigned int rowEnd;
+        double milliseconds;
+    };
+
+private:
+    Image* inputImage;
+    Image* outputImage;
+    unsigned int colorTableSize;
+    std::vector<std::unique_ptr<KMeansGPUQuantization> > devices;
+    std::vector<std::string> deviceNames;
+    std::unique_ptr<ThreadPool> threadPool;
+    NearestColorSearch nearestColor;
+
+    // devices first, the host last when it takes part
+    std::vector<Participant> participants;
+    // weight of the newest measurement in the smoothed speeds
+    double smoothing;
+
+    std::vector<unsigned char> colorTable;
+    std::vector<unsigned char> sample;
+    PaletteSeeding::Strategy seedingStrategy;
+
+    // per host band: (pixels, r, g, b) per entry, squared error, reassigned pixels and row labels
+    std::vector<std::vector<unsigned long long> > bandSums;
+    std::vector<double> bandSse;
+    std::vector<unsigned long long> bandReassigned;
+    std::vector<std::vector<unsigned int> > bandRowLabels;
+    // the entry the host last assigned to every pixel, invalid before the first time
+    std::vector<unsigned int> hostLabels;
+
+    Convergence lastConvergence;
+    PhaseStats lastStats;
+    PhaseTimer phaseTimer;
+    unsigned long long bytesTransferred;
+
+public:
+    // engines are borrowed, one per device; hostThreads 0 leaves the host out.
+    MultiDeviceQuantization(const std::vector<OpenCLEngine*>& engines, Image* inputImage, Image* outputImage, unsigned int colorTableSize,
+        unsigned int hostThreads = 0) :
+        inputImage(inputImage), outputImage(outputImage), colorTableSize(colorTableSize), smoothing(0.5),
+        seedingStrategy(PaletteSeeding::GrayRamp), lastConvergence(), lastStats(), bytesTransferred(0)
+    {
+        for(OpenCLEngine* engine : engines)
+        {
+            devices.emplace_back(new KMeansGPUQuantization(engine, inputImage, outputImage, colorTableSize));
+            deviceNames.push_back(OpenCLEngine::deviceName(engine->getDevice()));
+        }
+        if(hostThreads > 0)
+            threadPool.reset(new ThreadPool(hostThreads));
+    }
+
+    void setSeedingStrategy(PaletteSeeding::Strategy strategy)
+    {
+        seedingStrategy = strategy;
+    }
+
+    // 1 follows the last iteration only, smaller values average over more of them.
+    void setSmoothing(double weight)
+    {
+        smoothing = std::min(1.0, std::max(0.01, weight));
+    }
+
+    const std::vector<Participant>& getParticipants() const
+    {
+        return participants;
+    }
+
+    // interleaved RGB, valid after finalize()
+    const std::vector<unsigned char>& getColorTable() const
+    {
+        return colorTable;
+    }
+
+    void init()
+    {
+        phaseTimer.start();
+        bytesTransferred = 0;
+        sample = PaletteSeeding::samplePixels<RGBALayout>(inputImage->data.data(), (size_t)inputImage->details.width*inputImage->details.height);
+        colorTable = PaletteSeeding::seed(seedingStrategy, sample, colorTableSize);
+        nearestColor.setPalette(colorTable.data(), colorTableSize);
+
+        participants.clear();
+        for(size_t d = 0; d < devices.size(); d++)
+            participants.push_back(Participant{deviceNames[d], 0.0, 0, 0, 0.0});
+        if(threadPool)
+            participants.push_back(Participant{"host", 0.0, 0, 0, 0.0});
+        assignRows();
+
+        double kernelTime = 0.0;
+        for(size_t d = 0; d < devices.size(); d++)
+        {
+            if(!takesPart(d))
+                continue;
+            devices[d]->setRows(participants[d].rowBegin, participants[d].rowEnd);
+            devices[d]->init();
+            kernelTime += devices[d]->stats().kernelTime;
+            bytesTransferred += devices[d]->stats().bytesTransferred;
+        }
+        if(threadPool)
+        {
+            bandSums.assign(threadPool->size(), std::vector<unsigned long long>(4 * colorTableSize));
+            bandSse.assign(threadPool->size(), 0.0);
+            bandReassigned.assign(threadPool->size(), 0);
+            bandRowLabels.assign(threadPool->size(), std::vector<unsigned int>(inputImage->details.width));
+            hostLabels.assign((size_t)inputImage->details.width * inputImage->details.height, 0xFFFFFFFFu);
+        }
+
+        lastStats = PhaseStats();
+        lastStats.wallTime = phaseTimer.milliseconds();
+        lastStats.kernelTime = kernelTime;
+        lastStats.bytesTransferred = bytesTransferred;
+        lastStats.pixelsProcessed = sample.size() / 3;
+    }
+
+    void iterate()
+    {
+        phaseTimer.start();
+        unsigned long long startBytes = totalDeviceBytes();
+        std::vector<double> startKernelTimes = deviceKernelTimes();
+
+        for(size_t d = 0; d < devices.size(); d++)
+        {
+            if(!takesPart(d))
+                continue;
+            devices[d]->setColorTable(colorTable);
+            devices[d]->enqueueBandSums();
+        }
+
+        std::vector<unsigned long long> sums(4 * colorTableSize, 0);
+        double sse = 0.0;
+        unsigned long long reassigned = 0;
+        if(threadPool)
+        {
+            PhaseTimer hostTimer;
+            hostTimer.start();
+            accumulateHost(sums, sse, reassigned);
+            participants.back().milliseconds = hostTimer.milliseconds();
+        }
+
+        for(size_t d = 0; d < devices.size(); d++)
+            if(takesPart(d))
+                devices[d]->finishBandSums(sums, sse, reassigned);
+        std::vector<double> kernelTimes = deviceKernelTimes();
+        double kernelTime = 0.0;
+        for(size_t d = 0; d < devices.size(); d++)
+        {
+            participants[d].milliseconds = kernelTimes[d] - startKernelTimes[d];
+            kernelTime += participants[d].milliseconds;
+        }
+
+        std::vector<unsigned char> previous = colorTable;
+        std::vector<unsigned int> counts(colorTableSize);
+        unsigned int emptyClusters = 0;
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            counts[i] = (unsigned int)std::min<unsigned long long>(sums[4*i], 0xFFFFFFFFu);
+            if(sums[4*i] == 0)
+            {
+                emptyClusters++;
+                continue;
+            }
+            for(int c = 0; c < 3; c++)
+                colorTable[3*i + c] = (unsigned char)(sums[4*i + 1 + c] / sums[4*i]);
+        }
+        PaletteSeeding::reseedDeadEntries(colorTable, counts, sample);
+        nearestColor.setPalette(colorTable.data(), colorTableSize);
+
+        lastConvergence = Convergence();
+        lastConvergence.reassignedPixels = reassigned;
+        lastConvergence.sse = sse;
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            lastConvergence.maxCentroidShift = std::max(lastConvergence.maxCentroidShift,
+                nearestColor.distance(i, previous[3*i], previous[3*i + 1], previous[3*i + 2]));
+
+        rebalance();
+
+        unsigned long long pixels = (unsigned long long)inputImage->details.width * inputImage->details.height;
+        lastStats = PhaseStats();
+        lastStats.wallTime = phaseTimer.milliseconds();
+        lastStats.kernelTime = kernelTime;
+        lastStats.bytesTransferred = totalDeviceBytes() - startBytes;
+        lastStats.pixelsProcessed = pixels;
+        lastStats.distanceEvaluations = pixels * colorTableSize;
+        lastStats.sse = sse;
+        lastStats.psnr = peakSignalToNoiseRatio(sse, pixels);
+        lastStats.emptyClusters = emptyClusters;
+    }
+
+    void finalize()
+    {
+        phaseTimer.start();
+        unsigned long long startBytes = totalDeviceBytes();
+        std::vector<double> startKernelTimes = deviceKernelTimes();
+
+        for(size_t d = 0; d < devices.size(); d++)
+        {
+            if(!takesPart(d))
+                continue;
+            devices[d]->setColorTable(colorTable);
+            devices[d]->enqueueQuantizeRows();
+        }
+        if(threadPool)
+            quantizeHost();
+        for(size_t d = 0; d < devices.size(); d++)
+            if(takesPart(d))
+                devices[d]->finishRows();
+
+        std::vector<double> kernelTimes = deviceKernelTimes();
+        double kernelTime = 0.0;
+        for(size_t d = 0; d < devices.size(); d++)
+            kernelTime += kernelTimes[d] - startKernelTimes[d];
+
+        unsigned long long pixels = (unsigned long long)inputImage->details.width * inputImage->details.height;
+        double sse = 0.0;
+        const unsigned char* in = inputImage->data.data();
+        const unsigned char* out = outputImage->data.data();
+        for(size_t p = 0; p < pixels; p++)
+            for(int c = 0; c < 3; c++)
+                sse += (double)(in[4*p + c] - out[4*p + c]) * (in[4*p + c] - out[4*p + c]);
+
+        lastStats = PhaseStats();
+        lastStats.wallTime = phaseTimer.milliseconds();
+        lastStats.kernelTime = kernelTime;
+        lastStats.bytesTransferred = totalDeviceBytes() - startBytes;
+        lastStats.pixelsProcessed = pixels;
+        lastStats.distanceEvaluations = pixels * colorTableSize;
+        lastStats.sse = sse;
+        lastStats.psnr = peakSignalToNoiseRatio(sse, pixels);
+    }
+
+    Convergence convergence()
+    {
+        return lastConvergence;
+    }
+
+    PhaseStats stats()
+    {
+        return lastStats;
+    }
+
+private:
+    // Splits the rows by the smoothed speeds, evenly before the first measurement. The first
+    // min(participants, height) participants keep at least one row, the others get none.
+    void assignRows()
+    {
+        unsigned int height = inputImage->details.height;
+        unsigned int n = std::min<unsigned int>(participants.size(), height);
+        bool measured = std::all_of(participants.begin(), participants.begin() + n, [](const Participant& participant){ return participant.speed > 0.0; });
+        double total = 0.0;
+        for(unsigned int p = 0; p < n; p++)
+            total += measured ? participants[p].speed : 1.0;
+
+        for(unsigned int p = n; p < participants.size(); p++)
+            participants[p].rowBegin = participants[p].rowEnd = height;
+
+        double cumulative = 0.0;
+        unsigned int begin = 0;
+        for(unsigned int p = 0; p < n; p++)
+        {
+            cumulative += measured ? participants[p].speed : 1.0;
+            unsigned int end = p + 1 == n ? height : (unsigned int)(height * cumulative / total + 0.5);
+            end = std::max(end, begin + 1);
+            end = std::min(end, height - (n - 1 - p));
+            participants[p].rowBegin = begin;
+            participants[p].rowEnd = end;
+            begin = end;
+        }
+    }
+
+    // false for a participant without rows; such a device is never initialized
+    bool takesPart(size_t p) const
+    {
+        return participants[p].rowEnd > participants[p].rowBegin;
+    }
+
+    void rebalance()
+    {
+        for(Participant& participant : participants)
+        {
+            if(participant.rowEnd == participant.rowBegin)
+                continue;
+            double rate = (participant.rowEnd - participant.rowBegin) / std::max(participant.milliseconds, 0.01);
+            participant.speed = participant.speed == 0.0 ? rate : smoothing * rate + (1.0 - smoothing) * participant.speed;
+        }
+        assignRows();
+        for(size_t d = 0; d < devices.size(); d++)
+            if(takesPart(d))
+                devices[d]->setRows(participants[d].rowBegin, participants[d].rowEnd);
+    }
+
+    std::vector<double> deviceKernelTimes()
+    {
+        std::vector<double> times;
+        for(auto& device : devices)
+            times.push_back(device->getKernelTime());
+        return times;
+    }
+
+    unsigned long long totalDeviceBytes() const
+    {
+        unsigned long long bytes = 0;
+        for(const auto& device : devices)
+            bytes += device->getBytesTransferred();
+        return bytes;
+    }
+
+    void hostBandRange(unsigned int band, size_t& yBegin, size_t& yEnd) const
+    {
+        const Participant& host = participants.back();
+        size_t rows = host.rowEnd - host.rowBegin;
+        yBegin = host.rowBegin + rows * band / threadPool->size();
+        yEnd = host.rowBegin + rows * (band + 1) / threadPool->size();
+    }
+
+    // The host rows, in bands merged in band order.
+    void accumulateHost(std::vector<unsigned long long>& sums, double& sse, unsigned long long& reassigned)
+    {
+        size_t width = inputImage->details.width;
+        threadPool->run(threadPool->size(), [this, width](unsigned int band){
+            std::vector<unsigned long long>& bandSum = bandSums[band];
+            std::vector<unsigned int>& rowLabels = bandRowLabels[band];
+            std::fill(bandSum.begin(), bandSum.end(), 0);
+            bandSse[band] = 0.0;
+            bandReassigned[band] = 0;
+
+            size_t yBegin, yEnd;
+            hostBandRange(band, yBegin, yEnd);
+            for(size_t y = yBegin; y < yEnd; y++)
+            {
+                const unsigned char* row = inputImage->data.data() + 4 * y * width;
+                nearestColor.findRun<RGBALayout>(row, width, rowLabels.data());
+                for(size_t x = 0; x < width; x++)
+                {
+                    const unsigned char* px = row + 4 * x;
+                    unsigned int i = rowLabels[x];
+                    unsigned int& label = hostLabels[y * width + x];
+                    if(label != i)
+                        bandReassigned[band]++;
+                    label = i;
+                    bandSse[band] += nearestColor.squaredDistance(i, px[0], px[1], px[2]);
+                    bandSum[4*i + 0] += 1;
+                    bandSum[4*i + 1] += px[0];
+                    bandSum[4*i + 2] += px[1];
+                    bandSum[4*i + 3] += px[2];
+                }
+            }
+        });
+
+        for(unsigned int band = 0; band < threadPool->size(); band++)
+        {
+            for(size_t i = 0; i < sums.size(); i++)
+                sums[i] += bandSums[band][i];
+            sse += bandSse[band];
+            reassigned += bandReassigned[band];
+        }
+    }
+
+    void quantizeHost()
+    {
+        size_t width = inputImage->details.width;
+        threadPool->run(threadPool->size(), [this, width](unsigned int band){
+            std::vector<unsigned int>& rowLabels = bandRowLabels[band];
+            size_t yBegin, yEnd;
+            hostBandRange(band, yBegin, yEnd);
+            for(size_t y = yBegin; y < yEnd; y++)
+            {
+                const unsigned char* row = inputImage->data.data() + 4 * y * width;
+                unsigned char* outputRow = outputImage->data.data() + 4 * y * width;
+                nearestColor.findRun<RGBALayout>(row, width, rowLabels.data());
+                for(size_t x = 0; x < width; x++)
+                    RGBALayout::write(outputRow + 4 * x, row + 4 * x, &colorTable[3 * rowLabels[x]]);
+            }
+        });
+    }
+};
+
+#endif // MULTI_DEVICE_QUANTIZATION_H
@@ -0,0 +1,393 @@
+#ifndef NEAREST_COLOR_H
+#define NEAREST_COLOR_H
+
+#include <vector>
+#include <limits>
+#include <cmath>
+
+#include "PixelLayout.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEAREST_COLOR_X86
+#endif
+
+// Nearest palette entry search. The palette is kept twice: as the interleaved RGB bytes
+// used by the scalar reference path and as padded float lanes (SoA) for the SSE/AVX2 paths,
+// which compare 4/8 palette entries per instruction and select the best one without branches.
+// All paths return the same index: distances are small integers, exact in float, and ties
+// resolve to the lowest palette index.
+class NearestColorSearch
+{
+public:
+    enum Path { Scalar, SSE, AVX2 };
+
+private:
+    static constexpr unsigned int laneWidth = 8;
+    static constexpr float paddingValue = 1e18f;
+
+    Path path;
+    unsigned int colorTableSize;
+    std::vector<unsigned char> colorTable;
+    std::vector<float> red;
+    std::vector<float> green;
+    std::vector<float> blue;
+
+public:
+    NearestColorSearch() : path(bestAvailablePath()), colorTableSize(0)
+    {
+    }
+
+    static Path bestAvailablePath()
+    {
+#ifdef NEAREST_COLOR_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return AVX2;
+        if(__builtin_cpu_supports("sse2"))
+            return SSE;
+#endif
+        return Scalar;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    // Requests a specific path; falls back to the best supported one below it.
+    void setPath(Path requested)
+    {
+        Path available = bestAvailablePath();
+        path = requested < available ? requested : available;
+    }
+
+    void setPalette(const unsigned char* rgb, unsigned int size)
+    {
+        colorTableSize = size;
+        colorTable.assign(rgb, rgb + 3*size);
+
+        unsigned int paddedSize = ((size + laneWidth - 1) / laneWidth) * laneWidth;
+        red.assign(paddedSize, paddingValue);
+        green.assign(paddedSize, paddingValue);
+        blue.assign(paddedSize, paddingValue);
+        for(unsigned int i = 0; i < size; i++)
+        {
+            red[i] = rgb[3*i + 0];
+            green[i] = rgb[3*i + 1];
+            blue[i] = rgb[3*i + 2];
+        }
+    }
+
+    unsigned int find(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        switch(path)
+        {
+#ifdef NEAREST_COLOR_X86
+        case AVX2:
+            return findAVX2(r, g, b);
+        case SSE:
+            return findSSE(r, g, b);
+#endif
+        default:
+            return findScalar(r, g, b);
+        }
+    }
+
+    // Nearest entries of count consecutive pixels of a layout. With AVX2, palettes padded to
+    // 8, 16, 32, 64 or 256 lanes use a search with a compile-time trip count, fully unrolled,
+    // that loads the palette once per run; up to 32 entries it stays in registers.
+    template<class Layout>
+    void findRun(const unsigned char* pixels, size_t count, unsigned int* indices) const
+    {
+#ifdef NEAREST_COLOR_X86
+        if(path == AVX2)
+        {
+            switch(red.size())
+            {
+            case 8:
+                findRunAVX2<Layout, 1>(pixels, count, indices);
+                return;
+            case 16:
+                findRunAVX2<Layout, 2>(pixels, count, indices);
+                return;
+            case 32:
+                findRunAVX2<Layout, 4>(pixels, count, indices);
+                return;
+            case 64:
+                findRunAVX2<Layout, 8>(pixels, count, indices);
+                return;
+            case 256:
+                findRunAVX2<Layout, 32>(pixels, count, indices);
+                return;
+            }
+        }
+#endif
+        for(size_t p = 0; p < count; p++)
+        {
+            unsigned char r, g, b;
+            Layout::read(pixels + Layout::stride * p, r, g, b);
+            indices[p] = find(r, g, b);
+        }
+    }
+
+    unsigned int findScalar(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        unsigned int bestIndex = 0;
+        float bestValue = std::numeric_limits<float>::max();
+
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            float l2 = (1.0 * colorTable[3*i + 0] - r)*(1.0 * colorTable[3*i + 0] - r) + (1.0 * colorTable[3*i + 1] - g)*(1.0 * colorTable[3*i + 1] - g) + (1.0 * colorTable[3*i + 2] - b)*(1.0 * colorTable[3*i + 2] - b);
+            if(l2<bestValue)
+            {
+                bestIndex = i;
+                bestValue = l2;
+            }
+        }
+
+        return bestIndex;
+    }
+
+    unsigned int size() const
+    {
+        return colorTableSize;
+    }
+
+    float squaredDistance(unsigned int index, unsigned char r, unsigned char g, unsigned char b) const
+    {
+        float dr = red[index] - r;
+        float dg = green[index] - g;
+        float db = blue[index] - b;
+        return dr*dr + dg*dg + db*db;
+    }
+
+    float distance(unsigned int index, unsigned char r, unsigned char g, unsigned char b) const
+    {
+        return std::sqrt(squaredDistance(index, r, g, b));
+    }
+
+    // Full scan that also reports the Euclidean distances to the best and second best entry.
+    unsigned int findWithSecond(unsigned char r, unsigned char g, unsigned char b, float& bestDistance, float& secondDistance) const
+    {
+#ifdef NEAREST_COLOR_X86
+        if(path == AVX2)
+            return findWithSecondAVX2(r, g, b, bestDistance, secondDistance);
+#endif
+        return findWithSecondScalar(r, g, b, bestDistance, secondDistance);
+    }
+
+    unsigned int findWithSecondScalar(unsigned char r, unsigned char g, unsigned char b, float& bestDistance, float& secondDistance) const
+    {
+        unsigned int bestIndex = 0;
+        float bestValue = std::numeric_limits<float>::max();
+        float secondValue = std::numeric_limits<float>::max();
+
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            float dr = red[i] - r;
+            float dg = green[i] - g;
+            float db = blue[i] - b;
+            float l2 = dr*dr + dg*dg + db*db;
+            if(l2 < bestValue)
+            {
+                secondValue = bestValue;
+                bestValue = l2;
+                bestIndex = i;
+            }
+            else if(l2 < secondValue)
+            {
+                secondValue = l2;
+            }
+        }
+
+        bestDistance = std::sqrt(bestValue);
+        secondDistance = std::sqrt(secondValue);
+        return bestIndex;
+    }
+
+#ifdef NEAREST_COLOR_X86
+    __attribute__((target("sse2")))
+    unsigned int findSSE(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        const __m128 pr = _mm_set1_ps(r);
+        const __m128 pg = _mm_set1_ps(g);
+        const __m128 pb = _mm_set1_ps(b);
+        const __m128 step = _mm_set1_ps(4.0f);
+        __m128 index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        __m128 bestValue = _mm_set1_ps(std::numeric_limits<float>::max());
+        __m128 bestIndex = _mm_setzero_ps();
+
+        for(unsigned int i = 0; i < colorTableSize; i += 4)
+        {
+            __m128 dr = _mm_sub_ps(_mm_loadu_ps(&red[i]), pr);
+            __m128 dg = _mm_sub_ps(_mm_loadu_ps(&green[i]), pg);
+            __m128 db = _mm_sub_ps(_mm_loadu_ps(&blue[i]), pb);
+            __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+            __m128 better = _mm_cmplt_ps(l2, bestValue);
+            bestValue = _mm_or_ps(_mm_and_ps(better, l2), _mm_andnot_ps(better, bestValue));
+            bestIndex = _mm_or_ps(_mm_and_ps(better, index), _mm_andnot_ps(better, bestIndex));
+            index = _mm_add_ps(index, step);
+        }
+
+        alignas(16) float values[4];
+        alignas(16) float indices[4];
+        _mm_store_ps(values, bestValue);
+        _mm_store_ps(indices, bestIndex);
+        return reduceLanes(values, indices, 4);
+    }
+
+    __attribute__((target("avx2")))
+    unsigned int findAVX2(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        const __m256 pr = _mm256_set1_ps(r);
+        const __m256 pg = _mm256_set1_ps(g);
+        const __m256 pb = _mm256_set1_ps(b);
+        const __m256 step = _mm256_set1_ps(8.0f);
+        __m256 index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        __m256 bestValue = _mm256_set1_ps(std::numeric_limits<float>::max());
+        __m256 bestIndex = _mm256_setzero_ps();
+
+        for(unsigned int i = 0; i < colorTableSize; i += 8)
+        {
+            __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(&red[i]), pr);
+            __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(&green[i]), pg);
+            __m256 db = _mm256_sub_ps(_mm256_loadu_ps(&blue[i]), pb);
+            __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+
+            __m256 better = _mm256_cmp_ps(l2, bestValue, _CMP_LT_OQ);
+            bestValue = _mm256_blendv_ps(bestValue, l2, better);
+            bestIndex = _mm256_blendv_ps(bestIndex, index, better);
+            index = _mm256_add_ps(index, step);
+        }
+
+        alignas(32) float values[8];
+        alignas(32) float indices[8];
+        _mm256_store_ps(values, bestValue);
+        _mm256_store_ps(indices, bestIndex);
+        return reduceLanes(values, indices, 8);
+    }
+
+    template<class Layout, unsigned int Vectors>
+    __attribute__((target("avx2")))
+    void findRunAVX2(const unsigned char* pixels, size_t count, unsigned int* indices) const
+    {
+        __m256 paletteRed[Vectors], paletteGreen[Vectors], paletteBlue[Vectors], paletteIndex[Vectors];
+        for(unsigned int v = 0; v < Vectors; v++)
+        {
+            paletteRed[v] = _mm256_loadu_ps(&red[8*v]);
+            paletteGreen[v] = _mm256_loadu_ps(&green[8*v]);
+            paletteBlue[v] = _mm256_loadu_ps(&blue[8*v]);
+            paletteIndex[v] = _mm256_add_ps(_mm256_set1_ps(8.0f * v), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+        }
+
+        for(size_t p = 0; p < count; p++)
+        {
+            unsigned char r, g, b;
+            Layout::read(pixels + Layout::stride * p, r, g, b);
+            const __m256 pr = _mm256_set1_ps(r);
+            const __m256 pg = _mm256_set1_ps(g);
+            const __m256 pb = _mm256_set1_ps(b);
+            __m256 bestValue = _mm256_set1_ps(std::numeric_limits<float>::max());
+            __m256 bestIndex = _mm256_setzero_ps();
+
+            for(unsigned int v = 0; v < Vectors; v++)
+            {
+                __m256 dr = _mm256_sub_ps(paletteRed[v], pr);
+                __m256 dg = _mm256_sub_ps(paletteGreen[v], pg);
+                __m256 db = _mm256_sub_ps(paletteBlue[v], pb);
+                __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+
+                __m256 better = _mm256_cmp_ps(l2, bestValue, _CMP_LT_OQ);
+                bestValue = _mm256_blendv_ps(bestValue, l2, better);
+                bestIndex = _mm256_blendv_ps(bestIndex, paletteIndex[v], better);
+            }
+
+            indices[p] = reduceLanesAVX2(bestValue, bestIndex);
+        }
+    }
+
+    // reduceLanes() without leaving the registers: the smallest value, then the smallest
+    // index among the lanes holding it.
+    __attribute__((target("avx2")))
+    static unsigned int reduceLanesAVX2(__m256 values, __m256 indices)
+    {
+        __m256 minimum = _mm256_min_ps(values, _mm256_permute2f128_ps(values, values, 1));
+        minimum = _mm256_min_ps(minimum, _mm256_shuffle_ps(minimum, minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+        minimum = _mm256_min_ps(minimum, _mm256_shuffle_ps(minimum, minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m256 candidates = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::max()), indices, _mm256_cmp_ps(values, minimum, _CMP_EQ_OQ));
+        candidates = _mm256_min_ps(candidates, _mm256_permute2f128_ps(candidates, candidates, 1));
+        candidates = _mm256_min_ps(candidates, _mm256_shuffle_ps(candidates, candidates, _MM_SHUFFLE(1, 0, 3, 2)));
+        candidates = _mm256_min_ps(candidates, _mm256_shuffle_ps(candidates, candidates, _MM_SHUFFLE(2, 3, 0, 1)));
+        return static_cast<unsigned int>(_mm256_cvtss_f32(candidates));
+    }
+
+    __attribute__((target("avx2")))
+    unsigned int findWithSecondAVX2(unsigned char r, unsigned char g, unsigned char b, float& bestDistance, float& secondDistance) const
+    {
+        const __m256 pr = _mm256_set1_ps(r);
+        const __m256 pg = _mm256_set1_ps(g);
+        const __m256 pb = _mm256_set1_ps(b);
+        const __m256 step = _mm256_set1_ps(8.0f);
+        __m256 index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        __m256 bestValue = _mm256_set1_ps(std::numeric_limits<float>::max());
+        __m256 secondValue = _mm256_set1_ps(std::numeric_limits<float>::max());
+        __m256 bestIndex = _mm256_setzero_ps();
+
+        for(unsigned int i = 0; i < colorTableSize; i += 8)
+        {
+            __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(&red[i]), pr);
+            __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(&green[i]), pg);
+            __m256 db = _mm256_sub_ps(_mm256_loadu_ps(&blue[i]), pb);
+            __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+
+            __m256 better = _mm256_cmp_ps(l2, bestValue, _CMP_LT_OQ);
+            secondValue = _mm256_blendv_ps(_mm256_min_ps(secondValue, l2), bestValue, better);
+            bestValue = _mm256_blendv_ps(bestValue, l2, better);
+            bestIndex = _mm256_blendv_ps(bestIndex, index, better);
+            index = _mm256_add_ps(index, step);
+        }
+
+        alignas(32) float values[8];
+        alignas(32) float seconds[8];
+        alignas(32) float indices[8];
+        _mm256_store_ps(values, bestValue);
+        _mm256_store_ps(seconds, secondValue);
+        _mm256_store_ps(indices, bestIndex);
+
+        unsigned int bestLane = 0;
+        for(unsigned int lane = 1; lane < 8; lane++)
+            if(values[lane] < values[bestLane] || (values[lane] == values[bestLane] && indices[lane] < indices[bestLane]))
+                bestLane = lane;
+        float second = seconds[bestLane];
+        for(unsigned int lane = 0; lane < 8; lane++)
+            if(lane != bestLane && values[lane] < second)
+                second = values[lane];
+
+        bestDistance = std::sqrt(values[bestLane]);
+        secondDistance = std::sqrt(second);
+        return static_cast<unsigned int>(indices[bestLane]);
+    }
+#endif
+
+private:
+    // Every lane holds the first minimum of its own palette subset; pick the smallest value
+    // and, among equal values, the smallest index so ties match the scalar search.
+    static unsigned int reduceLanes(const float* values, const float* indices, unsigned int lanes)
+    {
+        float bestValue = values[0];
+        float bestIndex = indices[0];
+        for(unsigned int lane = 1; lane < lanes; lane++)
+        {
+            if(values[lane] < bestValue || (values[lane] == bestValue && indices[lane] < bestIndex))
+            {
+                bestValue = values[lane];
+                bestIndex = indices[lane];
+            }
+        }
+        return static_cast<unsigned int>(bestIndex);
+    }
+};
+
+#endif // NEAREST_COLOR_H
@@ -0,0 +1,552 @@
+#ifndef OPENCL_ENGINE_H
+#define OPENCL_ENGINE_H
+
+#define CL_TARGET_OPENCL_VERSION 220
+#include <CL/cl.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+
+#include "helpers.h"
+
+// Long lived OpenCL state: context, queue and the compiled k-means kernels, plus device
+// memory that quantizers borrow. Images and buffers only get reallocated when a request
+// does not fit into what is already allocated, so a stream of images of varying sizes
+// pays the platform setup and program build once. One quantizer may use an engine at a time.
+//
+// Built programs are cached on disk (CL_PROGRAM_BINARIES) under a name derived from the
+// platform, device, driver version, build options and kernel sources, so any change to
+// those builds from source again. Unreadable or rejected binaries are rebuilt and replaced.
+// The cache directory defaults to $KMEANS_CL_CACHE_DIR or ".clcache"; an empty one disables it.
+class OpenCLEngine
+{
+public:
+    enum BufferSlot { PartialSums, ColorTable, Labels, Convergence, Counts, MiniBatchCenters, MiniBatchSeen, LookupCells, LookupCandidates, Indices, BufferSlotsNumber };
+    // How the kernel file accumulates; decides the launch configuration of accumulate and partition.
+    enum AccumulationStrategy { GlobalAtomics, GroupReduction, LocalHistogram };
+    static constexpr unsigned int stagingBuffersNumber = 2;
+    static constexpr unsigned int defaultPixelsPerItem = 4;
+
+private:
+    std::string kernelFilename;
+    std::string buildOptions;
+    unsigned int pixelsPerItem;
+    std::string cacheDirectory;
+    bool programFromCache;
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+    cl_uint ret_num_devices;
+    cl_uint ret_num_platforms;
+    cl_context context;
+    cl_command_queue command_queue;
+    cl_program program;
+    cl_int ret;
+    cl_kernel accKernel;
+    cl_kernel partKernel;
+    cl_kernel quantKernel;
+    cl_kernel miniBatchAccKernel;
+    cl_kernel miniBatchUpdateKernel;
+    cl_kernel quantizeLookupKernel;
+    cl_kernel quantizeIndicesKernel;
+
+    cl_mem inputClImage;
+    cl_mem outputClImage;
+    size_t imageWidth;
+    size_t imageHeight;
+
+    cl_mem buffers[BufferSlotsNumber];
+    size_t bufferSizes[BufferSlotsNumber];
+
+    // host visible (pinned) upload buffers, kept mapped for their whole lifetime
+    cl_mem stagingBuffers[stagingBuffersNumber];
+    unsigned char* stagingPointers[stagingBuffersNumber];
+    size_t stagingSizes[stagingBuffersNumber];
+
+public:
+    // pixelsPerItem is baked into the program as PIXELS_PER_ITEM, the number of adjacent pixels
+    // every accumulate and quantize work-item handles. device selects one of allDevices() or
+    // subDevices(); NULL takes the first device of the first platform.
+    OpenCLEngine(std::string kernelFilename = "parallelReductionKernel.cl", std::string cacheDirectory = defaultCacheDirectory(),
+        unsigned int pixelsPerItem = defaultPixelsPerItem, cl_device_id device = NULL) :
+        kernelFilename(kernelFilename), buildOptions("-D PIXELS_PER_ITEM=" + std::to_string(pixelsPerItem)), pixelsPerItem(pixelsPerItem), cacheDirectory(cacheDirectory), programFromCache(false), device_id(device), inputClImage(NULL), outputClImage(NULL), imageWidth(0), imageHeight(0)
+    {
+        for(int slot = 0; slot < BufferSlotsNumber; slot++)
+        {
+            buffers[slot] = NULL;
+            bufferSizes[slot] = 0;
+        }
+        for(unsigned int i = 0; i < stagingBuffersNumber; i++)
+        {
+            stagingBuffers[i] = NULL;
+            stagingPointers[i] = NULL;
+            stagingSizes[i] = 0;
+        }
+
+        initOpenCL();
+        buildKernels();
+    }
+
+    ~OpenCLEngine()
+    {
+        clFlush(command_queue);
+        clFinish(command_queue);
+        clReleaseKernel(accKernel);
+        clReleaseKernel(partKernel);
+        clReleaseKernel(quantKernel);
+        clReleaseKernel(miniBatchAccKernel);
+        clReleaseKernel(miniBatchUpdateKernel);
+        clReleaseKernel(quantizeLookupKernel);
+        clReleaseKernel(quantizeIndicesKernel);
+        for(int slot = 0; slot < BufferSlotsNumber; slot++)
+            if(buffers[slot])
+                clReleaseMemObject(buffers[slot]);
+        for(unsigned int i = 0; i < stagingBuffersNumber; i++)
+            releaseStagingBuffer(i);
+        clFinish(command_queue);
+        if(outputClImage)
+            clReleaseMemObject(outputClImage);
+        if(inputClImage)
+            clReleaseMemObject(inputClImage);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(command_queue);
+        clReleaseContext(context);
+    }
+
+    OpenCLEngine(const OpenCLEngine&) = delete;
+    OpenCLEngine& operator=(const OpenCLEngine&) = delete;
+
+    cl_context getContext() const { return context; }
+    cl_command_queue getCommandQueue() const { return command_queue; }
+    cl_device_id getDevice() const { return device_id; }
+    cl_kernel getAccumulateKernel() const { return accKernel; }
+    cl_kernel getPartitionKernel() const { return partKernel; }
+    cl_kernel getQuantizeKernel() const { return quantKernel; }
+    cl_kernel getMiniBatchAccumulateKernel() const { return miniBatchAccKernel; }
+    cl_kernel getMiniBatchUpdateKernel() const { return miniBatchUpdateKernel; }
+    cl_kernel getQuantizeLookupKernel() const { return quantizeLookupKernel; }
+    cl_kernel getQuantizeIndicesKernel() const { return quantizeIndicesKernel; }
+    bool isProgramFromCache() const { return programFromCache; }
+    unsigned int getPixelsPerItem() const { return pixelsPerItem; }
+    const std::string& getKernelFilename() const { return kernelFilename; }
+    const std::string& getCacheDirectory() const { return cacheDirectory; }
+    std::string getDeviceKey() const { return deviceKey(platform_id, device_id); }
+
+    // Largest local size all three kernels can be launched with on this device.
+    size_t getMaxWorkGroupSize() const
+    {
+        size_t maxSize = 0;
+        clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxSize), &maxSize, NULL);
+        for(cl_kernel kernel : {accKernel, partKernel, quantKernel})
+        {
+            size_t kernelSize = 0;
+            if(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelSize), &kernelSize, NULL) == CL_SUCCESS)
+                maxSize = std::min(maxSize, kernelSize);
+        }
+        return maxSize;
+    }
+
+    std::vector<size_t> getMaxWorkItemSizes() const
+    {
+        cl_uint dimensions = 0;
+        clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(dimensions), &dimensions, NULL);
+        std::vector<size_t> sizes(dimensions);
+        clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t)*sizes.size(), sizes.data(), NULL);
+        return sizes;
+    }
+
+    cl_ulong getLocalMemorySize() const
+    {
+        cl_ulong size = 0;
+        clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(size), &size, NULL);
+        return size;
+    }
+
+    // Identifies the platform, device and driver; cached data is only valid for the same key.
+    static std::string deviceKey(cl_platform_id platform, cl_device_id device)
+    {
+        return platformInfo(platform, CL_PLATFORM_NAME) + "|" + platformInfo(platform, CL_PLATFORM_VERSION) + "|" +
+            deviceInfo(device, CL_DEVICE_NAME) + "|" + deviceInfo(device, CL_DRIVER_VERSION);
+    }
+
+    // Key of the device a new engine would pick, without creating a context.
+    static std::string defaultDeviceKey()
+    {
+        cl_platform_id platform;
+        cl_device_id device;
+        cl_uint platforms = 0, devices = 0;
+        if(clGetPlatformIDs(1, &platform, &platforms) != CL_SUCCESS || platforms == 0)
+            return "";
+        if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, &devices) != CL_SUCCESS || devices == 0)
+            return "";
+        return deviceKey(platform, device);
+    }
+
+    // Every device of every platform.
+    static std::vector<cl_device_id> allDevices()
+    {
+        std::vector<cl_device_id> devices;
+        cl_uint platformsNumber = 0;
+        if(clGetPlatformIDs(0, NULL, &platformsNumber) != CL_SUCCESS || platformsNumber == 0)
+            return devices;
+        std::vector<cl_platform_id> platforms(platformsNumber);
+        clGetPlatformIDs(platformsNumber, platforms.data(), NULL);
+        for(cl_platform_id platform : platforms)
+        {
+            cl_uint devicesNumber = 0;
+            if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &devicesNumber) != CL_SUCCESS || devicesNumber == 0)
+                continue;
+            std::vector<cl_device_id> platformDevices(devicesNumber);
+            clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, devicesNumber, platformDevices.data(), NULL);
+            devices.insert(devices.end(), platformDevices.begin(), platformDevices.end());
+        }
+        return devices;
+    }
+
+    // Splits device into parts sub-devices with equal shares of its compute units, e.g. to
+    // run a CPU device as several participants. Empty when the device cannot be partitioned
+    // that way; the caller releases the sub-devices with clReleaseDevice() after their engines.
+    static std::vector<cl_device_id> subDevices(cl_device_id device, unsigned int parts)
+    {
+        std::vector<cl_device_id> devices;
+        cl_uint computeUnits = 0;
+        clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+        if(parts < 2 || computeUnits < parts)
+            return devices;
+
+        cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(computeUnits / parts), 0};
+        cl_uint devicesNumber = 0;
+        if(clCreateSubDevices(device, properties, 0, NULL, &devicesNumber) != CL_SUCCESS || devicesNumber == 0)
+            return devices;
+        devices.resize(devicesNumber);
+        if(clCreateSubDevices(device, properties, devicesNumber, devices.data(), NULL) != CL_SUCCESS)
+            devices.clear();
+        // a remainder of compute units makes one more, smaller sub-device
+        for(size_t i = parts; i < devices.size(); i++)
+            clReleaseDevice(devices[i]);
+        devices.resize(std::min<size_t>(devices.size(), parts));
+        return devices;
+    }
+
+    static std::string deviceName(cl_device_id device)
+    {
+        return deviceInfo(device, CL_DEVICE_NAME);
+    }
+
+    // File in cacheDirectory named after a hash of key, or "" when caching is disabled.
+    static std::string cacheFile(const std::string& cacheDirectory, const std::string& key, const std::string& extension)
+    {
+        if(cacheDirectory.empty())
+            return "";
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx", fnv1a(key));
+        return (std::filesystem::path(cacheDirectory) / (name + extension)).string();
+    }
+    AccumulationStrategy getAccumulationStrategy() const { return accumulationStrategy(kernelFilename); }
+
+    static AccumulationStrategy accumulationStrategy(const std::string& kernelFilename)
+    {
+        std::string name = std::filesystem::path(kernelFilename).filename().string();
+        if(name == "atomicAddKernel.cl")
+            return GlobalAtomics;
+        if(name == "localHistogramKernel.cl")
+            return LocalHistogram;
+        return GroupReduction;
+    }
+
+    static std::string defaultCacheDirectory()
+    {
+        const char* directory = std::getenv("KMEANS_CL_CACHE_DIR");
+        return directory ? directory : ".clcache";
+    }
+
+    // Input and output images of at least width x height; the kernels get the used size as arguments.
+    void getImages(size_t width, size_t height, cl_mem& input, cl_mem& output)
+    {
+        if(width > imageWidth || height > imageHeight)
+        {
+            if(outputClImage)
+                clReleaseMemObject(outputClImage);
+            if(inputClImage)
+                clReleaseMemObject(inputClImage);
+
+            imageWidth = std::max(width, imageWidth);
+            imageHeight = std::max(height, imageHeight);
+
+            cl_image_format clImageFormat = {CL_RGBA, CL_UNSIGNED_INT8};
+            cl_image_desc clImageDesc = {
+                CL_MEM_OBJECT_IMAGE2D,          /* cl_mem_object_type image_type, */
+                imageWidth,                     /* size_t image_width; */
+                imageHeight,                    /* size_t image_height; */
+                1,                              /* size_t image_depth; */
+                1,                              /* size_t image_array_size; */
+                0,                              /* size_t image_row_pitch; */ // OpenCL will calculate this
+                0,                              /* size_t image_slice_pitch; */ // as above
+                0,                              /* cl_uint num_mip_levels; */
+                0,                              /* cl_uint num_samples; */
+                NULL                            /* cl_mem mem_object; */
+            };
+            inputClImage = clCreateImage(context, CL_MEM_READ_WRITE, &clImageFormat, &clImageDesc, NULL, &ret); trace(ret);
+            outputClImage = clCreateImage(context, CL_MEM_READ_WRITE, &clImageFormat, &clImageDesc, NULL, &ret); trace(ret);
+        }
+        input = inputClImage;
+        output = outputClImage;
+    }
+
+    // Buffer of at least the given size; contents are undefined.
+    cl_mem getBuffer(BufferSlot slot, size_t size)
+    {
+        if(size > bufferSizes[slot])
+        {
+            if(buffers[slot])
+                clReleaseMemObject(buffers[slot]);
+            buffers[slot] = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret); trace(ret);
+            bufferSizes[slot] = size;
+        }
+        return buffers[slot];
+    }
+
+    // Pinned host memory of at least the given size to upload images from. Growing it waits
+    // for the queue, so callers should alternate between the buffers and size them up front.
+    unsigned char* getStagingBuffer(unsigned int index, size_t size)
+    {
+        if(size > stagingSizes[index])
+        {
+            releaseStagingBuffer(index);
+            stagingBuffers[index] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, size, NULL, &ret); trace(ret);
+            stagingPointers[index] = (unsigned char*)clEnqueueMapBuffer(command_queue, stagingBuffers[index], CL_TRUE, CL_MAP_WRITE,
+                0, size, 0, NULL, NULL, &ret); trace(ret);
+            stagingSizes[index] = size;
+        }
+        return stagingPointers[index];
+    }
+
+private:
+    void releaseStagingBuffer(unsigned int index)
+    {
+        if(!stagingBuffers[index])
+            return;
+        ret = clEnqueueUnmapMemObject(command_queue, stagingBuffers[index], stagingPointers[index], 0, NULL, NULL); trace(ret);
+        clReleaseMemObject(stagingBuffers[index]);
+        stagingBuffers[index] = NULL;
+        stagingPointers[index] = NULL;
+        stagingSizes[index] = 0;
+    }
+
+    void initOpenCL()
+    {
+        if(device_id)
+        {
+            ret = clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform_id), &platform_id, NULL); trace(ret);
+        }
+        else
+        {
+            ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms); trace(ret);
+            ret = clGetDeviceIDs( platform_id, CL_DEVICE_TYPE_ALL, 1, &device_id, &ret_num_devices); trace(ret);
+        }
+        context = clCreateContext( NULL, 1, &device_id, NULL, NULL, &ret); trace(ret);
+        cl_queue_properties properties[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+        command_queue = clCreateCommandQueueWithProperties(context, device_id, properties, &ret); trace(ret);
+    }
+
+    void buildKernels()
+    {
+        std::vector<std::string> sources;
+        // the mini-batch, lookup and index kernels reuse the helpers of the accumulation file
+        std::filesystem::path directory = std::filesystem::path(kernelFilename).parent_path();
+        for(auto file : {kernelFilename, (directory / "miniBatchKernel.cl").string(), (directory / "lookupKernel.cl").string(),
+            (directory / "indexKernel.cl").string()})
+            sources.push_back(readFile(file));
+        auto [numberOfFiles, strings, lengths] = prepareSourcesForCL(sources);
+
+        std::string cacheKey = programCacheKey(sources);
+        std::string cacheFile = programCacheFile(cacheKey);
+        programFromCache = !cacheFile.empty() && loadProgramBinary(cacheFile, cacheKey);
+        if(!programFromCache)
+        {
+            program = clCreateProgramWithSource(context, numberOfFiles, strings.data(), lengths.data(), &ret); trace(ret);
+            ret = clBuildProgram(program, 1, &device_id, buildOptions.c_str(), NULL, NULL); trace(ret);
+            if(ret == 0 && !cacheFile.empty())
+                saveProgramBinary(cacheFile, cacheKey);
+        }
+        if(ret != 0)
+        {
+            size_t len;
+            clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &len);
+            std::string logs;
+            logs.resize(len);
+            clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, logs.data(), NULL);
+            std::cout<<"Kernel compilation error: "<<std::endl<<logs<<std::endl;
+        }
+
+        accKernel = clCreateKernel(program, "accumulate", &ret); trace(ret);
+        partKernel = clCreateKernel(program, "partition", &ret); trace(ret);
+        quantKernel = clCreateKernel(program, "quantize", &ret); trace(ret);
+        miniBatchAccKernel = clCreateKernel(program, "miniBatchAccumulate", &ret); trace(ret);
+        miniBatchUpdateKernel = clCreateKernel(program, "miniBatchUpdate", &ret); trace(ret);
+        quantizeLookupKernel = clCreateKernel(program, "quantizeLookup", &ret); trace(ret);
+        quantizeIndicesKernel = clCreateKernel(program, "quantizeIndices", &ret); trace(ret);
+    }
+
+    static std::string platformInfo(cl_platform_id platform, cl_platform_info param)
+    {
+        size_t len = 0;
+        clGetPlatformInfo(platform, param, 0, NULL, &len);
+        std::string value(len, '\0');
+        clGetPlatformInfo(platform, param, len, &value[0], NULL);
+        return value.c_str();
+    }
+
+    static std::string deviceInfo(cl_device_id device, cl_device_info param)
+    {
+        size_t len = 0;
+        clGetDeviceInfo(device, param, 0, NULL, &len);
+        std::string value(len, '\0');
+        clGetDeviceInfo(device, param, len, &value[0], NULL);
+        return value.c_str();
+    }
+
+    static unsigned long long fnv1a(const std::string& text, unsigned long long hash = 14695981039346656037ull)
+    {
+        for(unsigned char c : text)
+        {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    std::string programCacheKey(const std::vector<std::string>& sources)
+    {
+        unsigned long long sourceHash = fnv1a("");
+        for(const std::string& source : sources)
+            sourceHash = fnv1a(source, sourceHash);
+
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", sourceHash);
+        return getDeviceKey() + "|" + buildOptions + "|" + hash;
+    }
+
+    std::string programCacheFile(const std::string& cacheKey)
+    {
+        return cacheFile(cacheDirectory, cacheKey, ".bin");
+    }
+
+    // Cache file layout: the full key, a newline, then the device binary.
+    bool loadProgramBinary(const std::string& cacheFile, const std::string& cacheKey)
+    {
+        std::FILE *file = std::fopen(cacheFile.c_str(), "rb");
+        if(!file)
+            return false;
+
+        std::vector<unsigned char> content;
+        std::fseek(file, 0, SEEK_END);
+        content.resize(std::ftell(file));
+        std::rewind(file);
+        size_t read = std::fread(content.data(), 1, content.size(), file);
+        std::fclose(file);
+
+        size_t header = cacheKey.size() + 1;
+        if(read != content.size() || content.size() <= header || 
+            std::string(content.begin(), content.begin() + cacheKey.size()) != cacheKey)
+            return false;
+
+        const unsigned char* binary = content.data() + header;
+        size_t binarySize = content.size() - header;
+        cl_int binaryStatus;
+        program = clCreateProgramWithBinary(context, 1, &device_id, &binarySize, &binary, &binaryStatus, &ret);
+        if(ret != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+        {
+            if(ret == CL_SUCCESS)
+                clReleaseProgram(program);
+            return false;
+        }
+
+        ret = clBuildProgram(program, 1, &device_id, buildOptions.c_str(), NULL, NULL);
+        if(ret != CL_SUCCESS)
+        {
+            clReleaseProgram(program);
+            return false;
+        }
+        return true;
+    }
+
+    void saveProgramBinary(const std::string& cacheFile, const std::string& cacheKey)
+    {
+        size_t binarySize = 0;
+        cl_int status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL); trace(status);
+        if(status != CL_SUCCESS || binarySize == 0)
+            return;
+
+        std::vector<unsigned char> binary(binarySize);
+        unsigned char* binaries[1] = {binary.data()};
+        status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL); trace(status);
+        if(status != CL_SUCCESS)
+            return;
+
+        std::error_code error;
+        std::filesystem::create_directories(cacheDirectory, error);
+
+        // write aside under a name no other process or engine uses and rename, so concurrent
+        // runs never see a partial file; "x" refuses to open a file that already exists
+        std::random_device random;
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", (unsigned int)random(), (unsigned int)random());
+        std::string temporaryFile = cacheFile + suffix;
+        std::FILE *file = std::fopen(temporaryFile.c_str(), "wbx");
+        if(!file)
+            return;
+        bool written = std::fwrite(cacheKey.c_str(), 1, cacheKey.size(), file) == cacheKey.size() &&
+            std::fputc('\n', file) != EOF &&
+            std::fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+        written = std::fclose(file) == 0 && written;
+
+        if(written)
+            std::filesystem::rename(temporaryFile, cacheFile, error);
+        if(!written || error)
+            std::filesystem::remove(temporaryFile, error);
+    }
+
+    std::string readFile(std::string filename)
+    {
+            std::FILE *file = std::fopen(filename.c_str(), "r");
+            if(!file)
+                    std::cout<<"Problem with opening: "<<filename<<std::endl;
+
+            std::string content;
+            std::fseek(file, 0, SEEK_END);
+            content.resize(std::ftell(file));
+            std::rewind(file);
+            std::fread(&content[0], sizeof(char), content.size(), file);
+            std::fclose(file);
+            return std::move(content);
+    }
+
+    struct OpenCLProgram
+    {
+        size_t file;
+        std::vector<const char*> strings;
+        std::vector<size_t> lengths;
+    };
+
+    OpenCLProgram prepareSourcesForCL(const std::vector<std::string>& sources)
+    {
+        std::vector<size_t> lengths(sources.size());
+        std::vector<const char*> strings(sources.size());
+
+        for(int i = 0; i < sources.size(); i++)
+        {
+            strings[i] = sources[i].c_str();
+            lengths[i] = sources[i].size();
+        }
+
+        return {sources.size(), std::move(strings), std::move(lengths)};
+    }
+};
+
+#endif // OPENCL_ENGINE_H
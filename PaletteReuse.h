@@ -0,0 +1,224 @@
+#ifndef PALETTE_REUSE_H
+#define PALETTE_REUSE_H
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "image.h"
+#include "Quantization.h"
+#include "ColorLookup.h"
+#include "PixelLayout.h"
+#include "ThreadPool.h"
+
+// Quantizes a sequence of similar images, e.g. the frames of an animation, one at a time
+// and carries the palette from one frame to the next. The first frame runs full k-means.
+// Every later frame is first mapped to the previous palette through a lookup cube; when that
+// reaches minPsnr it is the result and no k-means runs at all (RemapOnly). Otherwise k-means
+// starts from the previous palette and runs warmIterations (WarmStart).
+//
+// The remap works in square tiles. A tile whose pixels equal the previous frame keeps the
+// previous output and error, since the palette it was mapped with is still the current one,
+// so static regions only cost a comparison.
+class PaletteReuse
+{
+public:
+    enum Decision { FullRun, WarmStart, RemapOnly };
+
+    struct FrameResult
+    {
+        Decision decision;
+        unsigned int iterations;
+        double psnr;
+        size_t tiles;
+        size_t reusedTiles;
+    };
+
+private:
+    unsigned int colorTableSize;
+    unsigned int iterations;
+    unsigned int warmIterations;
+    double minPsnr;
+    unsigned int tileSize;
+    unsigned int lookupBits;
+    ThreadPool* threadPool;
+
+    // empty until the first frame is done
+    std::vector<unsigned char> palette;
+    ColorLookup lookup;
+
+    // the last frame, its output under palette and the squared error of each of its tiles
+    std::vector<unsigned char> previousInput;
+    std::vector<unsigned char> previousOutput;
+    png_uint_32 previousWidth;
+    png_uint_32 previousHeight;
+    png_uint_32 previousFormat;
+    std::vector<double> tileSse;
+
+public:
+    PaletteReuse(unsigned int colorTableSize, unsigned int iterations, unsigned int warmIterations, double minPsnr,
+        unsigned int tileSize = 32, unsigned int lookupBits = 6, ThreadPool* threadPool = NULL) :
+        colorTableSize(colorTableSize), iterations(iterations), warmIterations(warmIterations), minPsnr(minPsnr),
+        tileSize(std::max(1u, tileSize)), lookupBits(lookupBits), threadPool(threadPool), previousWidth(0), previousHeight(0), previousFormat(0)
+    {
+    }
+
+    // Quantizes input into output. quantizer is a KMeansCPUQuantization or KMeansGPUQuantization
+    // set up for this image pair and colorTableSize; it is not touched on RemapOnly frames.
+    template<class Quantizer>
+    FrameResult quantize(Quantizer& quantizer, Image& input, Image& output)
+    {
+        FrameResult result = FrameResult();
+        result.decision = FullRun;
+        result.tiles = tilesX(input) * tilesY(input);
+        unsigned long long pixels = (unsigned long long)input.details.width * input.details.height;
+
+        if(!palette.empty())
+        {
+            result.psnr = peakSignalToNoiseRatio(processTiles(input, output, true, result.reusedTiles), pixels);
+            if(result.psnr >= minPsnr)
+            {
+                result.decision = RemapOnly;
+                remember(input, output);
+                return result;
+            }
+            result.decision = WarmStart;
+        }
+
+        // empty before the first frame and after restart(), which seeds a new palette
+        quantizer.setInitialPalette(palette);
+        result.iterations = result.decision == WarmStart ? warmIterations : iterations;
+        quantizer.init();
+        for(unsigned int i = 0; i < result.iterations; i++)
+            quantizer.iterate();
+        quantizer.finalize();
+
+        palette = quantizer.getColorTable();
+        lookup.build(palette.data(), colorTableSize, lookupBits, threadPool);
+        size_t reused = 0;
+        result.psnr = peakSignalToNoiseRatio(processTiles(input, output, false, reused), pixels);
+        remember(input, output);
+        return result;
+    }
+
+    // interleaved RGB palette of the last frame
+    const std::vector<unsigned char>& getColorTable() const
+    {
+        return palette;
+    }
+
+    // Forgets the palette, so the next frame runs full k-means again, e.g. at a scene cut.
+    void restart()
+    {
+        palette.clear();
+        previousWidth = previousHeight = 0;
+    }
+
+private:
+    unsigned int tilesX(const Image& image) const
+    {
+        return (image.details.width + tileSize - 1) / tileSize;
+    }
+
+    unsigned int tilesY(const Image& image) const
+    {
+        return (image.details.height + tileSize - 1) / tileSize;
+    }
+
+    // With remap, maps every tile that changed to the palette and copies the others from the
+    // previous output; without it only measures output. Returns the squared error of the frame.
+    double processTiles(const Image& input, Image& output, bool remap, size_t& reusedTiles)
+    {
+        bool cacheValid = input.details.width == previousWidth && input.details.height == previousHeight &&
+            input.details.format == previousFormat && tileSse.size() == (size_t)tilesX(input) * tilesY(input);
+        if(!cacheValid)
+            tileSse.assign((size_t)tilesX(input) * tilesY(input), 0.0);
+
+        std::vector<size_t> rowReused(tilesY(input), 0);
+        auto processRow = [this, &input, &output, remap, cacheValid, &rowReused](unsigned int tileY){
+            dispatchPixelLayout(input.details.format, [&](auto layout){
+                typedef decltype(layout) Layout;
+                for(unsigned int tileX = 0; tileX < tilesX(input); tileX++)
+                {
+                    size_t t = (size_t)tileY * tilesX(input) + tileX;
+                    if(remap && cacheValid && reuseTile<Layout>(input, output, tileX, tileY))
+                    {
+                        rowReused[tileY]++;
+                        continue;
+                    }
+                    tileSse[t] = mapTile<Layout>(input, output, tileX, tileY, remap);
+                }
+            });
+        };
+        if(threadPool)
+            threadPool->run(tilesY(input), processRow);
+        else
+            for(unsigned int tileY = 0; tileY < tilesY(input); tileY++)
+                processRow(tileY);
+
+        double sse = 0.0;
+        for(double value : tileSse)
+            sse += value;
+        for(size_t count : rowReused)
+            reusedTiles += count;
+        return sse;
+    }
+
+    // Copies the previous output of a tile that did not change.
+    template<class Layout>
+    bool reuseTile(const Image& input, Image& output, unsigned int tileX, unsigned int tileY) const
+    {
+        size_t width = input.details.width;
+        size_t x0 = (size_t)tileX * tileSize, y0 = (size_t)tileY * tileSize;
+        size_t rowBytes = Layout::stride * (std::min<size_t>(x0 + tileSize, width) - x0);
+        size_t yEnd = std::min<size_t>(y0 + tileSize, input.details.height);
+        for(size_t y = y0; y < yEnd; y++)
+        {
+            size_t offset = Layout::stride * (y * width + x0);
+            if(std::memcmp(&input.data[offset], &previousInput[offset], rowBytes) != 0)
+                return false;
+        }
+        for(size_t y = y0; y < yEnd; y++)
+        {
+            size_t offset = Layout::stride * (y * width + x0);
+            std::memcpy(&output.data[offset], &previousOutput[offset], rowBytes);
+        }
+        return true;
+    }
+
+    template<class Layout>
+    double mapTile(const Image& input, Image& output, unsigned int tileX, unsigned int tileY, bool remap) const
+    {
+        size_t width = input.details.width;
+        size_t x0 = (size_t)tileX * tileSize, y0 = (size_t)tileY * tileSize;
+        size_t xEnd = std::min<size_t>(x0 + tileSize, width);
+        size_t yEnd = std::min<size_t>(y0 + tileSize, input.details.height);
+        double sse = 0.0;
+        for(size_t y = y0; y < yEnd; y++)
+        for(size_t x = x0; x < xEnd; x++)
+        {
+            const unsigned char* px = &input.data[Layout::stride * (y * width + x)];
+            unsigned char* out = &output.data[Layout::stride * (y * width + x)];
+            unsigned char r, g, b;
+            Layout::read(px, r, g, b);
+            if(remap)
+                Layout::write(out, px, &palette[3 * lookup.find(r, g, b)]);
+
+            unsigned char qr, qg, qb;
+            Layout::read(out, qr, qg, qb);
+            sse += (r - qr) * (r - qr) + (g - qg) * (g - qg) + (b - qb) * (b - qb);
+        }
+        return sse;
+    }
+
+    void remember(const Image& input, const Image& output)
+    {
+        previousInput.assign(input.data.begin(), input.data.end());
+        previousOutput.assign(output.data.begin(), output.data.end());
+        previousWidth = input.details.width;
+        previousHeight = input.details.height;
+        previousFormat = input.details.format;
+    }
+};
+
+#endif // PALETTE_REUSE_H
@@ -0,0 +1,279 @@
+#ifndef PALETTE_SEEDING_H
+#define PALETTE_SEEDING_H
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <limits>
+
+#include "PixelLayout.h"
+
+// Initial palettes for both quantizers. Every strategy except GrayRamp works on a
+// deterministic sample of the image pixels, so its cost does not depend on the image size.
+class PaletteSeeding
+{
+public:
+    enum Strategy { GrayRamp, KMeansPlusPlus, MedianCut, WuVarianceSplit };
+
+    static constexpr size_t defaultSampleSize = 16384;
+
+    // Every n-th pixel of the image as interleaved RGB.
+    template<class Layout>
+    static std::vector<unsigned char> samplePixels(const unsigned char* pixels, size_t pixelsNumber, size_t sampleSize = defaultSampleSize)
+    {
+        std::vector<unsigned char> sample;
+        size_t step = std::max<size_t>(1, pixelsNumber / sampleSize);
+        for(size_t p = 0; p < pixelsNumber; p += step)
+        {
+            unsigned char rgb[3];
+            Layout::read(pixels + Layout::stride * p, rgb[0], rgb[1], rgb[2]);
+            sample.insert(sample.end(), rgb, rgb + 3);
+        }
+        return sample;
+    }
+
+    static std::vector<unsigned char> seed(Strategy strategy, const std::vector<unsigned char>& sample, unsigned int colorTableSize)
+    {
+        switch(strategy)
+        {
+        case KMeansPlusPlus:
+            return kMeansPlusPlus(sample, colorTableSize);
+        case MedianCut:
+            return splitBoxes(sample, colorTableSize, false);
+        case WuVarianceSplit:
+            return splitBoxes(sample, colorTableSize, true);
+        default:
+            return grayRamp(colorTableSize);
+        }
+    }
+
+    static std::vector<unsigned char> grayRamp(unsigned int colorTableSize)
+    {
+        std::vector<unsigned char> colorTable(3 * colorTableSize);
+        for(int i = 0; i < colorTableSize; i++)
+        {
+            colorTable[3*i] = (i * 255) / colorTableSize ;
+            colorTable[3*i+1] = (i * 255) / colorTableSize ;
+            colorTable[3*i+2] = (i * 255) / colorTableSize;
+        }
+        return colorTable;
+    }
+
+    // Moves every entry with a zero count onto the sample pixel that is currently furthest
+    // from the palette. Returns the number of moved entries.
+    static unsigned int reseedDeadEntries(std::vector<unsigned char>& colorTable, const std::vector<unsigned int>& counts,
+        const std::vector<unsigned char>& sample)
+    {
+        unsigned int colorTableSize = counts.size();
+        size_t samples = sample.size() / 3;
+        if(samples == 0)
+            return 0;
+
+        std::vector<unsigned int> nearest(samples, std::numeric_limits<unsigned int>::max());
+        for(unsigned int i = 0; i < colorTableSize; i++)
+            if(counts[i] != 0)
+                updateNearest(nearest, sample, &colorTable[3*i]);
+
+        unsigned int reseeded = 0;
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            if(counts[i] != 0)
+                continue;
+
+            size_t furthest = std::max_element(nearest.begin(), nearest.end()) - nearest.begin();
+            if(nearest[furthest] == 0)
+                break;
+            std::copy(&sample[3*furthest], &sample[3*furthest] + 3, &colorTable[3*i]);
+            updateNearest(nearest, sample, &colorTable[3*i]);
+            reseeded++;
+        }
+        return reseeded;
+    }
+
+private:
+    static unsigned int squaredDistance(const unsigned char* a, const unsigned char* b)
+    {
+        int dr = a[0] - b[0];
+        int dg = a[1] - b[1];
+        int db = a[2] - b[2];
+        return dr*dr + dg*dg + db*db;
+    }
+
+    static void updateNearest(std::vector<unsigned int>& nearest, const std::vector<unsigned char>& sample, const unsigned char* color)
+    {
+        for(size_t s = 0; s < nearest.size(); s++)
+            nearest[s] = std::min(nearest[s], squaredDistance(&sample[3*s], color));
+    }
+
+    // D^2 weighted sampling with a fixed seed, so runs are reproducible.
+    static std::vector<unsigned char> kMeansPlusPlus(const std::vector<unsigned char>& sample, unsigned int colorTableSize)
+    {
+        size_t samples = sample.size() / 3;
+        if(samples == 0)
+            return grayRamp(colorTableSize);
+
+        std::mt19937 generator(5489u);
+        std::vector<unsigned char> colorTable(3 * colorTableSize);
+        std::vector<unsigned int> nearest(samples, std::numeric_limits<unsigned int>::max());
+
+        size_t chosen = std::uniform_int_distribution<size_t>(0, samples - 1)(generator);
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            std::copy(&sample[3*chosen], &sample[3*chosen] + 3, &colorTable[3*i]);
+            updateNearest(nearest, sample, &colorTable[3*i]);
+
+            unsigned long long total = 0;
+            for(size_t s = 0; s < samples; s++)
+                total += nearest[s];
+            if(total == 0)
+                continue;
+
+            unsigned long long target = std::uniform_int_distribution<unsigned long long>(0, total - 1)(generator);
+            for(chosen = 0; chosen < samples && target >= nearest[chosen]; chosen++)
+                target -= nearest[chosen];
+        }
+        return colorTable;
+    }
+
+    struct Box
+    {
+        std::vector<size_t> members;
+        double score;
+        int axis;
+        size_t splitAt;
+    };
+
+    // Median cut splits the box with the widest channel range at the median of that channel.
+    // The variance split (Wu) splits the box with the largest squared error at the position
+    // that minimizes the squared error of the two halves, trying all three channels.
+    static std::vector<unsigned char> splitBoxes(const std::vector<unsigned char>& sample, unsigned int colorTableSize, bool varianceSplit)
+    {
+        size_t samples = sample.size() / 3;
+        if(samples == 0)
+            return grayRamp(colorTableSize);
+
+        std::vector<Box> boxes(1);
+        for(size_t s = 0; s < samples; s++)
+            boxes[0].members.push_back(s);
+        evaluateBox(boxes[0], sample, varianceSplit);
+
+        while(boxes.size() < colorTableSize)
+        {
+            auto widest = std::max_element(boxes.begin(), boxes.end(), [](const Box& a, const Box& b){ return a.score < b.score; });
+            if(widest->score <= 0.0)
+                break;
+
+            Box& box = *widest;
+            int axis = box.axis;
+            std::sort(box.members.begin(), box.members.end(), [&sample, axis](size_t a, size_t b){
+                return sample[3*a + axis] < sample[3*b + axis];
+            });
+
+            Box upper;
+            upper.members.assign(box.members.begin() + box.splitAt, box.members.end());
+            box.members.resize(box.splitAt);
+            evaluateBox(box, sample, varianceSplit);
+            evaluateBox(upper, sample, varianceSplit);
+            boxes.push_back(std::move(upper));
+        }
+
+        std::vector<unsigned char> colorTable(3 * colorTableSize);
+        for(size_t b = 0; b < colorTableSize; b++)
+        {
+            const Box& box = boxes[std::min(b, boxes.size() - 1)];
+            unsigned long long sum[3] = {0, 0, 0};
+            for(size_t s : box.members)
+                for(int c = 0; c < 3; c++)
+                    sum[c] += sample[3*s + c];
+            for(int c = 0; c < 3; c++)
+                colorTable[3*b + c] = (sum[c] + box.members.size() / 2) / box.members.size();
+        }
+        return colorTable;
+    }
+
+    static void evaluateBox(Box& box, const std::vector<unsigned char>& sample, bool varianceSplit)
+    {
+        box.score = 0.0;
+        box.axis = 0;
+        box.splitAt = 0;
+        size_t n = box.members.size();
+        if(n < 2)
+            return;
+
+        if(!varianceSplit)
+        {
+            for(int axis = 0; axis < 3; axis++)
+            {
+                unsigned char low = 255, high = 0;
+                for(size_t s : box.members)
+                {
+                    low = std::min(low, sample[3*s + axis]);
+                    high = std::max(high, sample[3*s + axis]);
+                }
+                if(high - low > box.score)
+                {
+                    box.score = high - low;
+                    box.axis = axis;
+                }
+            }
+            box.splitAt = n / 2;
+            return;
+        }
+
+        // squared error of the box and of the best two-way split along each channel,
+        // from prefix sums of the members sorted by that channel
+        std::vector<size_t> sorted = box.members;
+        double bestSplitError = std::numeric_limits<double>::max();
+        double boxError = 0.0;
+        for(int axis = 0; axis < 3; axis++)
+        {
+            std::sort(sorted.begin(), sorted.end(), [&sample, axis](size_t a, size_t b){
+                return sample[3*a + axis] < sample[3*b + axis];
+            });
+
+            std::vector<double> prefix(3 * (n + 1), 0.0);
+            std::vector<double> prefixSquares(n + 1, 0.0);
+            for(size_t i = 0; i < n; i++)
+            {
+                const unsigned char* color = &sample[3*sorted[i]];
+                prefixSquares[i + 1] = prefixSquares[i];
+                for(int c = 0; c < 3; c++)
+                {
+                    prefix[3*(i + 1) + c] = prefix[3*i + c] + color[c];
+                    prefixSquares[i + 1] += (double)color[c] * color[c];
+                }
+            }
+
+            auto error = [&](size_t begin, size_t end){
+                double count = end - begin;
+                double squares = prefixSquares[end] - prefixSquares[begin];
+                double norm = 0.0;
+                for(int c = 0; c < 3; c++)
+                {
+                    double sum = prefix[3*end + c] - prefix[3*begin + c];
+                    norm += sum * sum;
+                }
+                return squares - norm / count;
+            };
+
+            boxError = error(0, n);
+            for(size_t i = 1; i < n; i++)
+            {
+                if(sample[3*sorted[i] + axis] == sample[3*sorted[i - 1] + axis])
+                    continue;
+                double splitError = error(0, i) + error(i, n);
+                if(splitError < bestSplitError)
+                {
+                    bestSplitError = splitError;
+                    box.axis = axis;
+                    box.splitAt = i;
+                }
+            }
+        }
+
+        if(box.splitAt != 0)
+            box.score = boxError;
+    }
+};
+
+#endif // PALETTE_SEEDING_H
@@ -0,0 +1,82 @@
+#ifndef PIXEL_LAYOUT_H
+#define PIXEL_LAYOUT_H
+
+#include <png.h>
+
+// Channel layouts of the 8-bit formats the CPU quantizer works on in place. Every layout
+// reads a pixel as RGB and writes a palette entry back; bytes that are not color (alpha)
+// are copied from the source pixel. Gray pixels read as r = g = b, so their palette stays
+// gray and the entry is written back as its mean.
+struct GrayLayout
+{
+    static constexpr unsigned int stride = 1;
+
+    static void read(const unsigned char* px, unsigned char& r, unsigned char& g, unsigned char& b)
+    {
+        r = g = b = px[0];
+    }
+
+    static void write(unsigned char* px, const unsigned char* /*source*/, const unsigned char* color)
+    {
+        px[0] = (color[0] + color[1] + color[2] + 1) / 3;
+    }
+};
+
+struct RGBLayout
+{
+    static constexpr unsigned int stride = 3;
+
+    static void read(const unsigned char* px, unsigned char& r, unsigned char& g, unsigned char& b)
+    {
+        r = px[0];
+        g = px[1];
+        b = px[2];
+    }
+
+    static void write(unsigned char* px, const unsigned char* /*source*/, const unsigned char* color)
+    {
+        px[0] = color[0];
+        px[1] = color[1];
+        px[2] = color[2];
+    }
+};
+
+struct RGBALayout
+{
+    static constexpr unsigned int stride = 4;
+
+    static void read(const unsigned char* px, unsigned char& r, unsigned char& g, unsigned char& b)
+    {
+        r = px[0];
+        g = px[1];
+        b = px[2];
+    }
+
+    static void write(unsigned char* px, const unsigned char* source, const unsigned char* color)
+    {
+        px[0] = color[0];
+        px[1] = color[1];
+        px[2] = color[2];
+        px[3] = source[3];
+    }
+};
+
+// Calls f with the layout of a libpng format: PNG_FORMAT_GRAY, PNG_FORMAT_RGB, otherwise RGBA.
+template<class F>
+void dispatchPixelLayout(png_uint_32 format, F f)
+{
+    switch(format)
+    {
+    case PNG_FORMAT_GRAY:
+        f(GrayLayout());
+        break;
+    case PNG_FORMAT_RGB:
+        f(RGBLayout());
+        break;
+    default:
+        f(RGBALayout());
+        break;
+    }
+}
+
+#endif // PIXEL_LAYOUT_H
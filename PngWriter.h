@@ -0,0 +1,216 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <zlib.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+
+#include "image.h"
+#include "ThreadPool.h"
+
+// Compression settings of writeIndexedImage(). level and strategy go to zlib (0-9 and
+// Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED). Adaptive picks the
+// filter of every row with the smallest sum of absolute differences, like libpng; None is
+// usually best for paletted images. With chunks > 1 the rows are filtered and deflated in
+// that many independent pieces in parallel, which costs a little size at chunk borders.
+struct PngOptions
+{
+    enum Filter { None, Sub, Up, Average, Paeth, Adaptive };
+
+    int level;
+    int strategy;
+    Filter filter;
+    unsigned int chunks;
+
+    PngOptions() : level(6), strategy(Z_DEFAULT_STRATEGY), filter(None), chunks(1)
+    {
+    }
+};
+
+// Encodes a paletted PNG (color type 3). Palettes of up to 2, 4 and 16 entries are stored
+// with 1, 2 and 4 bits per pixel. Chunks run on threadPool when given. An image PNG cannot
+// hold (no palette, more than 256 entries, an index per pixel missing) encodes to nothing.
+class PngWriter
+{
+public:
+    static std::vector<unsigned char> encode(const IndexedImage& image, const PngOptions& options = PngOptions(), ThreadPool* threadPool = NULL)
+    {
+        unsigned int colors = image.palette.size() / 3;
+        if(colors == 0 || colors > IndexedImage::maxColors || image.palette.size() % 3 != 0 ||
+            image.indices.size() != (size_t)image.width * image.height || image.width == 0 || image.height == 0)
+            return std::vector<unsigned char>();
+        unsigned int bitDepth = colors <= 2 ? 1 : (colors <= 4 ? 2 : (colors <= 16 ? 4 : 8));
+        size_t rowBytes = ((size_t)image.width * bitDepth + 7) / 8;
+
+        unsigned int chunks = std::max(1u, std::min<unsigned int>(options.chunks, image.height));
+        std::vector<std::vector<unsigned char> > deflated(chunks);
+        std::vector<uLong> checksums(chunks);
+        std::vector<size_t> lengths(chunks);
+        auto compressChunk = [&](unsigned int chunk){
+            size_t yBegin = (size_t)image.height * chunk / chunks;
+            size_t yEnd = (size_t)image.height * (chunk + 1) / chunks;
+            std::vector<unsigned char> filtered = filterRows(image, bitDepth, rowBytes, yBegin, yEnd, options.filter);
+            lengths[chunk] = filtered.size();
+            checksums[chunk] = adler32(adler32(0L, Z_NULL, 0), filtered.data(), filtered.size());
+            deflated[chunk] = deflateChunk(filtered, options, chunk + 1 == chunks);
+        };
+        if(threadPool && chunks > 1)
+            threadPool->run(chunks, compressChunk);
+        else
+            for(unsigned int chunk = 0; chunk < chunks; chunk++)
+                compressChunk(chunk);
+
+        // one zlib stream: header, the raw deflate pieces back to back, Adler-32 of all rows
+        unsigned int cmf = 0x78;
+        unsigned int flevel = options.level < 2 ? 0 : (options.level < 6 ? 1 : (options.level == 6 ? 2 : 3));
+        unsigned int flg = flevel << 6;
+        flg += 31 - (cmf * 256 + flg) % 31;
+        uLong checksum = checksums[0];
+        for(unsigned int chunk = 1; chunk < chunks; chunk++)
+            checksum = adler32_combine(checksum, checksums[chunk], lengths[chunk]);
+
+        std::vector<unsigned char> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        std::vector<unsigned char> header;
+        putUint32(header, image.width);
+        putUint32(header, image.height);
+        header.insert(header.end(), {(unsigned char)bitDepth, 3, 0, 0, 0});
+        writeChunk(png, "IHDR", header.data(), header.size());
+        writeChunk(png, "PLTE", image.palette.data(), 3 * colors);
+
+        std::vector<unsigned char> start = {(unsigned char)cmf, (unsigned char)flg};
+        writeChunk(png, "IDAT", start.data(), start.size());
+        for(const std::vector<unsigned char>& piece : deflated)
+            writeChunk(png, "IDAT", piece.data(), piece.size());
+        std::vector<unsigned char> end;
+        putUint32(end, checksum);
+        writeChunk(png, "IDAT", end.data(), end.size());
+        writeChunk(png, "IEND", NULL, 0);
+        return png;
+    }
+
+private:
+    static void putUint32(std::vector<unsigned char>& out, uLong value)
+    {
+        out.insert(out.end(), {(unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value});
+    }
+
+    static void writeChunk(std::vector<unsigned char>& png, const char* type, const unsigned char* data, size_t size)
+    {
+        putUint32(png, size);
+        size_t typeOffset = png.size();
+        png.insert(png.end(), type, type + 4);
+        if(size > 0)
+            png.insert(png.end(), data, data + size);
+        putUint32(png, crc32(crc32(0L, Z_NULL, 0), &png[typeOffset], 4 + size));
+    }
+
+    static void packRow(const IndexedImage& image, unsigned int bitDepth, size_t y, unsigned char* row, size_t rowBytes)
+    {
+        const unsigned char* indices = &image.indices[y * image.width];
+        if(bitDepth == 8)
+        {
+            std::copy(indices, indices + image.width, row);
+            return;
+        }
+        std::fill(row, row + rowBytes, 0);
+        unsigned int perByte = 8 / bitDepth;
+        for(size_t x = 0; x < image.width; x++)
+            row[x / perByte] |= indices[x] << (8 - bitDepth * (x % perByte + 1));
+    }
+
+    static unsigned char paeth(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+    }
+
+    // Filter type byte plus filtered bytes of one row; bytes per pixel is 1 for every depth here.
+    static void filterRow(PngOptions::Filter filter, const unsigned char* row, const unsigned char* previous, size_t rowBytes, unsigned char* out)
+    {
+        out[0] = filter;
+        for(size_t i = 0; i < rowBytes; i++)
+        {
+            int left = i > 0 ? row[i - 1] : 0, up = previous[i], upLeft = i > 0 ? previous[i - 1] : 0;
+            int predicted = filter == PngOptions::Sub ? left : filter == PngOptions::Up ? up :
+                filter == PngOptions::Average ? (left + up) / 2 : filter == PngOptions::Paeth ? paeth(left, up, upLeft) : 0;
+            out[i + 1] = (unsigned char)(row[i] - predicted);
+        }
+    }
+
+    static std::vector<unsigned char> filterRows(const IndexedImage& image, unsigned int bitDepth, size_t rowBytes,
+        size_t yBegin, size_t yEnd, PngOptions::Filter filter)
+    {
+        std::vector<unsigned char> filtered((yEnd - yBegin) * (rowBytes + 1));
+        std::vector<unsigned char> previous(rowBytes, 0), row(rowBytes), candidate(rowBytes + 1);
+        if(yBegin > 0)
+            packRow(image, bitDepth, yBegin - 1, previous.data(), rowBytes);
+        for(size_t y = yBegin; y < yEnd; y++)
+        {
+            packRow(image, bitDepth, y, row.data(), rowBytes);
+            unsigned char* out = &filtered[(y - yBegin) * (rowBytes + 1)];
+            if(filter != PngOptions::Adaptive)
+                filterRow(filter, row.data(), previous.data(), rowBytes, out);
+            else
+            {
+                unsigned long long bestCost = ~0ull;
+                for(int type = PngOptions::None; type <= PngOptions::Paeth; type++)
+                {
+                    filterRow((PngOptions::Filter)type, row.data(), previous.data(), rowBytes, candidate.data());
+                    unsigned long long cost = 0;
+                    for(size_t i = 1; i <= rowBytes; i++)
+                        cost += std::abs((int)(signed char)candidate[i]);
+                    if(cost < bestCost)
+                    {
+                        bestCost = cost;
+                        std::copy(candidate.begin(), candidate.end(), out);
+                    }
+                }
+            }
+            std::swap(previous, row);
+        }
+        return filtered;
+    }
+
+    // Raw deflate of one piece; all but the last end on a byte boundary with a sync flush so
+    // the pieces can be concatenated.
+    static std::vector<unsigned char> deflateChunk(std::vector<unsigned char>& data, const PngOptions& options, bool last)
+    {
+        z_stream stream = z_stream();
+        deflateInit2(&stream, std::min(9, std::max(0, options.level)), Z_DEFLATED, -15, 8, options.strategy);
+        std::vector<unsigned char> out(deflateBound(&stream, data.size()) + 16);
+        stream.next_in = data.data();
+        stream.avail_in = data.size();
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        while(deflate(&stream, flush) == Z_OK && stream.avail_out == 0)
+        {
+            size_t used = out.size();
+            out.resize(2 * out.size());
+            stream.next_out = out.data() + used;
+            stream.avail_out = out.size() - used;
+        }
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return out;
+    }
+};
+
+// Writes image as a paletted PNG; false when it cannot be encoded or the file cannot be written.
+bool writeIndexedImage(std::string filename, const IndexedImage& image, const PngOptions& options = PngOptions(), ThreadPool* threadPool = NULL)
+{
+    std::vector<unsigned char> png = PngWriter::encode(image, options, threadPool);
+    if(png.empty())
+        return false;
+    std::ofstream file(filename, std::ios::binary);
+    file.write((const char*)png.data(), png.size());
+    return (bool)file;
+}
+
+#endif // PNG_WRITER_H
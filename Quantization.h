@@ -1,12 +1,72 @@
 #ifndef QUANTIZATION_H
 #define QUANTIZATION_H
 
+#include <cmath>
+#include <chrono>
+#include <limits>
+
+// Describes the last iterate(): how many pixels moved to another palette entry, how far
+// the furthest palette entry moved, and the squared error of the assignment it used.
+struct Convergence
+{
+    unsigned long long reassignedPixels;
+    float maxCentroidShift;
+    double sse;
+};
+
+// Cost and quality of the last init(), iterate() or finalize(). Times are in milliseconds;
+// kernelTime is device time from profiling events and 0 on the CPU. pixelsProcessed counts
+// the samples the phase visited (pixels, histogram entries or batch pixels) and sse/psnr
+// compare them with the entries they were assigned to; both are 0 after init().
+// emptyClusters counts entries that got no pixel, before they were reseeded.
+struct PhaseStats
+{
+    double wallTime;
+    double kernelTime;
+    unsigned long long bytesTransferred;
+    unsigned long long pixelsProcessed;
+    unsigned long long distanceEvaluations;
+    double sse;
+    double psnr;
+    unsigned int emptyClusters;
+};
+
+// PSNR in dB of an RGB squared error over pixels, infinite for an exact match.
+inline double peakSignalToNoiseRatio(double sse, unsigned long long pixels)
+{
+    if(pixels == 0)
+        return 0.0;
+    if(sse <= 0.0)
+        return std::numeric_limits<double>::infinity();
+    return 10.0 * std::log10(255.0 * 255.0 * 3.0 * pixels / sse);
+}
+
+// Wall clock of one phase.
+class PhaseTimer
+{
+private:
+    std::chrono::high_resolution_clock::time_point begin;
+public:
+    void start()
+    {
+        begin = std::chrono::high_resolution_clock::now();
+    }
+
+    double milliseconds() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+    }
+};
+
 class Quantization
 {
 public:
+    virtual ~Quantization() {}
     virtual void init() = 0;
     virtual void iterate() = 0;
     virtual void finalize() = 0;
+    virtual Convergence convergence() = 0;
+    virtual PhaseStats stats() = 0;
 };
 
 #endif // QUANTIZATION_H
\ No newline at end of file
@@ -0,0 +1,244 @@
+#ifndef QUANTIZATION_SERVICE_H
+#define QUANTIZATION_SERVICE_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "image.h"
+#include "Quantization.h"
+#include "KMeansCPUQuantization.h"
+#include "KMeansGPUQuantization.h"
+
+// One image to quantize. The image is moved into the job. output is optional: an image of
+// the same size and format (e.g. the output of an earlier result) is written in place
+// instead of allocating a new one. Iterations stop after maxIterations, once the largest
+// centroid shift drops below minShift, or once timeLimit milliseconds (0: none) have
+// passed since the job started running; finalize() always runs.
+struct QuantizationJob
+{
+    enum Backend { CPU, OpenCL };
+
+    Image image;
+    Image output;
+    unsigned int colors;
+    unsigned int maxIterations;
+    float minShift;
+    double timeLimit;
+    Backend backend;
+};
+
+struct QuantizationResult
+{
+    Image image;
+    std::vector<unsigned char> colorTable;
+    unsigned int iterations;
+    Convergence convergence;
+    // time spent in the queue and running, in milliseconds
+    double queueTime;
+    double runTime;
+};
+
+// Runs quantization jobs submitted from any thread on a fixed set of workers. Jobs wait in
+// a bounded queue per backend; submit() blocks while the queues hold capacity jobs and
+// trySubmit() refuses them instead. Every CPU worker keeps one KMeansCPUQuantization (its
+// threads and buffers) for all of its jobs and every OpenCL worker its own OpenCLEngine and
+// KMeansGPUQuantization, both re-targeted with reset(), so a steady stream of similar images
+// does not allocate per job beyond the returned image.
+// Errors, e.g. a backend without workers or a non-RGBA image for OpenCL, arrive through
+// the future. The destructor finishes the jobs already queued.
+class QuantizationService
+{
+private:
+    struct PendingJob
+    {
+        QuantizationJob job;
+        std::promise<QuantizationResult> promise;
+        PhaseTimer queueTimer;
+    };
+
+    size_t capacity;
+    unsigned int threadsPerWorker;
+
+    std::mutex mutex;
+    std::condition_variable jobQueued;
+    std::condition_variable slotFreed;
+    std::deque<PendingJob> queues[2];
+    unsigned int workersNumber[2];
+    bool stopping;
+
+    std::vector<std::unique_ptr<OpenCLEngine> > engines;
+    std::vector<std::thread> workers;
+
+public:
+    // threadsPerWorker is the size of each CPU worker's thread pool. OpenCL workers all use
+    // the first device, each with its own context and queue.
+    QuantizationService(unsigned int cpuWorkers, unsigned int threadsPerWorker = 1, unsigned int openclWorkers = 0,
+        size_t capacity = 64, std::string kernelFilename = "parallelReductionKernel.cl") :
+        capacity(std::max<size_t>(1, capacity)), threadsPerWorker(std::max(1u, threadsPerWorker)), stopping(false)
+    {
+        workersNumber[QuantizationJob::CPU] = cpuWorkers;
+        workersNumber[QuantizationJob::OpenCL] = openclWorkers;
+        for(unsigned int i = 0; i < openclWorkers; i++)
+            engines.emplace_back(new OpenCLEngine(kernelFilename));
+
+        for(unsigned int i = 0; i < cpuWorkers; i++)
+            workers.emplace_back([this](){ cpuWorker(); });
+        for(unsigned int i = 0; i < openclWorkers; i++)
+            workers.emplace_back([this, i](){ openclWorker(engines[i].get()); });
+    }
+
+    ~QuantizationService()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobQueued.notify_all();
+        slotFreed.notify_all();
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    QuantizationService(const QuantizationService&) = delete;
+    QuantizationService& operator=(const QuantizationService&) = delete;
+
+    std::future<QuantizationResult> submit(QuantizationJob job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFreed.wait(lock, [this](){ return stopping || queuedJobs() < capacity; });
+        return enqueue(std::move(job), lock);
+    }
+
+    // Like submit(), but returns false instead of waiting when the queues are full.
+    bool trySubmit(QuantizationJob& job, std::future<QuantizationResult>& result)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(!stopping && queuedJobs() >= capacity)
+            return false;
+        result = enqueue(std::move(job), lock);
+        return true;
+    }
+
+    size_t queuedJobs() const
+    {
+        return queues[0].size() + queues[1].size();
+    }
+
+private:
+    std::future<QuantizationResult> enqueue(QuantizationJob job, std::unique_lock<std::mutex>& lock)
+    {
+        std::promise<QuantizationResult> promise;
+        std::future<QuantizationResult> result = promise.get_future();
+        if(stopping || workersNumber[job.backend] == 0)
+        {
+            promise.set_exception(std::make_exception_ptr(std::invalid_argument(
+                stopping ? "quantization service is stopping" : "no workers for the requested backend")));
+            return result;
+        }
+
+        PendingJob pending;
+        pending.job = std::move(job);
+        pending.promise = std::move(promise);
+        pending.queueTimer.start();
+        queues[pending.job.backend].push_back(std::move(pending));
+        lock.unlock();
+        jobQueued.notify_all();
+        return result;
+    }
+
+    // Waits for a job of backend; false once the service stops and the queue is empty.
+    bool takeJob(QuantizationJob::Backend backend, PendingJob& pending)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobQueued.wait(lock, [this, backend](){ return stopping || !queues[backend].empty(); });
+        if(queues[backend].empty())
+            return false;
+        pending = std::move(queues[backend].front());
+        queues[backend].pop_front();
+        lock.unlock();
+        slotFreed.notify_one();
+        return true;
+    }
+
+    void cpuWorker()
+    {
+        KMeansCPUQuantization quantizer(NULL, NULL, 0, threadsPerWorker);
+        PendingJob pending;
+        while(takeJob(QuantizationJob::CPU, pending))
+            run(pending, [&quantizer](QuantizationJob& job) -> Quantization& {
+                quantizer.reset(&job.image, &job.output, job.colors);
+                return quantizer;
+            }, [&quantizer](){ return quantizer.getColorTable(); });
+    }
+
+    void openclWorker(OpenCLEngine* engine)
+    {
+        KMeansGPUQuantization quantizer(engine, NULL, NULL, 0);
+        PendingJob pending;
+        while(takeJob(QuantizationJob::OpenCL, pending))
+        {
+            if(pending.job.image.details.format != PNG_FORMAT_RGBA)
+            {
+                pending.promise.set_exception(std::make_exception_ptr(std::invalid_argument("the OpenCL backend needs RGBA images")));
+                continue;
+            }
+            run(pending, [&quantizer](QuantizationJob& job) -> Quantization& {
+                quantizer.reset(&job.image, &job.output, job.colors);
+                return quantizer;
+            }, [&quantizer](){ return quantizer.getColorTable(); });
+            // the job's images leave with the result, so nothing may still be queued for them
+            quantizer.reset(NULL, NULL, 0);
+        }
+    }
+
+    template<class Prepare, class ColorTable>
+    void run(PendingJob& pending, Prepare prepare, ColorTable colorTable)
+    {
+        QuantizationJob& job = pending.job;
+        QuantizationResult result;
+        result.queueTime = pending.queueTimer.milliseconds();
+        try
+        {
+            PhaseTimer runTimer;
+            runTimer.start();
+            const png_image& details = job.image.details;
+            if(job.output.data.size() != job.image.data.size() || job.output.details.width != details.width ||
+                job.output.details.height != details.height || job.output.details.format != details.format)
+                job.output = createBlankImage(details.width, details.height, details.format);
+
+            Quantization& quantizer = prepare(job);
+            quantizer.init();
+            result.iterations = 0;
+            result.convergence = Convergence();
+            while(result.iterations < job.maxIterations)
+            {
+                quantizer.iterate();
+                result.iterations++;
+                result.convergence = quantizer.convergence();
+                if(result.convergence.maxCentroidShift < job.minShift)
+                    break;
+                if(job.timeLimit > 0 && runTimer.milliseconds() >= job.timeLimit)
+                    break;
+            }
+            quantizer.finalize();
+
+            result.colorTable = colorTable();
+            result.image = std::move(job.output);
+            result.runTime = runTimer.milliseconds();
+            pending.promise.set_value(std::move(result));
+        }
+        catch(...)
+        {
+            pending.promise.set_exception(std::current_exception());
+        }
+    }
+};
+
+#endif // QUANTIZATION_SERVICE_H
@@ -0,0 +1,103 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+// Fixed set of worker threads executing numbered tasks. The thread calling run()
+// takes part in the work, so a pool of size 1 runs everything on the caller.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::condition_variable allDone;
+
+    std::function<void(unsigned int)> task;
+    unsigned int tasksNumber;
+    unsigned int nextTask;
+    unsigned int finishedTasks;
+    unsigned long long generation;
+    bool stopping;
+public:
+    ThreadPool(unsigned int threadsNumber = std::thread::hardware_concurrency()) :
+        tasksNumber(0), nextTask(0), finishedTasks(0), generation(0), stopping(false)
+    {
+        threadsNumber = std::max(1u, threadsNumber);
+        for(unsigned int i = 1; i < threadsNumber; i++)
+            workers.emplace_back([this](){ work(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int size() const
+    {
+        return workers.size() + 1;
+    }
+
+    // Calls f(0) ... f(count - 1) across the pool and returns once all of them finished.
+    void run(unsigned int count, std::function<void(unsigned int)> f)
+    {
+        if(count == 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        task = std::move(f);
+        tasksNumber = count;
+        nextTask = 0;
+        finishedTasks = 0;
+        generation++;
+        wakeUp.notify_all();
+
+        executeTasks(lock);
+        allDone.wait(lock, [this](){ return finishedTasks == tasksNumber; });
+        task = nullptr;
+    }
+
+private:
+    void work()
+    {
+        unsigned long long seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wakeUp.wait(lock, [this, &seenGeneration](){ return stopping || generation != seenGeneration; });
+            if(stopping)
+                return;
+            seenGeneration = generation;
+            executeTasks(lock);
+        }
+    }
+
+    void executeTasks(std::unique_lock<std::mutex>& lock)
+    {
+        while(nextTask < tasksNumber)
+        {
+            unsigned int current = nextTask++;
+            lock.unlock();
+            task(current);
+            lock.lock();
+            if(++finishedTasks == tasksNumber)
+                allDone.notify_all();
+        }
+    }
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,289 @@
+#ifndef TILED_QUANTIZATION_H
+#define TILED_QUANTIZATION_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <iostream>
+
+#include "image.h"
+#include "Quantization.h"
+#include "ThreadPool.h"
+#include "NearestColor.h"
+#include "PaletteSeeding.h"
+
+// K-means for images that do not fit into memory. The PNG is never held as a whole: every
+// pass decodes it again tileRows rows at a time, so memory is bounded by one tile of RGBA
+// rows plus the palette sums, whatever the image size. init() streams the file once to
+// draw the seeding sample, every iterate() streams it to accumulate running per-entry sums,
+// and finalize() streams it once more, writing the quantized rows as they are produced.
+//
+// Without per-pixel labels the number of reassigned pixels is not known; convergence()
+// reports the palette shift and the SSE only. stats() counts the RGBA bytes decoded and
+// encoded by a phase as its transferred bytes.
+class TiledQuantization : public Quantization
+{
+private:
+    std::string inputFilename;
+    std::string outputFilename;
+    unsigned int colorTableSize;
+    unsigned int tileRows;
+    unsigned int threadsNumber;
+    bool valid;
+
+    ThreadPool threadPool;
+
+    unsigned int width;
+    unsigned int height;
+    std::vector<unsigned char> tile;
+
+    std::vector<unsigned char> colorTable;
+    NearestColorSearch nearestColor;
+    std::vector<unsigned long long> acc;
+    std::vector<unsigned long long> counter;
+
+    PaletteSeeding::Strategy seedingStrategy;
+    std::vector<unsigned char> sample;
+
+    // one accumulator set per band of tile rows, merged in band order after every tile
+    std::vector<std::vector<unsigned long long> > bandAcc;
+    std::vector<std::vector<unsigned long long> > bandCounter;
+    std::vector<double> bandSse;
+
+    Convergence lastConvergence;
+    PhaseStats lastStats;
+    PhaseTimer phaseTimer;
+public:
+    TiledQuantization(std::string inputFilename, std::string outputFilename, unsigned int colorTableSize, unsigned int tileRows = 256,
+        unsigned int threadsNumber = std::thread::hardware_concurrency()) :
+        inputFilename(inputFilename), outputFilename(outputFilename), colorTableSize(colorTableSize), tileRows(std::max(1u, tileRows)),
+        threadsNumber(std::max(1u, threadsNumber)), valid(false), threadPool(this->threadsNumber), width(0), height(0),
+        seedingStrategy(PaletteSeeding::GrayRamp), lastConvergence(), lastStats()
+    {
+    }
+
+    void setSeedingStrategy(PaletteSeeding::Strategy strategy)
+    {
+        seedingStrategy = strategy;
+    }
+
+    Convergence convergence()
+    {
+        return lastConvergence;
+    }
+
+    PhaseStats stats()
+    {
+        return lastStats;
+    }
+
+    // bytes of decoded pixels held at any time
+    size_t getTileBytes() const
+    {
+        return tile.size();
+    }
+
+    void init()
+    {
+        phaseTimer.start();
+        PngRowReader reader;
+        valid = reader.open(inputFilename);
+        if(!valid)
+        {
+            std::cout<<"cannot stream "<<inputFilename<<" (missing, unreadable or interlaced)"<<std::endl;
+            return;
+        }
+        width = reader.getWidth();
+        height = reader.getHeight();
+        tileRows = std::min(tileRows, std::max(1u, height));
+        tile.resize(4 * (size_t)width * tileRows);
+
+        // same pixels as PaletteSeeding::samplePixels() on the decoded image
+        size_t pixelsNumber = (size_t)width * height;
+        size_t step = std::max<size_t>(1, pixelsNumber / PaletteSeeding::defaultSampleSize);
+        sample.clear();
+        valid = streamTiles(reader, [this, step](unsigned int firstRow, unsigned int rows){
+            size_t first = (size_t)firstRow * width;
+            size_t p = ((first + step - 1) / step) * step;
+            for(; p < first + (size_t)rows * width; p += step)
+            {
+                const unsigned char* px = &tile[4 * (p - first)];
+                sample.insert(sample.end(), px, px + 3);
+            }
+        });
+        colorTable = PaletteSeeding::seed(seedingStrategy, sample, colorTableSize);
+        nearestColor.setPalette(colorTable.data(), colorTableSize);
+
+        acc.assign(3*colorTableSize, 0);
+        counter.assign(colorTableSize, 0);
+        bandAcc.assign(threadsNumber, std::vector<unsigned long long>(3*colorTableSize));
+        bandCounter.assign(threadsNumber, std::vector<unsigned long long>(colorTableSize));
+        bandSse.assign(threadsNumber, 0.0);
+        lastConvergence = Convergence();
+
+        endPhase(1, 0, 0.0, 0);
+        // nothing is assigned yet
+        lastStats.psnr = 0.0;
+    }
+
+    void iterate()
+    {
+        if(!valid)
+            return;
+        phaseTimer.start();
+
+        std::fill(acc.begin(), acc.end(), 0);
+        std::fill(counter.begin(), counter.end(), 0);
+        lastConvergence = Convergence();
+
+        PngRowReader reader;
+        valid = reader.open(inputFilename) && streamTiles(reader, [this](unsigned int, unsigned int rows){
+            threadPool.run(threadsNumber, [this, rows](unsigned int band){
+                accumulateBand(band, rows);
+            });
+            for(unsigned int band = 0; band < threadsNumber; band++)
+            {
+                for(unsigned int i = 0; i < colorTableSize; i++)
+                    counter[i] += bandCounter[band][i];
+                for(unsigned int i = 0; i < 3*colorTableSize; i++)
+                    acc[i] += bandAcc[band][i];
+                lastConvergence.sse += bandSse[band];
+            }
+        });
+        if(!valid)
+            return;
+
+        std::vector<unsigned char> previous = colorTable;
+        std::vector<unsigned int> counts(colorTableSize);
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            counts[i] = std::min<unsigned long long>(counter[i], 0xFFFFFFFFu);
+            if(counter[i] == 0) continue;
+
+            colorTable[3*i + 0] = acc[3*i + 0] / counter[i];
+            colorTable[3*i + 1] = acc[3*i + 1] / counter[i];
+            colorTable[3*i + 2] = acc[3*i + 2] / counter[i];
+        }
+        PaletteSeeding::reseedDeadEntries(colorTable, counts, sample);
+        nearestColor.setPalette(colorTable.data(), colorTableSize);
+
+        for(unsigned int i = 0; i < colorTableSize; i++)
+        {
+            float shift = nearestColor.distance(i, previous[3*i], previous[3*i + 1], previous[3*i + 2]);
+            lastConvergence.maxCentroidShift = std::max(lastConvergence.maxCentroidShift, shift);
+        }
+        endPhase(1, colorTableSize, lastConvergence.sse, std::count(counts.begin(), counts.end(), 0u));
+    }
+
+    void finalize()
+    {
+        if(!valid)
+            return;
+        phaseTimer.start();
+
+        PngRowReader reader;
+        PngRowWriter writer;
+        if(!reader.open(inputFilename) || !writer.open(outputFilename, width, height))
+        {
+            std::cout<<"cannot write "<<outputFilename<<std::endl;
+            return;
+        }
+
+        double sse = 0.0;
+        bool written = streamTiles(reader, [this, &writer, &sse](unsigned int, unsigned int rows){
+            threadPool.run(threadsNumber, [this, rows](unsigned int band){
+                quantizeBand(band, rows);
+            });
+            for(unsigned int band = 0; band < threadsNumber; band++)
+                sse += bandSse[band];
+            writer.writeRows(tile.data(), rows);
+        });
+        if(!writer.close() || !written)
+            std::cout<<"cannot write "<<outputFilename<<std::endl;
+
+        endPhase(2, colorTableSize, sse, 0);
+    }
+
+private:
+    // passes over the file: one to decode, two when the quantized rows are encoded as well
+    void endPhase(unsigned int passes, unsigned int evaluationsPerPixel, double sse, unsigned int emptyClusters)
+    {
+        unsigned long long pixels = (unsigned long long)width * height;
+        lastStats = PhaseStats();
+        lastStats.wallTime = phaseTimer.milliseconds();
+        lastStats.bytesTransferred = 4 * pixels * passes;
+        lastStats.pixelsProcessed = pixels;
+        lastStats.distanceEvaluations = pixels * evaluationsPerPixel;
+        lastStats.sse = sse;
+        lastStats.psnr = peakSignalToNoiseRatio(sse, pixels);
+        lastStats.emptyClusters = emptyClusters;
+    }
+
+    // Decodes the image tile by tile into tile and calls f(first row, rows) for each.
+    template<class F>
+    bool streamTiles(PngRowReader& reader, F f)
+    {
+        for(unsigned int row = 0; row < height; )
+        {
+            unsigned int rows = reader.readRows(tile.data(), tileRows);
+            if(rows == 0)
+                return false;
+            f(row, rows);
+            row += rows;
+        }
+        return true;
+    }
+
+    void bandRange(unsigned int band, unsigned int rows, size_t& begin, size_t& end) const
+    {
+        begin = ((size_t)rows * band) / threadsNumber;
+        end = ((size_t)rows * (band + 1)) / threadsNumber;
+    }
+
+    void accumulateBand(unsigned int band, unsigned int rows)
+    {
+        std::vector<unsigned long long>& acc = bandAcc[band];
+        std::vector<unsigned long long>& counter = bandCounter[band];
+        std::fill(acc.begin(), acc.end(), 0);
+        std::fill(counter.begin(), counter.end(), 0);
+        double& sse = bandSse[band];
+        sse = 0.0;
+
+        size_t yBegin, yEnd;
+        bandRange(band, rows, yBegin, yEnd);
+        for(size_t p = yBegin * width; p < yEnd * width; p++)
+        {
+            unsigned char r = tile[4*p + 0];
+            unsigned char g = tile[4*p + 1];
+            unsigned char b = tile[4*p + 2];
+            unsigned int i = nearestColor.find(r, g, b);
+            sse += nearestColor.squaredDistance(i, r, g, b);
+
+            acc[3*i + 0] += r;
+            acc[3*i + 1] += g;
+            acc[3*i + 2] += b;
+            counter[i] += 1;
+        }
+    }
+
+    // quantizes the tile in place, keeping the source alpha; it is written out right after
+    void quantizeBand(unsigned int band, unsigned int rows)
+    {
+        double& sse = bandSse[band];
+        sse = 0.0;
+
+        size_t yBegin, yEnd;
+        bandRange(band, rows, yBegin, yEnd);
+        for(size_t p = yBegin * width; p < yEnd * width; p++)
+        {
+            unsigned int i = nearestColor.find(tile[4*p + 0], tile[4*p + 1], tile[4*p + 2]);
+            sse += nearestColor.squaredDistance(i, tile[4*p + 0], tile[4*p + 1], tile[4*p + 2]);
+            tile[4*p + 0] = colorTable[3*i + 0];
+            tile[4*p + 1] = colorTable[3*i + 1];
+            tile[4*p + 2] = colorTable[3*i + 2];
+        }
+    }
+};
+
+#endif // TILED_QUANTIZATION_H
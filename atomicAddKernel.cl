@@ -1,82 +1,138 @@
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
 
-uint colorize(uint colorTableSize, __global uchar* colorTable, uint4 color)
+// Every work-item handles PIXELS_PER_ITEM horizontally adjacent pixels (set with -D by the host).
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 1
+#endif
+
+// The palette is padded to uchar4 (the fourth byte is 0), so an entry is one load and a dot product.
+// Every entry is read once per work-item and compared against all of its pixels.
+void colorize(uint colorTableSize, __constant uchar4* colorTable, const float4* colors, uint* bestIndices)
 {
-    uint bestIndex = 0;
-    float bestValue = FLT_MAX;
+    float bestValues[PIXELS_PER_ITEM];
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        bestIndices[p] = 0;
+        bestValues[p] = FLT_MAX;
+    }
 
     for(uint i = 0; i < colorTableSize; i++)
     {
-        float value = (colorTable[3*i] - color.x) * (colorTable[3*i] - color.x) +
-                      (colorTable[3*i + 1] - color.y) * (colorTable[3*i + 1] - color.y) +
-                      (colorTable[3*i + 2] - color.z) * (colorTable[3*i + 2] - color.z); 
-        if(value < bestValue)
+        float4 entry = convert_float4(colorTable[i]);
+        for(uint p = 0; p < PIXELS_PER_ITEM; p++)
         {
-            bestValue = value;
-            bestIndex = i;
+            float4 difference = entry - colors[p];
+            float value = dot(difference, difference);
+            if(value < bestValues[p])
+            {
+                bestValues[p] = value;
+                bestIndices[p] = i;
+            }
         }
     }
+}
+
+void readPixels(__read_only image2d_t image, int x, int y, uint4* pixels, float4* colors)
+{
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        pixels[p] = read_imageui(image, sampler, (int2)(x + p, y));
+        colors[p] = (float4)(pixels[p].x, pixels[p].y, pixels[p].z, 0.0f);
+    }
+}
 
-    return bestIndex;
+uint squaredDistance(uchar4 entry, uint4 color)
+{
+    int dr = entry.x - (int)color.x;
+    int dg = entry.y - (int)color.y;
+    int db = entry.z - (int)color.z;
+    return dr*dr + dg*dg + db*db;
 }
 
 __kernel void quantize(
         __read_only image2d_t image,
         uint colorTableSize,
-        __global uchar* colorTable,
-        __write_only image2d_t output
+        __constant uchar4* colorTable,
+        __write_only image2d_t output,
+        uint width,
+        uint height
 )
 {
-
-    const int2 dim = get_image_dim(image);
-    const int2 cord;
-    cord.x = get_global_id(0);
-    cord.y = get_global_id(1);
-
-    if(cord.x >= dim.x || cord.y >= dim.y)
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
     {
         return;
     }  
 
-    uint4 px = read_imageui(image, sampler, cord);
-    uint index = colorize(colorTableSize, colorTable, px);
-    uint4 color = (uint4)(colorTable[3*index], colorTable[3*index+1], colorTable[3*index+2], 255);
-    
-    write_imageui(output, cord, color);
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint indices[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+    colorize(colorTableSize, colorTable, colors, indices);
+
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+    {
+        uint4 color = convert_uint4(colorTable[indices[p]]);
+        color.w = pixels[p].w;
+        write_imageui(output, (int2)(x + p, y), color);
+    }
 }
 
 __kernel void accumulate(
         __read_only image2d_t image,
         uint colorTableSize,
-        __global uchar* colorTable,
+        __constant uchar4* colorTable,
         __global uint* partialSums,
-        __local uint* localSums
+        __local uint* localSums,
+        __global uint* labels,
+        __global uint* convergence,
+        uint width,
+        uint height
     )
 {
-    const int2 dim = get_image_dim(image);
-    const int2 cord = (int2)(get_global_id(0), get_global_id(1));
-    if(cord.x >= dim.x || cord.y >= dim.y)
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
         return;
-    const uint2 localId = (uint2)(get_local_id(0), get_local_id(1));
-    const uint2 groupId = (uint2)(get_group_id(0), get_group_id(1));
-    const uint2 groups = (uint2)(get_num_groups(0), get_num_groups(1));
-    const uint2 groupSize = (uint2)(get_local_size(0), get_local_size(1));
-
-    uint4 px = read_imageui(image, sampler, cord);
-    uint bestColorIndex = colorize(colorTableSize, colorTable, px);
-
-    atomic_add(partialSums + 4*bestColorIndex + 0, 1);
-    atomic_add(partialSums + 4*bestColorIndex + 1, px.x);
-    atomic_add(partialSums + 4*bestColorIndex + 2, px.y);
-    atomic_add(partialSums + 4*bestColorIndex + 3, px.z);
+
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint indices[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+    colorize(colorTableSize, colorTable, colors, indices);
+
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+    {
+        uint4 px = pixels[p];
+        uint bestColorIndex = indices[p];
+
+        uint pixelIndex = x + p + y * width;
+        if(labels[pixelIndex] != bestColorIndex)
+        {
+            labels[pixelIndex] = bestColorIndex;
+            atomic_inc(convergence + 0);
+        }
+        uint error = squaredDistance(colorTable[bestColorIndex], px);
+        uint sseLow = atomic_add(convergence + 1, error);
+        if(sseLow + error < sseLow)
+            atomic_inc(convergence + 2);
+
+        atomic_add(partialSums + 4*bestColorIndex + 0, 1);
+        atomic_add(partialSums + 4*bestColorIndex + 1, px.x);
+        atomic_add(partialSums + 4*bestColorIndex + 2, px.y);
+        atomic_add(partialSums + 4*bestColorIndex + 3, px.z);
+    }
 }
 
 __kernel void partition(
         uint colorTableSize,
-        __global uchar* colorTable,
+        __global uchar4* colorTable,
         __global uint* partialSums,
         uint accGroupsNumber,
-        uint accGroupsX
+        uint accGroupsX,
+        __global uint* convergence,
+        __global uint* counts
     )
 {
     uint id = get_global_id(0);
@@ -92,15 +148,22 @@ __kernel void partition(
     racc    = partialSums[4* id + 1]; 
     gacc    = partialSums[4* id + 2]; 
     bacc    = partialSums[4* id + 3]; 
-
-
-    if(counter == 0)
-        counter = 1;
-    colorTable[3*id    ] = racc / counter;
-    colorTable[3*id + 1] = gacc / counter;
-    colorTable[3*id + 2] = bacc / counter;
     partialSums[4* id + 0] = 0; 
     partialSums[4* id + 1] = 0; 
     partialSums[4* id + 2] = 0; 
     partialSums[4* id + 3] = 0; 
-}
\ No newline at end of file
+
+    // counts gets the pixel count and channel sums of the entry, for the host to reseed
+    // empty entries or to add up the sums of several devices
+    vstore4((uint4)(counter, racc, gacc, bacc), id, counts);
+    // empty entries keep their color; the host moves them elsewhere
+    if(counter == 0)
+    {
+        atomic_inc(convergence + 4);
+        return;
+    }
+    uchar4 previous = colorTable[id];
+    uchar4 entry = (uchar4)(racc / counter, gacc / counter, bacc / counter, 0);
+    colorTable[id] = entry;
+    atomic_max(convergence + 3, squaredDistance(entry, convert_uint4(previous)));
+}
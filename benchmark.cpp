@@ -0,0 +1,162 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "image.h"
+#include "Benchmark.h"
+#include "Quantization.h"
+#include "KMeansCPUQuantization.h"
+#include "KMeansGPUQuantization.h"
+
+// benchmark [--sizes <w>x<h>,...] [--colors <k>,...] [--iterations <n>,...] [--backends <name>,...]
+//           [--repetitions <n>] [--warmup <n>] [--format json|csv] [--output <file>] [--input <png>]
+// Sweeps every combination of image size, palette size, iteration count and backend and
+// reports the statistics of the timed repetitions. Each timed run is init(), the iterations
+// and finalize() of a fresh quantizer; OpenCL engines are created once per kernel file so
+// program builds are not timed. With --input the image is read from the file and --sizes is
+// ignored, otherwise a synthetic image of each size is generated.
+// Backends: cpu-serial, cpu, atomic, reduction, histogram. The OpenCL backends run on the
+// device the engine picks; with POCL as the only ICD that is the CPU device.
+
+std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while(std::getline(stream, item, ','))
+        if(!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+std::vector<unsigned int> splitNumbers(const std::string& list)
+{
+    std::vector<unsigned int> numbers;
+    for(const std::string& item : split(list))
+        numbers.push_back(atoi(item.c_str()));
+    return numbers;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::pair<unsigned int, unsigned int> > sizes = {{256, 256}, {1024, 1024}};
+    std::vector<unsigned int> colorsList = {2, 16, 64, 256};
+    std::vector<unsigned int> iterationsList = {4};
+    std::vector<std::string> backends = {"cpu-serial", "cpu", "atomic", "reduction", "histogram"};
+    unsigned int repetitions = 5;
+    unsigned int warmup = 1;
+    std::string format = "json";
+    std::string outputFilename;
+    std::string inputFilename;
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i], value = argv[i + 1];
+        if(option == "--sizes")
+        {
+            sizes.clear();
+            for(const std::string& size : split(value))
+            {
+                size_t x = size.find('x');
+                unsigned int width = atoi(size.substr(0, x).c_str());
+                unsigned int height = x == std::string::npos ? width : atoi(size.substr(x + 1).c_str());
+                sizes.push_back(std::make_pair(width, height));
+            }
+        }
+        else if(option == "--colors")
+            colorsList = splitNumbers(value);
+        else if(option == "--iterations")
+            iterationsList = splitNumbers(value);
+        else if(option == "--backends")
+            backends = split(value);
+        else if(option == "--repetitions")
+            repetitions = std::max(1, atoi(value.c_str()));
+        else if(option == "--warmup")
+            warmup = atoi(value.c_str());
+        else if(option == "--format")
+            format = value;
+        else if(option == "--output")
+            outputFilename = value;
+        else if(option == "--input")
+            inputFilename = value;
+        else
+        {
+            std::cout<<"unknown option "<<option<<std::endl;
+            return 1;
+        }
+    }
+
+    std::map<std::string, std::string> kernelFilenames = {
+        {"atomic", "atomicAddKernel.cl"}, {"reduction", "parallelReductionKernel.cl"}, {"histogram", "localHistogramKernel.cl"}};
+    std::map<std::string, std::unique_ptr<OpenCLEngine> > engines;
+
+    std::vector<Image> images;
+    if(!inputFilename.empty())
+        images.push_back(readImage(inputFilename));
+    else
+        for(const std::pair<unsigned int, unsigned int>& size : sizes)
+            images.push_back(Benchmark::syntheticImage(size.first, size.second));
+
+    std::vector<BenchmarkResult> results;
+    for(Image& inputImage : images)
+    for(unsigned int colors : colorsList)
+    for(unsigned int iterations : iterationsList)
+    for(const std::string& backend : backends)
+    {
+        if(backend != "cpu-serial" && backend != "cpu" && !kernelFilenames.count(backend))
+        {
+            std::cout<<"unknown backend "<<backend<<std::endl;
+            return 1;
+        }
+        if(kernelFilenames.count(backend) && !engines.count(backend))
+            engines[backend].reset(new OpenCLEngine(kernelFilenames[backend]));
+
+        BenchmarkCase benchmarkCase = {backend, inputImage.details.width, inputImage.details.height, colors, iterations};
+        Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+        std::unique_ptr<Quantization> quantizer;
+
+        results.push_back(Benchmark::run(benchmarkCase, warmup, repetitions, [&](){
+            if(backend == "cpu-serial")
+                quantizer.reset(new KMeansCPUQuantization(&inputImage, &outputImage, colors, 1));
+            else if(backend == "cpu")
+                quantizer.reset(new KMeansCPUQuantization(&inputImage, &outputImage, colors));
+            else
+                quantizer.reset(new KMeansGPUQuantization(engines[backend].get(), &inputImage, &outputImage, colors));
+
+            return std::function<void()>([&quantizer, iterations](){
+                quantizer->init();
+                for(unsigned int i = 0; i < iterations; i++)
+                    quantizer->iterate();
+                quantizer->finalize();
+            });
+        }));
+        quantizer.reset();
+
+        const BenchmarkResult& result = results.back();
+        std::cerr<<backend<<" "<<benchmarkCase.width<<"x"<<benchmarkCase.height<<" K="<<colors<<" n="<<iterations
+            <<" : "<<std::fixed<<std::setprecision(2)<<result.median<<" ms, "<<result.megapixelsPerSecond<<" MP/s"<<std::endl;
+    }
+
+    std::vector<std::pair<std::string, std::string> > context = {
+        {"threads", std::to_string(std::thread::hardware_concurrency())},
+        {"repetitions", std::to_string(repetitions)},
+        {"warmup", std::to_string(warmup)},
+        {"input", inputFilename.empty() ? "synthetic" : inputFilename}};
+    if(!engines.empty())
+        context.push_back(std::make_pair("device", engines.begin()->second->getDeviceKey()));
+
+    std::ofstream file;
+    if(!outputFilename.empty())
+        file.open(outputFilename);
+    std::ostream& out = outputFilename.empty() ? std::cout : file;
+    if(format == "csv")
+        Benchmark::writeCsv(out, results);
+    else
+        Benchmark::writeJson(out, results, context);
+
+    return 0;
+}
@@ -3,16 +3,76 @@
 
 #include <png.h>
 #include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 
 
+// Page aligned storage rounded up to whole pages, so OpenCL can wrap pixels in place with
+// CL_MEM_USE_HOST_PTR: runtimes that share memory with the host only skip the copy for
+// page aligned pointers and sizes.
+template<class T>
+struct PageAlignedAllocator
+{
+    typedef T value_type;
+    static constexpr size_t pageSize = 4096;
+
+    PageAlignedAllocator() {}
+    template<class U> PageAlignedAllocator(const PageAlignedAllocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        size_t size = ((n * sizeof(T) + pageSize - 1) / pageSize) * pageSize;
+#ifdef _WIN32
+        void* p = _aligned_malloc(size, pageSize);
+#else
+        void* p = NULL;
+        if(posix_memalign(&p, pageSize, size) != 0)
+            p = NULL;
+#endif
+        if(!p)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+    template<class U> bool operator==(const PageAlignedAllocator<U>&) const { return true; }
+    template<class U> bool operator!=(const PageAlignedAllocator<U>&) const { return false; }
+};
+
 struct Image
 {
     png_image details;
-    std::vector<unsigned char> data;
+    std::vector<unsigned char, PageAlignedAllocator<unsigned char> > data;
+};
+
+// Quantizer output as an RGB palette of at most 256 entries and one index byte per pixel,
+// row after row; written as a paletted PNG by writeIndexedImage().
+struct IndexedImage
+{
+    static constexpr unsigned int maxColors = 256;
+
+    png_uint_32 width;
+    png_uint_32 height;
+    std::vector<unsigned char> palette;
+    std::vector<unsigned char> indices;
 };
 
 
-Image readImage(std::string filename)
+// Reads only the header, so the size is known before the pixels are decoded by finishReadImage().
+// The pixels are decoded into format, e.g. PNG_FORMAT_GRAY for the CPU quantizer.
+Image readImageHeader(std::string filename, png_uint_32 format = PNG_FORMAT_RGBA)
 {
     Image output;
 
@@ -20,10 +80,22 @@ Image readImage(std::string filename)
     output.details.version = PNG_IMAGE_VERSION;
     int ret;
     ret = png_image_begin_read_from_file(&(output.details), filename.c_str());
-    output.details.format = PNG_FORMAT_RGBA;
+    output.details.format = format;
 
-    output.data.resize(PNG_IMAGE_SIZE(output.details));
-    ret = png_image_finish_read(&(output.details), NULL, output.data.data(), 0/*row_stride*/, NULL/*colormap*/);
+    return std::move(output);
+}
+
+void finishReadImage(Image& image)
+{
+    int ret;
+    image.data.resize(PNG_IMAGE_SIZE(image.details));
+    ret = png_image_finish_read(&(image.details), NULL, image.data.data(), 0/*row_stride*/, NULL/*colormap*/);
+}
+
+Image readImage(std::string filename, png_uint_32 format = PNG_FORMAT_RGBA)
+{
+    Image output = readImageHeader(filename, format);
+    finishReadImage(output);
     
     return std::move(output);
 }
@@ -33,12 +105,12 @@ void writeImage(std::string filename, Image &image)
     png_image_write_to_file(&(image.details), filename.c_str(), 0/*convert_to_8bit*/, image.data.data(), 0/*row_stride*/, NULL/*colormap*/);
 }
 
-Image createBlankImage(int width, int height)
+Image createBlankImage(int width, int height, png_uint_32 format = PNG_FORMAT_RGBA)
 {
     Image output;
     memset(&(output.details), 0, (sizeof output.details));
     output.details.version = PNG_IMAGE_VERSION;
-    output.details.format = PNG_FORMAT_RGBA;
+    output.details.format = format;
     output.details.width = width;
     output.details.height = height;
     output.data.resize(PNG_IMAGE_SIZE(output.details));
@@ -46,4 +118,177 @@ Image createBlankImage(int width, int height)
     return std::move(output);
 }
 
+// Decodes a PNG a few rows at a time as 8-bit RGBA, for images too large to hold in memory.
+// Interlaced files need the whole image for every pass and are rejected by open().
+class PngRowReader
+{
+private:
+    std::FILE* file;
+    png_structp png;
+    png_infop info;
+    png_uint_32 width;
+    png_uint_32 height;
+    png_uint_32 nextRow;
+
+public:
+    PngRowReader() : file(NULL), png(NULL), info(NULL), width(0), height(0), nextRow(0)
+    {
+    }
+
+    ~PngRowReader()
+    {
+        close();
+    }
+
+    PngRowReader(const PngRowReader&) = delete;
+    PngRowReader& operator=(const PngRowReader&) = delete;
+
+    bool open(std::string filename)
+    {
+        close();
+        file = std::fopen(filename.c_str(), "rb");
+        if(!file)
+            return false;
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        info = png ? png_create_info_struct(png) : NULL;
+        if(!info || setjmp(png_jmpbuf(png)))
+        {
+            close();
+            return false;
+        }
+
+        png_init_io(png, file);
+        png_read_info(png, info);
+        if(png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+        {
+            close();
+            return false;
+        }
+
+        png_set_expand(png);
+        png_set_strip_16(png);
+        png_set_gray_to_rgb(png);
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+        png_read_update_info(png, info);
+        width = png_get_image_width(png, info);
+        height = png_get_image_height(png, info);
+        nextRow = 0;
+        return true;
+    }
+
+    png_uint_32 getWidth() const { return width; }
+    png_uint_32 getHeight() const { return height; }
+
+    // Decodes up to rows rows into pixels (4*width bytes each); returns how many were read.
+    png_uint_32 readRows(unsigned char* pixels, png_uint_32 rows)
+    {
+        if(!png || setjmp(png_jmpbuf(png)))
+            return 0;
+
+        rows = std::min(rows, height - nextRow);
+        for(png_uint_32 row = 0; row < rows; row++)
+            png_read_row(png, pixels + 4 * (size_t)width * row, NULL);
+        nextRow += rows;
+        return rows;
+    }
+
+    void close()
+    {
+        if(png)
+            png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+        if(file)
+            std::fclose(file);
+        png = NULL;
+        info = NULL;
+        file = NULL;
+    }
+};
+
+// Encodes an 8-bit RGBA PNG a few rows at a time; close() writes the end of the file.
+class PngRowWriter
+{
+private:
+    std::FILE* file;
+    png_structp png;
+    png_infop info;
+    png_uint_32 width;
+
+public:
+    PngRowWriter() : file(NULL), png(NULL), info(NULL), width(0)
+    {
+    }
+
+    ~PngRowWriter()
+    {
+        close();
+    }
+
+    PngRowWriter(const PngRowWriter&) = delete;
+    PngRowWriter& operator=(const PngRowWriter&) = delete;
+
+    bool open(std::string filename, png_uint_32 width, png_uint_32 height)
+    {
+        close();
+        this->width = width;
+        file = std::fopen(filename.c_str(), "wb");
+        if(!file)
+            return false;
+        png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        info = png ? png_create_info_struct(png) : NULL;
+        if(!info || setjmp(png_jmpbuf(png)))
+        {
+            discard();
+            return false;
+        }
+
+        png_init_io(png, file);
+        png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+        return true;
+    }
+
+    bool writeRows(const unsigned char* pixels, png_uint_32 rows)
+    {
+        if(!png || setjmp(png_jmpbuf(png)))
+            return false;
+
+        for(png_uint_32 row = 0; row < rows; row++)
+            png_write_row(png, pixels + 4 * (size_t)width * row);
+        return true;
+    }
+
+    bool close()
+    {
+        bool written = true;
+        if(png)
+        {
+            if(setjmp(png_jmpbuf(png)))
+            {
+                discard();
+                return false;
+            }
+            png_write_end(png, info);
+            png_destroy_write_struct(&png, &info);
+        }
+        if(file)
+            written = std::fclose(file) == 0;
+        file = NULL;
+        return written;
+    }
+
+private:
+    // drops the libpng state after an error; the partial file stays behind
+    void discard()
+    {
+        if(png)
+            png_destroy_write_struct(&png, info ? &info : NULL);
+        if(file)
+            std::fclose(file);
+        png = NULL;
+        info = NULL;
+        file = NULL;
+    }
+};
+
 #endif // IMAGE_H
\ No newline at end of file
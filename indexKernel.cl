@@ -0,0 +1,26 @@
+// Final remap to 8-bit palette indices instead of RGBA pixels, for paletted output. Built
+// into the same program as the accumulation kernel file and using its colorize() and
+// readPixels(); indices holds one byte per pixel, row after row.
+__kernel void quantizeIndices(
+        __read_only image2d_t image,
+        uint colorTableSize,
+        __constant uchar4* colorTable,
+        __global uchar* indices,
+        uint width,
+        uint height
+)
+{
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
+        return;
+
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint bestIndices[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+    colorize(colorTableSize, colorTable, colors, bestIndices);
+
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+        indices[y * width + x + p] = (uchar)bestIndices[p];
+}
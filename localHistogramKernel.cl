@@ -0,0 +1,205 @@
+__constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
+
+// Every work-item handles PIXELS_PER_ITEM horizontally adjacent pixels (set with -D by the host).
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 1
+#endif
+
+// The palette is padded to uchar4 (the fourth byte is 0), so an entry is one load and a dot product.
+// Every entry is read once per work-item and compared against all of its pixels.
+void colorize(uint colorTableSize, __constant uchar4* colorTable, const float4* colors, uint* bestIndices)
+{
+    float bestValues[PIXELS_PER_ITEM];
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        bestIndices[p] = 0;
+        bestValues[p] = FLT_MAX;
+    }
+
+    for(uint i = 0; i < colorTableSize; i++)
+    {
+        float4 entry = convert_float4(colorTable[i]);
+        for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+        {
+            float4 difference = entry - colors[p];
+            float value = dot(difference, difference);
+            if(value < bestValues[p])
+            {
+                bestValues[p] = value;
+                bestIndices[p] = i;
+            }
+        }
+    }
+}
+
+void readPixels(__read_only image2d_t image, int x, int y, uint4* pixels, float4* colors)
+{
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        pixels[p] = read_imageui(image, sampler, (int2)(x + p, y));
+        colors[p] = (float4)(pixels[p].x, pixels[p].y, pixels[p].z, 0.0f);
+    }
+}
+
+uint squaredDistance(uchar4 entry, uint4 color)
+{
+    int dr = entry.x - (int)color.x;
+    int dg = entry.y - (int)color.y;
+    int db = entry.z - (int)color.z;
+    return dr*dr + dg*dg + db*db;
+}
+
+__kernel void quantize(
+        __read_only image2d_t image,
+        uint colorTableSize,
+        __constant uchar4* colorTable,
+        __write_only image2d_t output,
+        uint width,
+        uint height
+)
+{
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
+    {
+        return;
+    }  
+
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint indices[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+    colorize(colorTableSize, colorTable, colors, indices);
+
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+    {
+        uint4 color = convert_uint4(colorTable[indices[p]]);
+        color.w = pixels[p].w;
+        write_imageui(output, (int2)(x + p, y), color);
+    }
+}
+
+// Each work-group builds a (count, r, g, b) histogram over the palette in local memory with
+// local atomics and writes it out once, instead of running one barrier reduction per entry.
+// localHistogram holds 4*colorTableSize + 2 uints: the histogram, then reassigned and SSE.
+__kernel void accumulate(
+        __read_only image2d_t image,
+        uint colorTableSize,
+        __constant uchar4* colorTable,
+        __global uint* partialSums,
+        __local uint* localHistogram,
+        __global uint* labels,
+        __global uint* convergence,
+        uint width,
+        uint height
+    )
+{
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    const uint localIndex = get_local_id(0) + get_local_size(0) * get_local_id(1);
+    const uint groupSize = get_local_size(0) * get_local_size(1);
+    const uint groupIndex = get_group_id(0) + get_group_id(1) * get_num_groups(0);
+    const uint histogramSize = 4 * colorTableSize;
+    __local uint* localConvergence = localHistogram + histogramSize;
+
+    for(uint i = localIndex; i < histogramSize + 2; i += groupSize)
+        localHistogram[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // items outside the image still have to reach the barriers
+    if(x < width && y < height)
+    {
+        uint4 pixels[PIXELS_PER_ITEM];
+        float4 colors[PIXELS_PER_ITEM];
+        uint indices[PIXELS_PER_ITEM];
+        readPixels(image, x, y, pixels, colors);
+        colorize(colorTableSize, colorTable, colors, indices);
+
+        for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+        {
+            uint4 px = pixels[p];
+            uint bestColorIndex = indices[p];
+
+            uint pixelIndex = x + p + y * width;
+            if(labels[pixelIndex] != bestColorIndex)
+            {
+                labels[pixelIndex] = bestColorIndex;
+                atomic_inc(localConvergence + 0);
+            }
+            atomic_add(localConvergence + 1, squaredDistance(colorTable[bestColorIndex], px));
+
+            atomic_inc(localHistogram + 4*bestColorIndex + 0);
+            atomic_add(localHistogram + 4*bestColorIndex + 1, px.x);
+            atomic_add(localHistogram + 4*bestColorIndex + 2, px.y);
+            atomic_add(localHistogram + 4*bestColorIndex + 3, px.z);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint i = localIndex; i < histogramSize; i += groupSize)
+        partialSums[histogramSize * groupIndex + i] = localHistogram[i];
+
+    if(localIndex == 0)
+    {
+        atomic_add(convergence + 0, localConvergence[0]);
+        uint sseLow = atomic_add(convergence + 1, localConvergence[1]);
+        if(sseLow + localConvergence[1] < sseLow)
+            atomic_inc(convergence + 2);
+    }
+}
+
+// One work-group per palette entry: every item sums a strided subset of the accumulate
+// groups, then the group adds the subsets up with a tree reduction in localSums
+// (4 uints per item, the local size has to be a power of two).
+__kernel void partition(
+        uint colorTableSize,
+        __global uchar4* colorTable,
+        __global uint* partialSums,
+        uint accGroupsNumber,
+        uint accGroupsX,
+        __global uint* convergence,
+        __global uint* counts,
+        __local uint* localSums
+    )
+{
+    uint id = get_group_id(0);
+    uint localIndex = get_local_id(0);
+    uint groupSize = get_local_size(0);
+    if(id >= colorTableSize)
+        return;
+
+    uint4 sum = (uint4)(0, 0, 0, 0);
+    for(uint accGroup = localIndex; accGroup < accGroupsNumber; accGroup += groupSize)
+        sum += vload4(accGroup * colorTableSize + id, partialSums);
+    vstore4(sum, localIndex, localSums);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint stride = groupSize / 2; stride > 0; stride /= 2)
+    {
+        if(localIndex < stride)
+            vstore4(vload4(localIndex, localSums) + vload4(localIndex + stride, localSums), localIndex, localSums);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(localIndex != 0)
+        return;
+
+    uint counter = localSums[0];
+    uint racc = localSums[1];
+    uint gacc = localSums[2];
+    uint bacc = localSums[3];
+
+    // counts gets the pixel count and channel sums of the entry, for the host to reseed
+    // empty entries or to add up the sums of several devices
+    vstore4((uint4)(counter, racc, gacc, bacc), id, counts);
+    // empty entries keep their color; the host moves them elsewhere
+    if(counter == 0)
+    {
+        atomic_inc(convergence + 4);
+        return;
+    }
+    uchar4 previous = colorTable[id];
+    uchar4 entry = (uchar4)(racc / counter, gacc / counter, bacc / counter, 0);
+    colorTable[id] = entry;
+    atomic_max(convergence + 3, squaredDistance(entry, convert_uint4(previous)));
+}
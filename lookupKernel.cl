@@ -0,0 +1,49 @@
+// Remap through a ColorLookup cube, built into the same program as the accumulation kernel
+// file and sharing its sampler, readPixels() and PIXELS_PER_ITEM. cells and candidates are
+// the cube and candidate lists of ColorLookup; ambiguous cells have the top bit set.
+__kernel void quantizeLookup(
+        __read_only image2d_t image,
+        uint colorTableSize,
+        __constant uchar4* colorTable,
+        __global uint* cells,
+        __global uint* candidates,
+        uint bits,
+        __write_only image2d_t output,
+        uint width,
+        uint height
+)
+{
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
+        return;
+
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+
+    const uint shift = 8 - bits;
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+    {
+        uint4 px = pixels[p];
+        uint index = cells[((px.x >> shift) << (2 * bits)) | ((px.y >> shift) << bits) | (px.z >> shift)];
+        if(index & 0x80000000U)
+        {
+            __global uint* list = candidates + (index & 0x7FFFFFFFU);
+            uint bestValue = UINT_MAX;
+            for(uint c = 1; c <= list[0]; c++)
+            {
+                uint value = squaredDistance(colorTable[list[c]], px);
+                if(value < bestValue)
+                {
+                    bestValue = value;
+                    index = list[c];
+                }
+            }
+        }
+
+        uint4 color = convert_uint4(colorTable[index]);
+        color.w = px.w;
+        write_imageui(output, (int2)(x + p, y), color);
+    }
+}
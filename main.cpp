@@ -1,32 +1,579 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <iomanip>
-#include <chrono>
-#include <functional>
+#include <thread>
+#include <memory>
+#include <future>
 
 #include "image.h"
 #include "Quantization.h"
 #include "KMeansCPUQuantization.h"
 #include "KMeansGPUQuantization.h"
+#include "AutoTuner.h"
+#include "TiledQuantization.h"
+#include "MultiDeviceQuantization.h"
+#include "QuantizationService.h"
+#include "PaletteReuse.h"
+#include "PngWriter.h"
+#include "Benchmark.h"
 
-void measure(std::string title, std::function<void()> f)
+// Every timed step of the run; --benchmark writes them out at the end.
+BenchmarkLog benchmarkLog(&std::cout);
+
+// One JSON object per line, so cost and quality of runs can be collected and plotted.
+void writeStats(std::ostream& out, std::string quantizer, std::string phase, unsigned int iteration, PhaseStats stats)
+{
+    out<<std::fixed<<std::setprecision(3)<<"{\"quantizer\": \""<<quantizer<<"\", \"phase\": \""<<phase<<"\", \"iteration\": "<<iteration
+        <<", \"wall_ms\": "<<stats.wallTime<<", \"kernel_ms\": "<<stats.kernelTime<<", \"bytes_transferred\": "<<stats.bytesTransferred
+        <<", \"pixels\": "<<stats.pixelsProcessed<<", \"distance_evaluations\": "<<stats.distanceEvaluations
+        <<", \"sse\": "<<stats.sse<<", \"psnr\": ";
+    if(std::isfinite(stats.psnr))
+        out<<stats.psnr;
+    else
+        out<<"null";
+    out<<", \"empty_clusters\": "<<stats.emptyClusters<<"}"<<std::endl;
+}
+
+// Removes a flag (and its value when value is given) from anywhere on the command line.
+bool takeOption(int& argc, char** argv, std::string name, std::string* value = NULL)
+{
+    int length = value ? 2 : 1;
+    for(int i = 1; i + length - 1 < argc; i++)
+    {
+        if(argv[i] != name)
+            continue;
+        if(value)
+            *value = argv[i + 1];
+        for(int j = i; j + length < argc; j++)
+            argv[j] = argv[j + length];
+        argc -= length;
+        return true;
+    }
+    return false;
+}
+
+int parsePngStrategy(std::string name)
+{
+    if(name == "filtered")
+        return Z_FILTERED;
+    if(name == "huffman")
+        return Z_HUFFMAN_ONLY;
+    if(name == "rle")
+        return Z_RLE;
+    if(name == "fixed")
+        return Z_FIXED;
+    return Z_DEFAULT_STRATEGY;
+}
+
+PngOptions::Filter parsePngFilter(std::string name)
+{
+    if(name == "sub")
+        return PngOptions::Sub;
+    if(name == "up")
+        return PngOptions::Up;
+    if(name == "average")
+        return PngOptions::Average;
+    if(name == "paeth")
+        return PngOptions::Paeth;
+    if(name == "adaptive")
+        return PngOptions::Adaptive;
+    return PngOptions::None;
+}
+
+PaletteSeeding::Strategy parseSeedingStrategy(std::string name)
+{
+    if(name == "kmeans++")
+        return PaletteSeeding::KMeansPlusPlus;
+    if(name == "median-cut")
+        return PaletteSeeding::MedianCut;
+    if(name == "wu")
+        return PaletteSeeding::WuVarianceSplit;
+    return PaletteSeeding::GrayRamp;
+}
+
+// A kernel file of "auto" selects the kernel file and local size stored by --autotune.
+TuningResult resolveConfiguration(std::string kernelFilename)
+{
+    if(kernelFilename == "auto")
+        return AutoTuner().loadOrDefault();
+
+    TuningResult configuration = AutoTuner::defaultConfiguration();
+    configuration.kernelFilename = kernelFilename;
+    return configuration;
+}
+
+// main --autotune <input> <colors> <iterations>
+// Benchmarks every kernel file and local size on the input and stores the fastest for this device.
+int runAutotune(int argc, char** argv)
+{
+    if(argc < 5)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --autotune <input> <colors> <iterations>"<<std::endl;
+        return 1;
+    }
+
+    Image inputImage = readImage(argv[2]);
+    unsigned int colors = atoi(argv[3]);
+    unsigned int iterations = atoi(argv[4]);
+
+    AutoTuner tuner;
+    TuningResult best = tuner.tune(inputImage, colors, iterations);
+    for(const TuningResult& result : tuner.getResults())
+    {
+        std::cout<< std::setw(32)<<result.kernelFilename + " " + std::to_string(result.localWorkSizeX) + "x" + std::to_string(result.localWorkSizeY)
+            <<" : " << std::setw(13)<<std::fixed<<std::setprecision(2)<<result.milliseconds << " ms;"<< std::endl;
+    }
+    std::cout<< std::setw(32)<<"best"<<" : "<<best.kernelFilename<<" "<<best.localWorkSizeX<<"x"<<best.localWorkSizeY<<std::endl;
+    return 0;
+}
+
+// main --tiled <input> <output> <colors> <iterations> [<tile rows> [<seeding>]]
+// Streams the PNG through the CPU quantizer a tile of rows at a time, for images larger than memory.
+int runTiled(int argc, char** argv)
+{
+    if(argc < 6)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --tiled <input> <output> <colors> <iterations> [<tile rows> [<seeding>]]"<<std::endl;
+        return 1;
+    }
+
+    unsigned int colors = atoi(argv[4]);
+    unsigned int iterations = atoi(argv[5]);
+    unsigned int tileRows = argc >= 7 ? atoi(argv[6]) : 256;
+
+    TiledQuantization quantizer(argv[2], argv[3], colors, tileRows);
+    if(argc >= 8)
+        quantizer.setSeedingStrategy(parseSeedingStrategy(argv[7]));
+
+    benchmarkLog.time("tiled/total    ", [&quantizer, &iterations](){
+        benchmarkLog.time("tiled/init     ", [&quantizer](){
+            quantizer.init();
+        });
+        for(unsigned int i = 0; i < iterations; i++)
+        {
+            benchmarkLog.time("tiled/iteration", [&quantizer](){
+                quantizer.iterate();
+            });
+            Convergence convergence = quantizer.convergence();
+            std::cout<< std::setw(32)<<"shift/SSE"<<" : "<<std::setprecision(2)<<convergence.maxCentroidShift<<" / "
+                <<std::setprecision(0)<<convergence.sse<<std::endl;
+        }
+        benchmarkLog.time("tiled/finalize ", [&quantizer](){
+            quantizer.finalize();
+        });
+    });
+    std::cout<< std::setw(32)<<"tiled/tile bytes"<<" : "<<quantizer.getTileBytes()<<std::endl;
+    return 0;
+}
+
+// main --remap <reference> <colors> <iterations> <lookup bits> <input> <output> [<input> <output> ...]
+// Computes one palette on the reference image and maps every input (e.g. the frames of a
+// video) to it through a lookup cube, so each frame costs a table lookup per pixel.
+int runRemap(int argc, char** argv)
+{
+    if(argc < 8)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --remap <reference> <colors> <iterations> <lookup bits> <input> <output> [<input> <output> ...]"<<std::endl;
+        return 1;
+    }
+
+    unsigned int colors = atoi(argv[3]);
+    unsigned int iterations = atoi(argv[4]);
+    unsigned int bits = atoi(argv[5]);
+
+    std::vector<unsigned char> colorTable;
+    benchmarkLog.time("remap/palette", [&argv, &colors, &iterations, &colorTable](){
+        Image referenceImage = readImage(argv[2]);
+        Image outputImage = createBlankImage(referenceImage.details.width, referenceImage.details.height);
+        KMeansCPUQuantization quantizer(&referenceImage, &outputImage, colors);
+        quantizer.init();
+        for(unsigned int i = 0; i < iterations; i++)
+            quantizer.iterate();
+        colorTable = quantizer.getColorTable();
+    });
+
+    ThreadPool threadPool;
+    ColorLookup lookup;
+    benchmarkLog.time("remap/lookup", [&lookup, &colorTable, &colors, &bits, &threadPool](){
+        lookup.build(colorTable.data(), colors, bits, &threadPool);
+    });
+
+    for(int i = 6; i + 1 < argc; i += 2)
+    {
+        Image inputImage = readImage(argv[i]);
+        Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+        benchmarkLog.setCase(inputImage.details.width, inputImage.details.height, colors);
+        benchmarkLog.time(std::string(argv[i]), [&lookup, &inputImage, &outputImage, &threadPool](){
+            lookup.remap(inputImage.data.data(), outputImage.data.data(), (size_t)inputImage.details.width * inputImage.details.height, 4, &threadPool);
+        });
+        writeImage(argv[i + 1], outputImage);
+    }
+    return 0;
+}
+
+// main --multi-device <input> <output> <colors> <iterations> [<kernel file> [<sub-devices> [<host threads>]]]
+// Splits the image across every OpenCL device and host threads (all hardware threads by
+// default, 0 for none). With sub-devices > 1 each device that supports it is partitioned
+// into that many equal sub-devices, e.g. to try the split on a single POCL CPU device.
+int runMultiDevice(int argc, char** argv)
+{
+    if(argc < 6)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --multi-device <input> <output> <colors> <iterations> [<kernel file> [<sub-devices> [<host threads>]]]"<<std::endl;
+        return 1;
+    }
+
+    unsigned int colors = atoi(argv[4]);
+    unsigned int iterations = atoi(argv[5]);
+    std::string kernelFilename = argc >= 7 ? argv[6] : "parallelReductionKernel.cl";
+    unsigned int parts = argc >= 8 ? atoi(argv[7]) : 1;
+    unsigned int hostThreads = argc >= 9 ? atoi(argv[8]) : std::thread::hardware_concurrency();
+
+    std::vector<cl_device_id> devices, subDevices;
+    for(cl_device_id device : OpenCLEngine::allDevices())
+    {
+        std::vector<cl_device_id> parted = OpenCLEngine::subDevices(device, parts);
+        if(parted.empty())
+            devices.push_back(device);
+        devices.insert(devices.end(), parted.begin(), parted.end());
+        subDevices.insert(subDevices.end(), parted.begin(), parted.end());
+    }
+
+    std::vector<std::unique_ptr<OpenCLEngine> > engines;
+    std::vector<OpenCLEngine*> enginePointers;
+    benchmarkLog.time("engine/init", [&](){
+        for(cl_device_id device : devices)
+        {
+            engines.emplace_back(new OpenCLEngine(kernelFilename, OpenCLEngine::defaultCacheDirectory(), OpenCLEngine::defaultPixelsPerItem, device));
+            enginePointers.push_back(engines.back().get());
+        }
+    });
+
+    {
+        Image inputImage = readImage(argv[2]);
+        Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+        MultiDeviceQuantization quantizer(enginePointers, &inputImage, &outputImage, colors, hostThreads);
+        benchmarkLog.setCase(inputImage.details.width, inputImage.details.height, colors);
+
+        benchmarkLog.time("multi/total    ", [&quantizer, &iterations](){
+            benchmarkLog.time("multi/init     ", [&quantizer](){
+                quantizer.init();
+            });
+            for(unsigned int i = 0; i < iterations; i++)
+            {
+                benchmarkLog.time("multi/iteration", [&quantizer](){
+                    quantizer.iterate();
+                });
+                for(const MultiDeviceQuantization::Participant& participant : quantizer.getParticipants())
+                    std::cout<< std::setw(32)<<participant.name<<" : rows "<<participant.rowBegin<<"-"<<participant.rowEnd
+                        <<" in "<<std::fixed<<std::setprecision(2)<<participant.milliseconds<<" ms"<<std::endl;
+            }
+            benchmarkLog.time("multi/finalize ", [&quantizer](){
+                quantizer.finalize();
+            });
+        });
+        writeImage(argv[3], outputImage);
+    }
+
+    engines.clear();
+    for(cl_device_id device : subDevices)
+        clReleaseDevice(device);
+    return 0;
+}
+
+// main --service <cpu workers> <opencl workers> <colors> <iterations> <input> <output> [<input> <output> ...]
+// Submits every pair to a QuantizationService at once, OpenCL workers taking every other
+// image when there are any, and reports queue and run time of each job.
+int runService(int argc, char** argv)
+{
+    if(argc < 8)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --service <cpu workers> <opencl workers> <colors> <iterations> <input> <output> [<input> <output> ...]"<<std::endl;
+        return 1;
+    }
+
+    unsigned int cpuWorkers = atoi(argv[2]);
+    unsigned int openclWorkers = atoi(argv[3]);
+    unsigned int colors = atoi(argv[4]);
+    unsigned int iterations = atoi(argv[5]);
+    unsigned int threadsPerWorker = std::max(1u, std::thread::hardware_concurrency() / std::max(1u, cpuWorkers));
+    QuantizationService service(cpuWorkers, threadsPerWorker, openclWorkers);
+
+    benchmarkLog.time("service/total", [&](){
+        std::vector<std::future<QuantizationResult> > results;
+        for(int i = 6; i + 1 < argc; i += 2)
+        {
+            bool opencl = openclWorkers > 0 && (cpuWorkers == 0 || (i / 2) % 2 == 0);
+            QuantizationJob job = {readImage(argv[i]), Image(), colors, iterations, 0.0f, 0.0,
+                opencl ? QuantizationJob::OpenCL : QuantizationJob::CPU};
+            results.push_back(service.submit(std::move(job)));
+        }
+        for(int i = 6; i + 1 < argc; i += 2)
+        {
+            QuantizationResult result = results[(i - 6) / 2].get();
+            writeImage(argv[i + 1], result.image);
+            std::cout<< std::setw(32)<<argv[i]<<" : queued "<<std::fixed<<std::setprecision(2)<<result.queueTime
+                <<" ms, ran "<<result.runTime<<" ms, "<<result.iterations<<" iterations"<<std::endl;
+        }
+    });
+    return 0;
+}
+
+// main --frames <colors> <iterations> <warm iterations> <min psnr> <input> <output> [<input> <output> ...]
+// Quantizes the inputs as frames of one animation: the palette of each frame seeds the next
+// one, and frames the previous palette already maps to at least <min psnr> dB are only remapped.
+int runFrames(int argc, char** argv)
+{
+    if(argc < 8)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --frames <colors> <iterations> <warm iterations> <min psnr> <input> <output> [<input> <output> ...]"<<std::endl;
+        return 1;
+    }
+
+    unsigned int colors = atoi(argv[2]);
+    ThreadPool threadPool;
+    PaletteReuse reuse(colors, atoi(argv[3]), atoi(argv[4]), atof(argv[5]), 32, 6, &threadPool);
+    KMeansCPUQuantization quantizer(NULL, NULL, colors);
+    const char* decisions[] = {"full run", "warm start", "remap only"};
+
+    for(int i = 6; i + 1 < argc; i += 2)
+    {
+        Image inputImage = readImage(argv[i]);
+        Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+        quantizer.reset(&inputImage, &outputImage, colors);
+        benchmarkLog.setCase(inputImage.details.width, inputImage.details.height, colors);
+        PaletteReuse::FrameResult result;
+        benchmarkLog.time(std::string(argv[i]), [&reuse, &quantizer, &inputImage, &outputImage, &result](){
+            result = reuse.quantize(quantizer, inputImage, outputImage);
+        });
+        std::cout<< std::setw(32)<<decisions[result.decision]<<" : "<<result.iterations<<" iterations, "<<std::fixed<<std::setprecision(2)
+            <<result.psnr<<" dB, "<<result.reusedTiles<<"/"<<result.tiles<<" tiles reused"<<std::endl;
+        writeImage(argv[i + 1], outputImage);
+    }
+    return 0;
+}
+
+// main --batch <kernel file|auto> <colors> <iterations> <input> <output> [<input> <output> ...]
+// Quantizes every pair with one OpenCL engine, so context creation and program build happen once.
+int runBatch(int argc, char** argv)
+{
+    if(argc < 7)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --batch <kernel file|auto> <colors> <iterations> <input> <output> [<input> <output> ...]"<<std::endl;
+        return 1;
+    }
+
+    TuningResult configuration = resolveConfiguration(argv[2]);
+    unsigned int colors = atoi(argv[3]);
+    unsigned int iterations = atoi(argv[4]);
+
+    std::unique_ptr<OpenCLEngine> engine;
+    benchmarkLog.time("engine/init", [&engine, &configuration](){
+        engine.reset(new OpenCLEngine(configuration.kernelFilename));
+    });
+    std::cout<< std::setw(32)<<"engine/program"<<" : "<<(engine->isProgramFromCache() ? "cached binary" : "built from source")<<std::endl;
+
+    for(int i = 5; i + 1 < argc; i += 2)
+    {
+        benchmarkLog.time(std::string(argv[i]), [&engine, &configuration, &colors, &iterations, &argv, &i](){
+            Image inputImage = readImage(argv[i]);
+            Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+
+            KMeansGPUQuantization quantizer(engine.get(), &inputImage, &outputImage, colors, configuration.localWorkSizeX, configuration.localWorkSizeY);
+            quantizer.init();
+            quantizer.runIterations(iterations);
+            quantizer.finalize();
+
+            writeImage(argv[i + 1], outputImage);
+        });
+    }
+
+    return 0;
+}
+
+// main --pipeline <kernel file|auto> <colors> <iterations> <input> <output> [<input> <output> ...]
+// Like --batch, but decodes image N+1 and encodes image N-1 on worker threads while image N
+// is on the device. Decoded pixels are copied into alternating pinned staging buffers and
+// all transfers are asynchronous, so throughput approaches the slowest stage.
+int runPipeline(int argc, char** argv)
+{
+    if(argc < 7)
+    {
+        std::cout<<"usage: "<<argv[0]<<" --pipeline <kernel file|auto> <colors> <iterations> <input> <output> [<input> <output> ...]"<<std::endl;
+        return 1;
+    }
+
+    TuningResult configuration = resolveConfiguration(argv[2]);
+    unsigned int colors = atoi(argv[3]);
+    unsigned int iterations = atoi(argv[4]);
+    std::vector<std::pair<std::string, std::string> > jobs;
+    for(int i = 5; i + 1 < argc; i += 2)
+        jobs.push_back(std::make_pair(argv[i], argv[i + 1]));
+
+    struct Decoding
+    {
+        std::future<Image> image;
+        unsigned char* staging;
+    };
+
+    struct Stage
+    {
+        Image input;
+        Image output;
+        std::unique_ptr<KMeansGPUQuantization> quantizer;
+        std::future<void> encoded;
+    };
+
+    OpenCLEngine engine(configuration.kernelFilename);
+
+    // the header is read here so the staging buffer can be sized before decoding starts
+    auto decode = [&engine](std::string filename, unsigned int slot){
+        Image header = readImageHeader(filename);
+        Decoding decoding;
+        decoding.staging = engine.getStagingBuffer(slot, PNG_IMAGE_SIZE(header.details));
+        unsigned char* staging = decoding.staging;
+        decoding.image = std::async(std::launch::async, [header = std::move(header), staging]() mutable {
+            finishReadImage(header);
+            memcpy(staging, header.data.data(), header.data.size());
+            return std::move(header);
+        });
+        return decoding;
+    };
+
+    benchmarkLog.time("pipeline/total", [&](){
+        Decoding next = decode(jobs[0].first, 0);
+        std::unique_ptr<Stage> previous;
+
+        for(size_t job = 0; job < jobs.size(); job++)
+        {
+            std::unique_ptr<Stage> current(new Stage());
+            current->input = next.image.get();
+            unsigned char* staging = next.staging;
+            if(job + 1 < jobs.size())
+                next = decode(jobs[job + 1].first, (job + 1) % OpenCLEngine::stagingBuffersNumber);
+
+            current->output = createBlankImage(current->input.details.width, current->input.details.height);
+            current->quantizer.reset(new KMeansGPUQuantization(&engine, &current->input, &current->output, colors,
+                configuration.localWorkSizeX, configuration.localWorkSizeY));
+            current->quantizer->setUploadSource(staging);
+            current->quantizer->init();
+            current->quantizer->runIterations(iterations);
+            current->quantizer->enqueueFinalize();
+
+            Stage* stage = current.get();
+            std::string outputFilename = jobs[job].second;
+            current->encoded = std::async(std::launch::async, [stage, outputFilename](){
+                cl_event done = stage->quantizer->getFinalizeEvent();
+                clWaitForEvents(1, &done);
+                writeImage(outputFilename, stage->output);
+            });
+
+            if(previous)
+                previous->encoded.get();
+            previous = std::move(current);
+        }
+
+        if(previous)
+            previous->encoded.get();
+    });
+
+    return 0;
+}
+
+// The default run: every quantizer on one image.
+int runQuantizers(int argc, char** argv);
+
+int run(int argc, char** argv)
 {
-    auto start = std::chrono::high_resolution_clock::now();
-       
-    f();
-       
-    auto finish = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> elapsed = finish - start;
-    std::cout<< std::setw(32)<<title<<" : " << std::setw(13)<<std::fixed<<std::setprecision(2)<<elapsed.count() << " ms;"<< std::endl;
+    if(argc >= 2 && std::string(argv[1]) == "--batch")
+        return runBatch(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--pipeline")
+        return runPipeline(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--autotune")
+        return runAutotune(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--tiled")
+        return runTiled(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--remap")
+        return runRemap(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--multi-device")
+        return runMultiDevice(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--service")
+        return runService(argc, argv);
+    if(argc >= 2 && std::string(argv[1]) == "--frames")
+        return runFrames(argc, argv);
+    return runQuantizers(argc, argv);
 }
 
+// --benchmark <file> (any mode) writes every timed step as a benchmark result, CSV for a
+// .csv file and JSON otherwise, "-" for JSON on stdout. A step repeated under one title,
+// like every iteration, becomes the repetitions of one result.
 int main(int argc, char** argv)
 {
+    std::string benchmarkFilename;
+    bool benchmark = takeOption(argc, argv, "--benchmark", &benchmarkFilename);
+    std::string mode = argc >= 2 && std::string(argv[1]).compare(0, 2, "--") == 0 ? argv[1] + 2 : "quantizers";
+
+    int status = run(argc, argv);
+    if(!benchmark)
+        return status;
+
+    std::ofstream benchmarkFile;
+    std::ostream* out = &std::cout;
+    if(benchmarkFilename != "-")
+    {
+        benchmarkFile.open(benchmarkFilename);
+        out = &benchmarkFile;
+    }
+    bool csv = benchmarkFilename.size() >= 4 && benchmarkFilename.compare(benchmarkFilename.size() - 4, 4, ".csv") == 0;
+    if(csv)
+        Benchmark::writeCsv(*out, benchmarkLog.results());
+    else
+        Benchmark::writeJson(*out, benchmarkLog.results(), {{"mode", mode}});
+    return status;
+}
+
+int runQuantizers(int argc, char** argv)
+{
+    // --stats <file> writes PhaseStats of every phase as JSON lines, "-" to stdout
+    std::ofstream statsFile;
+    std::ostream* statsOut = NULL;
+    std::string statsFilename;
+    if(takeOption(argc, argv, "--stats", &statsFilename))
+    {
+        if(statsFilename == "-")
+            statsOut = &std::cout;
+        else
+        {
+            statsFile.open(statsFilename);
+            statsOut = &statsFile;
+        }
+    }
+    // --zero-copy lets the GPU quantizers work on the image memory itself
+    bool zeroCopy = takeOption(argc, argv, "--zero-copy");
+    // --indexed writes a paletted PNG straight from palette indices; --png-level <0-9>,
+    // --png-strategy <default|filtered|huffman|rle|fixed>, --png-filter <none|sub|up|average|paeth|adaptive>
+    // and --png-chunks <n> (pieces deflated in parallel) tune its compression
+    bool indexed = takeOption(argc, argv, "--indexed");
+    PngOptions pngOptions;
+    std::string pngValue;
+    if(takeOption(argc, argv, "--png-level", &pngValue))
+        pngOptions.level = atoi(pngValue.c_str());
+    if(takeOption(argc, argv, "--png-strategy", &pngValue))
+        pngOptions.strategy = parsePngStrategy(pngValue);
+    if(takeOption(argc, argv, "--png-filter", &pngValue))
+        pngOptions.filter = parsePngFilter(pngValue);
+    if(takeOption(argc, argv, "--png-chunks", &pngValue))
+        pngOptions.chunks = atoi(pngValue.c_str());
 
     std::string inputFilename = "input1.png";
     std::string outputFilename = "output1.png";
     unsigned int colors = 32;
     unsigned int iterations = 3;
+    unsigned int threads = std::thread::hardware_concurrency();
+    float epsilon = 0.0f;
+    PaletteSeeding::Strategy seeding = PaletteSeeding::GrayRamp;
+    size_t miniBatchSize = 0;
 
     if(argc >= 2)
         inputFilename = argv[1];
@@ -36,40 +583,109 @@ int main(int argc, char** argv)
         colors = atoi(argv[3]);
     if(argc >= 5)
         iterations = atoi(argv[4]);
+    if(argc >= 6)
+        threads = atoi(argv[5]);
+    if(argc >= 7)
+        epsilon = atof(argv[6]);
+    if(argc >= 8)
+        seeding = parseSeedingStrategy(argv[7]);
+    if(argc >= 9)
+        miniBatchSize = atoi(argv[8]);
+    if(indexed && colors > IndexedImage::maxColors)
+    {
+        std::cout<<"--indexed needs at most "<<IndexedImage::maxColors<<" colors"<<std::endl;
+        return 1;
+    }
 
     Image inputImage = readImage(inputFilename);
     Image outputImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+    benchmarkLog.setCase(inputImage.details.width, inputImage.details.height, colors);
 
 
     std::vector<std::pair<std::string, Quantization*> > quantizers;
 
-    quantizers.push_back(std::make_pair("CPU", new KMeansCPUQuantization(&inputImage, &outputImage, colors))); 
-    quantizers.push_back(std::make_pair("atomic add GPU", new KMeansGPUQuantization(&inputImage, &outputImage, colors, "atomicAddKernel.cl"))); 
-    quantizers.push_back(std::make_pair("parallel reduction GPU", new KMeansGPUQuantization(&inputImage, &outputImage, colors, "parallelReductionKernel.cl"))); 
+    KMeansCPUQuantization* cpuQuantizer = new KMeansCPUQuantization(&inputImage, &outputImage, colors, threads);
+    KMeansGPUQuantization* atomicQuantizer = new KMeansGPUQuantization(&inputImage, &outputImage, colors, "atomicAddKernel.cl");
+    KMeansGPUQuantization* reductionQuantizer = new KMeansGPUQuantization(&inputImage, &outputImage, colors, "parallelReductionKernel.cl");
+    KMeansGPUQuantization* histogramQuantizer = new KMeansGPUQuantization(&inputImage, &outputImage, colors, "localHistogramKernel.cl");
+    cpuQuantizer->setSeedingStrategy(seeding);
+    atomicQuantizer->setSeedingStrategy(seeding);
+    reductionQuantizer->setSeedingStrategy(seeding);
+    histogramQuantizer->setSeedingStrategy(seeding);
+    cpuQuantizer->setMiniBatch(miniBatchSize);
+    atomicQuantizer->setMiniBatch(miniBatchSize);
+    reductionQuantizer->setMiniBatch(miniBatchSize);
+    histogramQuantizer->setMiniBatch(miniBatchSize);
+    atomicQuantizer->setZeroCopy(zeroCopy);
+    reductionQuantizer->setZeroCopy(zeroCopy);
+    histogramQuantizer->setZeroCopy(zeroCopy);
+    IndexedImage indexedImage;
+    if(indexed)
+    {
+        cpuQuantizer->setIndexedOutput(&indexedImage);
+        atomicQuantizer->setIndexedOutput(&indexedImage);
+        reductionQuantizer->setIndexedOutput(&indexedImage);
+        histogramQuantizer->setIndexedOutput(&indexedImage);
+    }
+
+    quantizers.push_back(std::make_pair("CPU", cpuQuantizer)); 
+    quantizers.push_back(std::make_pair("atomic add GPU", atomicQuantizer)); 
+    quantizers.push_back(std::make_pair("parallel reduction GPU", reductionQuantizer)); 
+    quantizers.push_back(std::make_pair("local histogram GPU", histogramQuantizer));
 
     for(int q = 0; q < quantizers.size(); q++)
     {
-        measure(quantizers[q].first + "/total    ", [&quantizers, &q, &iterations](){
+        benchmarkLog.time(quantizers[q].first + "/total    ", [&quantizers, &q, &iterations, &epsilon, &statsOut](){
 
-            measure(quantizers[q].first+"/init     ", [&quantizers, &q](){
+            benchmarkLog.time(quantizers[q].first+"/init     ", [&quantizers, &q](){
                     quantizers[q].second->init(); 
             });
+            if(statsOut)
+                writeStats(*statsOut, quantizers[q].first, "init", 0, quantizers[q].second->stats());
             for(int i = 0; i < iterations; i++)
             {
-                measure(quantizers[q].first+"/iteration", [&quantizers, &q](){
+                benchmarkLog.time(quantizers[q].first+"/iteration", [&quantizers, &q](){
                         quantizers[q].second->iterate();
                 });
+                if(statsOut)
+                    writeStats(*statsOut, quantizers[q].first, "iterate", i + 1, quantizers[q].second->stats());
+
+                Convergence convergence = quantizers[q].second->convergence();
+                std::cout<< std::setw(32)<<"reassigned/shift/SSE"<<" : "<<convergence.reassignedPixels<<" / "
+                    <<std::setprecision(2)<<convergence.maxCentroidShift<<" / "<<std::setprecision(0)<<convergence.sse<<std::endl;
+                if(convergence.maxCentroidShift < epsilon)
+                    break;
             }
 
-            measure(quantizers[q].first+"/finalize ", [&quantizers, &q](){
+            benchmarkLog.time(quantizers[q].first+"/finalize ", [&quantizers, &q](){
                     quantizers[q].second->finalize();
             });
+            if(statsOut)
+                writeStats(*statsOut, quantizers[q].first, "finalize", 0, quantizers[q].second->stats());
         });
 
+        if(KMeansGPUQuantization* gpuQuantizer = dynamic_cast<KMeansGPUQuantization*>(quantizers[q].second))
+        {
+            std::cout<< std::setw(32)<<"kernels accumulate/partition/quantize"<<" : "<<std::setprecision(2)
+                <<gpuQuantizer->getAccumulateKernelTime()<<" / "<<gpuQuantizer->getPartitionKernelTime()<<" / "
+                <<gpuQuantizer->getQuantizeKernelTime()<<" ms;"<<std::endl;
+        }
+
         delete quantizers[q].second;
     }
 
-    writeImage(outputFilename, outputImage);
+    if(indexed)
+    {
+        ThreadPool threadPool(threads);
+        benchmarkLog.time("encode/indexed", [&outputFilename, &indexedImage, &pngOptions, &threadPool](){
+            if(!writeIndexedImage(outputFilename, indexedImage, pngOptions, &threadPool))
+                std::cout<<"cannot write "<<outputFilename<<std::endl;
+        });
+    }
+    else
+        benchmarkLog.time("encode/rgba", [&outputFilename, &outputImage](){
+            writeImage(outputFilename, outputImage);
+        });
 
     return 0;
 };
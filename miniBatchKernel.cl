@@ -0,0 +1,118 @@
+// Mini-batch k-means, built into the same program as the accumulation kernel file and
+// sharing its sampler and squaredDistance(). The batch is drawn on the device from a hash of
+// the iteration seed and the work-item id, so no sample indices are uploaded.
+
+uint hashUint(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+uint nearestEntry(uint colorTableSize, __constant uchar4* colorTable, float4 color)
+{
+    uint bestIndex = 0;
+    float bestValue = FLT_MAX;
+    for(uint i = 0; i < colorTableSize; i++)
+    {
+        float4 difference = convert_float4(colorTable[i]) - color;
+        float value = dot(difference, difference);
+        if(value < bestValue)
+        {
+            bestValue = value;
+            bestIndex = i;
+        }
+    }
+    return bestIndex;
+}
+
+// One work-item per batch pixel. With stratified sampling item i draws from the i-th of
+// batchSize equal runs of pixels, otherwise from the whole image. Sums go to the first
+// 4*colorTableSize words of partialSums, which miniBatchUpdate clears again.
+__kernel void miniBatchAccumulate(
+        __read_only image2d_t image,
+        uint colorTableSize,
+        __constant uchar4* colorTable,
+        __global uint* partialSums,
+        __global uint* labels,
+        __global uint* convergence,
+        uint width,
+        uint height,
+        uint batchSize,
+        uint stratified,
+        uint seed
+    )
+{
+    uint id = get_global_id(0);
+    if(id >= batchSize)
+        return;
+
+    ulong pixelsNumber = (ulong)width * height;
+    ulong begin = stratified ? (pixelsNumber * id) / batchSize : 0;
+    ulong end = stratified ? (pixelsNumber * (id + 1)) / batchSize : pixelsNumber;
+    uint pixelIndex = begin + hashUint(id ^ hashUint(seed)) % (end - begin);
+
+    uint4 px = read_imageui(image, sampler, (int2)(pixelIndex % width, pixelIndex / width));
+    uint bestColorIndex = nearestEntry(colorTableSize, colorTable, (float4)(px.x, px.y, px.z, 0.0f));
+
+    if(labels[pixelIndex] != bestColorIndex)
+    {
+        labels[pixelIndex] = bestColorIndex;
+        atomic_inc(convergence + 0);
+    }
+    uint error = squaredDistance(colorTable[bestColorIndex], px);
+    uint sseLow = atomic_add(convergence + 1, error);
+    if(sseLow + error < sseLow)
+        atomic_inc(convergence + 2);
+
+    atomic_add(partialSums + 4*bestColorIndex + 0, 1);
+    atomic_add(partialSums + 4*bestColorIndex + 1, px.x);
+    atomic_add(partialSums + 4*bestColorIndex + 2, px.y);
+    atomic_add(partialSums + 4*bestColorIndex + 3, px.z);
+}
+
+// Moves every entry towards the mean of its batch pixels with the learning rate
+// 1 / (pixels seen so far). centers keeps the unrounded float positions between iterations;
+// counts gets the pixels seen so far and the channel sums of the batch.
+__kernel void miniBatchUpdate(
+        uint colorTableSize,
+        __global uchar4* colorTable,
+        __global uint* partialSums,
+        __global float4* centers,
+        __global uint* seen,
+        __global uint* convergence,
+        __global uint* counts
+    )
+{
+    uint id = get_global_id(0);
+    if(id >= colorTableSize)
+        return;
+
+    uint4 sum = vload4(id, partialSums);
+    vstore4((uint4)(0, 0, 0, 0), id, partialSums);
+
+    // only entries that never got a pixel in any batch are dead
+    uint total = seen[id] + sum.x;
+    vstore4((uint4)(total, sum.y, sum.z, sum.w), id, counts);
+    if(total == 0)
+    {
+        atomic_inc(convergence + 4);
+        return;
+    }
+    if(sum.x == 0)
+        return;
+
+    seen[id] = total;
+    float4 center = centers[id];
+    center += (convert_float4((uint4)(sum.y, sum.z, sum.w, 0)) - (float)sum.x * center) / (float)total;
+    centers[id] = center;
+
+    uchar4 previous = colorTable[id];
+    uchar4 entry = convert_uchar4_sat_rte(center);
+    entry.w = 0;
+    colorTable[id] = entry;
+    atomic_max(convergence + 3, squaredDistance(entry, convert_uint4(previous)));
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+
+#include "image.h"
+#include "Quantization.h"
+#include "KMeansCPUQuantization.h"
+#include "MultiDeviceQuantization.h"
+#include "Benchmark.h"
+
+// multiDeviceCheck [<colors> [<iterations> [<kernel file>]]]
+// Quantizes a translucent synthetic image (alpha varies from pixel to pixel) with
+// MultiDeviceQuantization on the host alone and on the host plus every OpenCL device, and
+// with KMeansCPUQuantization. The palette and every output byte, alpha included, have to be
+// the same whatever the row split, so rows moving between participants between iterations
+// must not show. Returns 1 on any difference; without OpenCL devices only the host run is
+// compared with the CPU quantizer.
+
+size_t countDifferences(const Image& a, const Image& b, size_t& alphaDifferences)
+{
+    size_t differences = 0;
+    alphaDifferences = 0;
+    for(size_t i = 0; i < a.data.size(); i++)
+    {
+        if(a.data[i] == b.data[i])
+            continue;
+        differences++;
+        if(i % 4 == 3)
+            alphaDifferences++;
+    }
+    return differences;
+}
+
+template<class Q>
+std::vector<unsigned char> quantize(Q& quantizer, unsigned int iterations)
+{
+    quantizer.init();
+    for(unsigned int i = 0; i < iterations; i++)
+        quantizer.iterate();
+    quantizer.finalize();
+    return quantizer.getColorTable();
+}
+
+bool compare(std::string name, const Image& reference, const Image& output,
+    const std::vector<unsigned char>& referencePalette, const std::vector<unsigned char>& palette)
+{
+    size_t alphaDifferences;
+    size_t differences = countDifferences(reference, output, alphaDifferences);
+    bool samePalette = referencePalette == palette;
+    std::cout<<name<<": palette "<<(samePalette ? "equal" : "different")<<", "<<differences<<" bytes differ, "
+        <<alphaDifferences<<" of them alpha"<<std::endl;
+    return samePalette && differences == 0;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int colors = argc >= 2 ? atoi(argv[1]) : 16;
+    unsigned int iterations = argc >= 3 ? atoi(argv[2]) : 5;
+    std::string kernelFilename = argc >= 4 ? argv[3] : "parallelReductionKernel.cl";
+    unsigned int hostThreads = std::max(2u, std::thread::hardware_concurrency());
+
+    Image inputImage = Benchmark::syntheticImage(257, 193);
+    for(size_t y = 0; y < inputImage.details.height; y++)
+        for(size_t x = 0; x < inputImage.details.width; x++)
+            inputImage.data[4 * (y * inputImage.details.width + x) + 3] = (unsigned char)(x * 13 + y * 7);
+
+    Image cpuImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+    KMeansCPUQuantization cpu(&inputImage, &cpuImage, colors, hostThreads);
+    std::vector<unsigned char> cpuPalette = quantize(cpu, iterations);
+
+    Image hostImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+    MultiDeviceQuantization host(std::vector<OpenCLEngine*>(), &inputImage, &hostImage, colors, hostThreads);
+    std::vector<unsigned char> hostPalette = quantize(host, iterations);
+    bool same = compare("host vs CPU", cpuImage, hostImage, cpuPalette, hostPalette);
+
+    std::vector<std::unique_ptr<OpenCLEngine> > engines;
+    std::vector<OpenCLEngine*> enginePointers;
+    for(cl_device_id device : OpenCLEngine::allDevices())
+    {
+        engines.emplace_back(new OpenCLEngine(kernelFilename, OpenCLEngine::defaultCacheDirectory(), OpenCLEngine::defaultPixelsPerItem, device));
+        enginePointers.push_back(engines.back().get());
+    }
+    if(enginePointers.empty())
+    {
+        std::cout<<"no OpenCL devices, host+device run skipped"<<std::endl;
+        return same ? 0 : 1;
+    }
+
+    Image mixedImage = createBlankImage(inputImage.details.width, inputImage.details.height);
+    {
+        MultiDeviceQuantization mixed(enginePointers, &inputImage, &mixedImage, colors, hostThreads);
+        std::vector<unsigned char> mixedPalette = quantize(mixed, iterations);
+        for(const MultiDeviceQuantization::Participant& participant : mixed.getParticipants())
+            std::cout<<participant.name<<": rows "<<participant.rowBegin<<"-"<<participant.rowEnd<<std::endl;
+        same = compare("host+devices vs host", hostImage, mixedImage, hostPalette, mixedPalette) && same;
+    }
+
+    return same ? 0 : 1;
+}
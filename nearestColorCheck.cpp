@@ -0,0 +1,83 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "PixelLayout.h"
+#include "NearestColor.h"
+
+// nearestColorCheck [<png> ...]
+// Checks that every NearestColorSearch path the CPU supports picks the same palette entry as
+// the scalar reference for every pixel of the images (input1.png and input2.png by default),
+// through find() and findRun(). Palettes are taken from image pixels, so some entries repeat
+// and ties are covered; the sizes include ones that are not multiples of the lane width.
+// Returns 1 on the first image/palette size with a mismatch.
+
+std::vector<unsigned char> samplePalette(const Image& image, unsigned int size)
+{
+    std::vector<unsigned char> palette(3 * size);
+    size_t pixels = (size_t)image.details.width * image.details.height;
+    for(unsigned int i = 0; i < size; i++)
+    {
+        size_t p = (pixels * i / size + 7 * i) % pixels;
+        RGBALayout::read(&image.data[4 * p], palette[3*i + 0], palette[3*i + 1], palette[3*i + 2]);
+    }
+    return palette;
+}
+
+const char* pathName(NearestColorSearch::Path path)
+{
+    return path == NearestColorSearch::AVX2 ? "AVX2" : (path == NearestColorSearch::SSE ? "SSE" : "scalar");
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> filenames = {"input1.png", "input2.png"};
+    if(argc >= 2)
+        filenames.assign(argv + 1, argv + argc);
+    std::vector<unsigned int> sizes = {1, 2, 3, 5, 8, 13, 16, 31, 32, 47, 64, 100, 129, 255, 256};
+
+    NearestColorSearch::Path best = NearestColorSearch::bestAvailablePath();
+    std::vector<NearestColorSearch::Path> paths;
+    for(int path = NearestColorSearch::Scalar; path <= best; path++)
+        paths.push_back((NearestColorSearch::Path)path);
+
+    for(const std::string& filename : filenames)
+    {
+        Image image = readImage(filename);
+        size_t pixels = (size_t)image.details.width * image.details.height;
+        std::vector<unsigned int> expected(pixels), runIndices(pixels);
+
+        for(unsigned int size : sizes)
+        {
+            std::vector<unsigned char> palette = samplePalette(image, size);
+            NearestColorSearch search;
+            search.setPalette(palette.data(), size);
+            for(size_t p = 0; p < pixels; p++)
+            {
+                unsigned char r, g, b;
+                RGBALayout::read(&image.data[4 * p], r, g, b);
+                expected[p] = search.findScalar(r, g, b);
+            }
+
+            for(NearestColorSearch::Path path : paths)
+            {
+                search.setPath(path);
+                search.findRun<RGBALayout>(image.data.data(), pixels, runIndices.data());
+                size_t mismatches = 0;
+                for(size_t p = 0; p < pixels; p++)
+                {
+                    unsigned char r, g, b;
+                    RGBALayout::read(&image.data[4 * p], r, g, b);
+                    if(search.find(r, g, b) != expected[p] || runIndices[p] != expected[p])
+                        mismatches++;
+                }
+                std::cout<<filename<<" K="<<size<<" "<<pathName(path)<<": "<<mismatches<<" mismatches of "<<pixels<<std::endl;
+                if(mismatches)
+                    return 1;
+            }
+        }
+    }
+
+    return 0;
+}
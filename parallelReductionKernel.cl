@@ -1,111 +1,181 @@
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST | CLK_ADDRESS_CLAMP_TO_EDGE;
 
-uint colorize(uint colorTableSize, __global uchar* colorTable, uint4 color)
+// Every work-item handles PIXELS_PER_ITEM horizontally adjacent pixels (set with -D by the host).
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 1
+#endif
+
+// The palette is padded to uchar4 (the fourth byte is 0), so an entry is one load and a dot product.
+// Every entry is read once per work-item and compared against all of its pixels.
+void colorize(uint colorTableSize, __constant uchar4* colorTable, const float4* colors, uint* bestIndices)
 {
-    uint bestIndex = 0;
-    float bestValue = FLT_MAX;
+    float bestValues[PIXELS_PER_ITEM];
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        bestIndices[p] = 0;
+        bestValues[p] = FLT_MAX;
+    }
 
     for(uint i = 0; i < colorTableSize; i++)
     {
-        float value = (colorTable[3*i] - color.x) * (colorTable[3*i] - color.x) +
-                      (colorTable[3*i + 1] - color.y) * (colorTable[3*i + 1] - color.y) +
-                      (colorTable[3*i + 2] - color.z) * (colorTable[3*i + 2] - color.z); 
-        if(value < bestValue)
+        float4 entry = convert_float4(colorTable[i]);
+        for(uint p = 0; p < PIXELS_PER_ITEM; p++)
         {
-            bestValue = value;
-            bestIndex = i;
+            float4 difference = entry - colors[p];
+            float value = dot(difference, difference);
+            if(value < bestValues[p])
+            {
+                bestValues[p] = value;
+                bestIndices[p] = i;
+            }
         }
     }
+}
+
+void readPixels(__read_only image2d_t image, int x, int y, uint4* pixels, float4* colors)
+{
+    for(uint p = 0; p < PIXELS_PER_ITEM; p++)
+    {
+        pixels[p] = read_imageui(image, sampler, (int2)(x + p, y));
+        colors[p] = (float4)(pixels[p].x, pixels[p].y, pixels[p].z, 0.0f);
+    }
+}
 
-    return bestIndex;
+uint squaredDistance(uchar4 entry, uint4 color)
+{
+    int dr = entry.x - (int)color.x;
+    int dg = entry.y - (int)color.y;
+    int db = entry.z - (int)color.z;
+    return dr*dr + dg*dg + db*db;
 }
 
 __kernel void quantize(
         __read_only image2d_t image,
         uint colorTableSize,
-        __global uchar* colorTable,
-        __write_only image2d_t output
+        __constant uchar4* colorTable,
+        __write_only image2d_t output,
+        uint width,
+        uint height
 )
 {
-
-    const int2 dim = get_image_dim(image);
-    const int2 cord;
-    cord.x = get_global_id(0);
-    cord.y = get_global_id(1);
-
-    if(cord.x >= dim.x || cord.y >= dim.y)
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
+    if(x >= width || y >= height)
     {
         return;
     }  
 
-    uint4 px = read_imageui(image, sampler, cord);
-    uint index = colorize(colorTableSize, colorTable, px);
-    uint4 color = (uint4)(colorTable[3*index], colorTable[3*index+1], colorTable[3*index+2], 255);
-    
-    write_imageui(output, cord, color);
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint indices[PIXELS_PER_ITEM];
+    readPixels(image, x, y, pixels, colors);
+    colorize(colorTableSize, colorTable, colors, indices);
+
+    for(uint p = 0; p < PIXELS_PER_ITEM && x + p < width; p++)
+    {
+        uint4 color = convert_uint4(colorTable[indices[p]]);
+        color.w = pixels[p].w;
+        write_imageui(output, (int2)(x + p, y), color);
+    }
 }
 
 __kernel void accumulate(
         __read_only image2d_t image,
         uint colorTableSize,
-        __global uchar* colorTable,
+        __constant uchar4* colorTable,
         __global uint* partialSums,
-        __local uint* localSums
+        __local uint* localSums,
+        __global uint* labels,
+        __global uint* convergence,
+        uint width,
+        uint height
     )
 {
-    const int2 dim = get_image_dim(image);
-    const int2 cord = (int2)(get_global_id(0), get_global_id(1));
-    if(cord.x >= dim.x || cord.y >= dim.y)
-        return;
+    const int x = get_global_id(0) * PIXELS_PER_ITEM;
+    const int y = get_global_id(1);
     const uint2 localId = (uint2)(get_local_id(0), get_local_id(1));
     const uint2 groupId = (uint2)(get_group_id(0), get_group_id(1));
     const uint2 groups = (uint2)(get_num_groups(0), get_num_groups(1));
     const uint2 groupSize = (uint2)(get_local_size(0), get_local_size(1));
 
-    uint4 px = read_imageui(image, sampler, cord);
-    uint bestColorIndex = colorize(colorTableSize, colorTable, px);
+    // items outside the image contribute nothing but still have to reach the barriers
+    uint validPixels = (y < height && x < width) ? min((uint)PIXELS_PER_ITEM, width - x) : 0;
+    uint4 pixels[PIXELS_PER_ITEM];
+    float4 colors[PIXELS_PER_ITEM];
+    uint indices[PIXELS_PER_ITEM];
+    uint reassigned = 0;
+    uint error = 0;
+    if(validPixels > 0)
+    {
+        readPixels(image, x, y, pixels, colors);
+        colorize(colorTableSize, colorTable, colors, indices);
+        for(uint p = 0; p < validPixels; p++)
+        {
+            uint pixelIndex = x + p + y * width;
+            reassigned += (labels[pixelIndex] != indices[p]) ? 1 : 0;
+            error += squaredDistance(colorTable[indices[p]], pixels[p]);
+            labels[pixelIndex] = indices[p];
+        }
+    }
 
+    uint localSumsIndex = localId.x + groupSize.x * localId.y;
     for(uint colorTableIndex = 0; colorTableIndex < colorTableSize; colorTableIndex++ )
     {
-        uint localSumsIndex = localId.x + groupSize.x * localId.y;
-        localSums[4*localSumsIndex] = (bestColorIndex == colorTableIndex) ? 1 : 0; // counter
-        localSums[4*localSumsIndex + 1] = (bestColorIndex == colorTableIndex) ? px.x : 0; //r 
-        localSums[4*localSumsIndex + 2] = (bestColorIndex == colorTableIndex) ? px.y : 0; //g
-        localSums[4*localSumsIndex + 3] = (bestColorIndex == colorTableIndex) ? px.z : 0; //b
+        uint4 sum = (uint4)(0, 0, 0, 0);
+        for(uint p = 0; p < validPixels; p++)
+            if(indices[p] == colorTableIndex)
+                sum += (uint4)(1, pixels[p].x, pixels[p].y, pixels[p].z);
+        vstore4(sum, localSumsIndex, localSums);
 
         barrier(CLK_LOCAL_MEM_FENCE);
 
         for(int stride = (groupSize.x*groupSize.y) / 2; stride > 0; stride /= 2)
         {
             if(localSumsIndex < stride)
-            {
-                localSums[4*localSumsIndex] += localSums[4*(localSumsIndex + stride)];
-                localSums[4*localSumsIndex+1] += localSums[4*(localSumsIndex + stride) + 1];
-                localSums[4*localSumsIndex+2] += localSums[4*(localSumsIndex + stride) + 2];
-                localSums[4*localSumsIndex+3] += localSums[4*(localSumsIndex + stride) + 3];
-            }    
+                vstore4(vload4(localSumsIndex, localSums) + vload4(localSumsIndex + stride, localSums), localSumsIndex, localSums);
             barrier(CLK_LOCAL_MEM_FENCE);
         }
 
-
         if(localSumsIndex == 0)
         {
             uint groupindex = groupId.x + groupId.y * groups.x;
-            partialSums[4*(colorTableSize * groupindex + colorTableIndex) + 0] =  localSums[4*localSumsIndex + 0];
-            partialSums[4*(colorTableSize * groupindex + colorTableIndex) + 1] =  localSums[4*localSumsIndex + 1];
-            partialSums[4*(colorTableSize * groupindex + colorTableIndex) + 2] =  localSums[4*localSumsIndex + 2];
-            partialSums[4*(colorTableSize * groupindex + colorTableIndex) + 3] =  localSums[4*localSumsIndex + 3];
+            vstore4(vload4(0, localSums), colorTableSize * groupindex + colorTableIndex, partialSums);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    localSums[4*localSumsIndex] = reassigned;
+    localSums[4*localSumsIndex + 1] = error;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(int stride = (groupSize.x*groupSize.y) / 2; stride > 0; stride /= 2)
+    {
+        if(localSumsIndex < stride)
+        {
+            localSums[4*localSumsIndex] += localSums[4*(localSumsIndex + stride)];
+            localSums[4*localSumsIndex+1] += localSums[4*(localSumsIndex + stride) + 1];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(localSumsIndex == 0)
+    {
+        atomic_add(convergence + 0, localSums[0]);
+        uint sseLow = atomic_add(convergence + 1, localSums[1]);
+        if(sseLow + localSums[1] < sseLow)
+            atomic_inc(convergence + 2);
     }
 
 }
 
 __kernel void partition(
         uint colorTableSize,
-        __global uchar* colorTable,
+        __global uchar4* colorTable,
         __global uint* partialSums,
         uint accGroupsNumber,
-        uint accGroupsX
+        uint accGroupsX,
+        __global uint* convergence,
+        __global uint* counts
     )
 {
     uint id = get_global_id(0);
@@ -125,9 +195,17 @@ __kernel void partition(
         bacc    += partialSums[4*(accGroup * colorTableSize + id) + 3]; 
     }
 
+    // counts gets the pixel count and channel sums of the entry, for the host to reseed
+    // empty entries or to add up the sums of several devices
+    vstore4((uint4)(counter, racc, gacc, bacc), id, counts);
+    // empty entries keep their color; the host moves them elsewhere
     if(counter == 0)
-        counter = 1;
-    colorTable[3*id    ] = racc / counter;
-    colorTable[3*id + 1] = gacc / counter;
-    colorTable[3*id + 2] = bacc / counter;
+    {
+        atomic_inc(convergence + 4);
+        return;
+    }
+    uchar4 previous = colorTable[id];
+    uchar4 entry = (uchar4)(racc / counter, gacc / counter, bacc / counter, 0);
+    colorTable[id] = entry;
+    atomic_max(convergence + 3, squaredDistance(entry, convert_uint4(previous)));
 }
\ No newline at end of file